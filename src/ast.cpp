@@ -1,9 +1,13 @@
 #include "ast.h"
 
 #include "errors.h"
+#include "sizer.h"
 #include "utils.h"
 
+#include <algorithm>
+#include <numeric>
 #include <stdio.h>
+#include <string.h>
 
 size_t TypeAnnotation::intrinsic_type_index_int;
 size_t TypeAnnotation::intrinsic_type_index_bool;
@@ -104,6 +108,13 @@ void dump_ast(FILE* output, SymbolTable& symbol_table, Ast& ast, size_t index, i
 		if (ast[index].next.has_value())
 			dump_ast(output, symbol_table, ast, ast[index].next.value(), indent);
 	}
+	else if (ast[index].type == AstNodeType::Uninitialised)
+	{
+		fprintf(output, "Uninitialised\n");
+		dump_ast(output, symbol_table, ast, ast[index].child0, indent + 1);
+		if (ast[index].next.has_value())
+			dump_ast(output, symbol_table, ast, ast[index].next.value(), indent);
+	}
 	else if (ast[index].type == AstNodeType::Return)
 	{
 		fprintf(output, "return\n");
@@ -302,7 +313,7 @@ void dump_scope(FILE* output, SymbolTable& symbol_table, size_t index, int inden
 			fprintf(output, "  ");
 		fprintf(output, "%s (type=", variable.name.c_str());
 		pretty_print_type(output, symbol_table, variable.type_annotation);
-		fprintf(output, ", stack_offset=%u)\n", variable.stack_offset);
+		fprintf(output, ", stack_offset=%u, size=%zu)\n", variable.stack_offset, get_data_size(symbol_table, variable.type_annotation));
 	}
 
 	for (size_t child = 0; child < symbol_table.scopes.size(); child++)
@@ -314,6 +325,33 @@ void dump_scope(FILE* output, SymbolTable& symbol_table, size_t index, int inden
 	}
 }
 
+// Lists the members of a struct in memory order with their offsets, and the padding between them
+void dump_struct_layout(FILE* output, SymbolTable& symbol_table, const Type& type)
+{
+	auto& members = symbol_table.scopes[type.scope].local_variables;
+	auto start_of = [&](const Variable& member) { return member.stack_offset - (uint32_t)get_data_size(symbol_table, member.type_annotation); };
+
+	std::vector<size_t> order(members.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return start_of(members[a]) < start_of(members[b]); });
+
+	uint32_t offset = 0;
+	for (auto index : order)
+	{
+		auto& member = members[index];
+		if (start_of(member) > offset)
+			fprintf(output, "    %4u: padding, size=%u\n", offset, start_of(member) - offset);
+
+		fprintf(output, "    %4u: %s (type=", start_of(member), member.name.c_str());
+		pretty_print_type(output, symbol_table, member.type_annotation);
+		fprintf(output, ", size=%zu)\n", get_data_size(symbol_table, member.type_annotation));
+		offset = member.stack_offset;
+	}
+
+	if (type.data_size > offset)
+		fprintf(output, "    %4u: padding, size=%zu\n", offset, type.data_size - offset);
+}
+
 void dump_symbol_table(FILE* output, SymbolTable& symbol_table)
 {
 	fprintf(output, "------ Types ------\n");
@@ -337,11 +375,14 @@ void dump_symbol_table(FILE* output, SymbolTable& symbol_table)
 			internal_error("Unhandled type type in dump_symbol_table\n");
 
 		fprintf(output, "  Size: %zd\n", t.data_size);
+		fprintf(output, "  Alignment: %zd\n", t.alignment);
 
 		if (t.type == TypeType::Struct)
 		{
 			fprintf(output, "  Scope:\n");
 			dump_scope(output, symbol_table, t.scope, 2);
+			fprintf(output, "  Layout:\n");
+			dump_struct_layout(output, symbol_table, t);
 		}
 	}
 
@@ -563,11 +604,12 @@ size_t SymbolTable::find_add_string(const std::string& str)
 	return constant_strings.size() - 1;
 }
 
+// Constants are compared by their bits, so 0.0 and -0.0 are kept apart
 size_t SymbolTable::find_add_float(double value)
 {
 	for (size_t i = 0; i < constant_floats.size(); i++)
 	{
-		if (constant_floats[i] == value)
+		if (memcmp(&constant_floats[i], &value, sizeof(double)) == 0)
 			return i;
 	}
 
@@ -575,6 +617,18 @@ size_t SymbolTable::find_add_float(double value)
 	return constant_floats.size() - 1;
 }
 
+size_t SymbolTable::find_add_float_32(float value)
+{
+	for (size_t i = 0; i < constant_floats_32.size(); i++)
+	{
+		if (memcmp(&constant_floats_32[i], &value, sizeof(float)) == 0)
+			return i;
+	}
+
+	constant_floats_32.emplace_back(value);
+	return constant_floats_32.size() - 1;
+}
+
 void SymbolTable::add_linker_path(const std::string& path, bool is_macos_framework)
 {
 	for (auto& linker_path : linker_paths)
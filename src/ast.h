@@ -71,6 +71,7 @@ enum class AstNodeType
 	Selector,
 	Assignment,
 	ZeroInitialise,
+	Uninitialised,
 	Return,
 	ExpressionStatement,
 	FunctionDefinition,
@@ -133,6 +134,21 @@ struct AstNode
 		size_t function_index;
 	};
 
+	struct DataReturn
+	{
+		bool tail_call; // Marked with #tailcall
+	};
+
+	struct DataLoop
+	{
+		int unroll; // N from #unroll(N), 0 if there isn't one
+	};
+
+	struct DataIf
+	{
+		bool branchless; // Marked with #branchless
+	};
+
 	union
 	{
 		DataLiteralInt data_literal_int;
@@ -142,6 +158,9 @@ struct AstNode
 		DataVariable data_variable;
 		DataFunctionDefinition data_function_definition;
 		DataFunctionCall data_function_call;
+		DataReturn data_return;
+		DataLoop data_loop;
+		DataIf data_if;
 	};
 };
 
@@ -184,6 +203,7 @@ struct Type
 	SourceLocation location; // For printing errors etc
 
 	size_t data_size;
+	size_t alignment = 1;
 
 	// Set for structs
 	size_t scope;
@@ -205,6 +225,13 @@ struct Scope
 	std::optional<size_t> make_variable(SymbolTable& symbol_table, const std::string& name, const TypeAnnotation& type_annotation);
 };
 
+enum class InlineHint
+{
+	Default,
+	Always, // #inline
+	Never   // #noinline
+};
+
 struct Function
 {
 	size_t scope;
@@ -215,8 +242,8 @@ struct Function
 	std::vector<size_t> parameters; // Indices of the parameters in the local variables of the scope
 	bool intrinsic;
 	std::optional<TypeAnnotation> return_type;
-	size_t next_label = 0;
 	bool is_external = false;
+	InlineHint inline_hint = InlineHint::Default;
 };
 
 struct FunctionType
@@ -256,6 +283,7 @@ struct SymbolTable
 	std::vector<FunctionType> function_types;
 	std::vector<ConstantString> constant_strings;
 	std::vector<double> constant_floats;
+	std::vector<float> constant_floats_32;
 	std::vector<LinkerPath> linker_paths;
 
 	std::optional<VariableFindResult> find_variable(size_t scope_index, const std::string& name);
@@ -268,6 +296,7 @@ struct SymbolTable
 
 	size_t find_add_string(const std::string& str);
 	size_t find_add_float(double value);
+	size_t find_add_float_32(float value);
 
 	void add_linker_path(const std::string& path, bool is_macos_framework);
 };
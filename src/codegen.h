@@ -1,8 +1,17 @@
 #pragma once
 
 #include "ast.h"
+#include "ir.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 
-void codegen(SymbolTable& symbol_table, FILE* file, bool is_libc_mode);
\ No newline at end of file
+struct CodegenOptions
+{
+	bool is_libc_mode = false;
+	// Machine level optimisations (the peephole pass and leaf functions without a frame) run
+	// from level 1, and functions which make calls lose the frame pointer at level 2
+	int optimisation_level = 1;
+};
+
+void codegen(SymbolTable& symbol_table, IrProgram& program, FILE* file, const CodegenOptions& options);
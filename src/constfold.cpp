@@ -0,0 +1,366 @@
+#include "optimiser.h"
+
+#include "errors.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <set>
+
+// Sparse conditional constant propagation (Wegman & Zadeck). Every value starts out
+// unknown and is lowered to a constant or to overdefined as the executable parts of
+// the function are evaluated. Blocks are only evaluated once an edge into them is
+// known to be taken, so constants flowing through branches which can never be taken
+// don't make phis overdefined. The folding follows what the instruction selector
+// emits for each operation, e.g. integer compares and division are signed at the operand size.
+
+struct LatticeValue
+{
+	enum class State
+	{
+		Unknown,
+		Constant,
+		Overdefined
+	};
+
+	State state = State::Unknown;
+	int64_t value = 0;
+	double float_value = 0.0;
+
+	bool is_constant() const { return state == State::Constant; }
+};
+
+LatticeValue overdefined()
+{
+	LatticeValue result;
+	result.state = LatticeValue::State::Overdefined;
+	return result;
+}
+
+LatticeValue constant_int(int64_t value)
+{
+	LatticeValue result;
+	result.state = LatticeValue::State::Constant;
+	result.value = value;
+	return result;
+}
+
+LatticeValue constant_float(double value)
+{
+	LatticeValue result;
+	result.state = LatticeValue::State::Constant;
+	result.float_value = value;
+	return result;
+}
+
+bool same_constant(const LatticeValue& a, const LatticeValue& b)
+{
+	return a.value == b.value && memcmp(&a.float_value, &b.float_value, sizeof(double)) == 0;
+}
+
+LatticeValue meet(const LatticeValue& a, const LatticeValue& b)
+{
+	if (a.state == LatticeValue::State::Unknown) return b;
+	if (b.state == LatticeValue::State::Unknown) return a;
+	if (a.is_constant() && b.is_constant() && same_constant(a, b)) return a;
+	return overdefined();
+}
+
+// Integer values are kept zero extended from their size
+int64_t truncate_to_size(int64_t value, int size)
+{
+	if (size >= 8) return value;
+	return value & ((int64_t(1) << (size * 8)) - 1);
+}
+
+int64_t sign_extend_from_size(int64_t value, int size)
+{
+	if (size >= 8) return value;
+	int shift = 64 - size * 8;
+	return (int64_t)((uint64_t)value << shift) >> shift;
+}
+
+LatticeValue fold_int(IrInstruction& instruction, int64_t a, int64_t b)
+{
+	int size = ir_type_size(instruction.type);
+	uint64_t ua = (uint64_t)truncate_to_size(a, size);
+	uint64_t ub = (uint64_t)truncate_to_size(b, size);
+	int64_t sa = sign_extend_from_size(a, size);
+	int64_t sb = sign_extend_from_size(b, size);
+
+	switch (instruction.opcode)
+	{
+		case IrOpcode::Add: return constant_int(truncate_to_size(ua + ub, size));
+		case IrOpcode::Sub: return constant_int(truncate_to_size(ua - ub, size));
+		case IrOpcode::Mul: return constant_int(truncate_to_size(ua * ub, size));
+		case IrOpcode::Div:
+			// Leave division by zero, and the overflow of the most negative value divided by -1, to fault at runtime
+			if (sb == 0 || (sb == -1 && sa == sign_extend_from_size(int64_t(1) << (size * 8 - 1), size))) return overdefined();
+			return constant_int(truncate_to_size(sa / sb, size));
+		case IrOpcode::And: return constant_int(truncate_to_size(ua & ub, size));
+		case IrOpcode::Or: return constant_int(truncate_to_size(ua | ub, size));
+		case IrOpcode::CmpEq: return constant_int(sa == sb);
+		case IrOpcode::CmpNe: return constant_int(sa != sb);
+		case IrOpcode::CmpGt: return constant_int(sa > sb);
+		case IrOpcode::CmpGe: return constant_int(sa >= sb);
+		case IrOpcode::CmpLt: return constant_int(sa < sb);
+		case IrOpcode::CmpLe: return constant_int(sa <= sb);
+		default:
+			internal_error("Unhandled integer operation in constant folding");
+	}
+}
+
+LatticeValue fold_float(IrInstruction& instruction, double a, double b)
+{
+	// comisd and ucomiss report unordered as equal, and as neither greater nor less
+	bool unordered = std::isnan(a) || std::isnan(b);
+
+	// f32 arithmetic is done with the ss instructions, so it's rounded to f32 at each step.
+	// f32 values are held as the double with the same value, so they compare the same either way.
+	if (instruction.type == IrType::F32)
+	{
+		float fa = (float)a;
+		float fb = (float)b;
+		switch (instruction.opcode)
+		{
+			case IrOpcode::Add: return constant_float(fa + fb);
+			case IrOpcode::Sub: return constant_float(fa - fb);
+			case IrOpcode::Mul: return constant_float(fa * fb);
+			case IrOpcode::Div: return constant_float(fa / fb);
+			default: break;
+		}
+	}
+
+	switch (instruction.opcode)
+	{
+		case IrOpcode::Add: return constant_float(a + b);
+		case IrOpcode::Sub: return constant_float(a - b);
+		case IrOpcode::Mul: return constant_float(a * b);
+		case IrOpcode::Div: return constant_float(a / b);
+		case IrOpcode::CmpEq: return constant_int(unordered || a == b);
+		case IrOpcode::CmpNe: return constant_int(!unordered && a != b);
+		case IrOpcode::CmpGt: return constant_int(!unordered && a > b);
+		case IrOpcode::CmpGe: return constant_int(!unordered && a >= b);
+		case IrOpcode::CmpLt: return constant_int(!unordered && a < b);
+		case IrOpcode::CmpLe: return constant_int(!unordered && a <= b);
+		case IrOpcode::Min: return constant_float(a < b ? a : b);
+		case IrOpcode::Max: return constant_float(a > b ? a : b);
+		default:
+			return overdefined();
+	}
+}
+
+LatticeValue evaluate(IrInstruction& instruction, std::vector<LatticeValue>& values)
+{
+	switch (instruction.opcode)
+	{
+		case IrOpcode::Const:
+			return constant_int(instruction.immediate);
+		case IrOpcode::ConstFloat:
+			return constant_float(instruction.float_immediate);
+		case IrOpcode::Convert:
+		{
+			auto& operand = values[instruction.operands[0]];
+			if (!operand.is_constant()) return operand;
+			return constant_float((float)operand.float_value);
+		}
+		case IrOpcode::Add:
+		case IrOpcode::Sub:
+		case IrOpcode::Mul:
+		case IrOpcode::Div:
+		case IrOpcode::And:
+		case IrOpcode::Or:
+		case IrOpcode::CmpEq:
+		case IrOpcode::CmpNe:
+		case IrOpcode::CmpGt:
+		case IrOpcode::CmpGe:
+		case IrOpcode::CmpLt:
+		case IrOpcode::CmpLe:
+		case IrOpcode::Min:
+		case IrOpcode::Max:
+		{
+			auto& a = values[instruction.operands[0]];
+			auto& b = values[instruction.operands[1]];
+
+			// Bools are 0 or 1, so one side decides the result of && and ||
+			if (instruction.opcode == IrOpcode::And && ((a.is_constant() && a.value == 0) || (b.is_constant() && b.value == 0)))
+				return constant_int(0);
+			if (instruction.opcode == IrOpcode::Or && ((a.is_constant() && a.value == 1) || (b.is_constant() && b.value == 1)))
+				return constant_int(1);
+
+			if (a.state == LatticeValue::State::Overdefined || b.state == LatticeValue::State::Overdefined)
+				return overdefined();
+			if (!a.is_constant() || !b.is_constant())
+				return LatticeValue();
+
+			if (is_float_ir_type(instruction.type))
+				return fold_float(instruction, a.float_value, b.float_value);
+			else
+				return fold_int(instruction, a.value, b.value);
+		}
+		case IrOpcode::Select:
+		{
+			// Either value could be picked until the condition is known
+			auto& condition = values[instruction.operands[0]];
+			if (condition.is_constant())
+				return values[instruction.operands[(condition.value & 0xff) != 0 ? 1 : 2]];
+			if (condition.state == LatticeValue::State::Unknown)
+				return LatticeValue();
+			return meet(values[instruction.operands[1]], values[instruction.operands[2]]);
+		}
+		default:
+			return overdefined();
+	}
+}
+
+// Removes the incoming values for the edge from block from the phis in target
+void remove_phi_edge(IrBlock& target, size_t block)
+{
+	for (auto& instruction : target.instructions)
+	{
+		if (instruction.opcode != IrOpcode::Phi)
+			break;
+
+		for (size_t i = 0; i < instruction.phi_blocks.size(); i++)
+		{
+			if (instruction.phi_blocks[i] == block)
+			{
+				instruction.phi_blocks.erase(instruction.phi_blocks.begin() + i);
+				instruction.operands.erase(instruction.operands.begin() + i);
+				break;
+			}
+		}
+	}
+}
+
+bool propagate_constants(IrFunction& function)
+{
+	std::vector<LatticeValue> values(function.value_types.size());
+	std::vector<bool> executable(function.blocks.size());
+	std::set<std::pair<size_t, size_t>> executable_edges;
+
+	executable[0] = true;
+	auto order = reverse_post_order(function);
+
+	// The lattice only ever moves down, so this terminates
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+
+		for (auto b : order)
+		{
+			if (!executable[b]) continue;
+
+			auto& block = function.blocks[b];
+			for (auto& instruction : block.instructions)
+			{
+				if (instruction.dest >= 0)
+				{
+					LatticeValue result;
+					if (instruction.opcode == IrOpcode::Phi)
+					{
+						for (size_t i = 0; i < instruction.operands.size(); i++)
+						{
+							if (executable_edges.count({ instruction.phi_blocks[i], b }) != 0)
+								result = meet(result, values[instruction.operands[i]]);
+						}
+					}
+					else
+						result = evaluate(instruction, values);
+
+					auto& current = values[instruction.dest];
+					LatticeValue lowered = meet(current, result);
+					if (lowered.state != current.state || (lowered.is_constant() && !same_constant(lowered, current)))
+					{
+						current = lowered;
+						changed = true;
+					}
+				}
+
+				if (!is_terminator(instruction.opcode))
+					continue;
+
+				std::vector<size_t> taken;
+				if (instruction.opcode == IrOpcode::Jump)
+					taken.push_back(instruction.targets[0]);
+				else if (instruction.opcode == IrOpcode::Branch)
+				{
+					auto& condition = values[instruction.operands[0]];
+					if (condition.is_constant())
+						taken.push_back(instruction.targets[(condition.value & 0xff) != 0 ? 0 : 1]);
+					else if (condition.state == LatticeValue::State::Overdefined)
+						taken = instruction.targets;
+				}
+
+				for (auto target : taken)
+				{
+					if (executable_edges.insert({ b, target }).second)
+						changed = true;
+					executable[target] = true;
+				}
+			}
+		}
+	}
+
+	// Rewrite constant values and branches
+	bool rewritten = false;
+	for (size_t b = 0; b < function.blocks.size(); b++)
+	{
+		if (!executable[b]) continue;
+
+		auto& instructions = function.blocks[b].instructions;
+		for (auto& instruction : instructions)
+		{
+			if (instruction.dest >= 0 && values[instruction.dest].is_constant()
+				&& instruction.opcode != IrOpcode::Const && instruction.opcode != IrOpcode::ConstFloat)
+			{
+				IrType type = function.value_types[instruction.dest];
+
+				IrInstruction folded;
+				folded.dest = instruction.dest;
+				folded.type = type;
+				if (is_float_ir_type(type))
+				{
+					folded.opcode = IrOpcode::ConstFloat;
+					folded.float_immediate = values[instruction.dest].float_value;
+				}
+				else
+				{
+					folded.opcode = IrOpcode::Const;
+					folded.immediate = values[instruction.dest].value;
+				}
+
+				instruction = folded;
+				rewritten = true;
+			}
+
+			if (instruction.opcode == IrOpcode::Branch && values[instruction.operands[0]].is_constant())
+			{
+				bool condition = (values[instruction.operands[0]].value & 0xff) != 0;
+				size_t taken = instruction.targets[condition ? 0 : 1];
+				size_t not_taken = instruction.targets[condition ? 1 : 0];
+
+				if (not_taken != taken)
+					remove_phi_edge(function.blocks[not_taken], b);
+
+				instruction.opcode = IrOpcode::Jump;
+				instruction.operands.clear();
+				instruction.targets = { taken };
+				rewritten = true;
+			}
+		}
+
+		// Folded phis become ordinary instructions, which go after the remaining phis
+		std::stable_partition(instructions.begin(), instructions.end(), [](IrInstruction& instruction) { return instruction.opcode == IrOpcode::Phi; });
+	}
+
+	if (rewritten)
+	{
+		compute_predecessors(function);
+		remove_unreachable_blocks(function);
+		remove_trivial_phis(function);
+	}
+
+	return rewritten;
+}
@@ -0,0 +1,161 @@
+#include "optimiser.h"
+
+#include "errors.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <optional>
+
+// Dead store elimination. A store, zero or copy into a variable in the frame is removed when
+// nothing reads the bytes it writes before they're written again or the function returns.
+// This drops the zeroing of a declaration which is then assigned, and stores to variables
+// which are never read again.
+//
+// Liveness is tracked for each byte of the frame, so a struct assigned field by field kills
+// the zeroing before it. Variables whose address is taken could be read through a pointer
+// anywhere, so their stores are all kept.
+
+struct DeadStoreFrame
+{
+	// Index of each object's first byte in the live sets, or -1 if it escapes
+	std::vector<int> first_byte;
+	size_t num_bytes = 0;
+};
+
+// Where the bytes of a frame access are in the live sets, or nullopt if the object escapes
+std::optional<std::pair<size_t, size_t>> frame_bytes(IrFunction& function, DeadStoreFrame& frame, const IrAddress& address, int size)
+{
+	int object = address.frame_object;
+	if (object < 0)
+		internal_error("Frame access without a frame object");
+	if (frame.first_byte[object] < 0)
+		return std::nullopt;
+
+	size_t start = frame.first_byte[object] + function.frame_objects[object].stack_offset - address.stack_offset;
+	return std::make_pair(start, start + size);
+}
+
+// Walks a block backwards from the bytes live at its end, leaving the bytes live at its start.
+// Stores which write only dead bytes are added to dead.
+void walk_block(IrFunction& function, DeadStoreFrame& frame, size_t b, std::vector<bool>& live, std::vector<size_t>* dead)
+{
+	auto& instructions = function.blocks[b].instructions;
+	for (size_t i = instructions.size(); i-- > 0;)
+	{
+		auto& instruction = instructions[i];
+
+		if (writes_memory(instruction) && instruction.address.kind == IrAddressKind::Frame)
+		{
+			auto bytes = frame_bytes(function, frame, instruction.address, memory_write_size(instruction));
+			if (bytes.has_value())
+			{
+				auto [start, end] = bytes.value();
+				bool any_live = std::any_of(live.begin() + start, live.begin() + end, [](bool byte) { return byte; });
+				if (!any_live && instruction.opcode != IrOpcode::Call)
+				{
+					// A dead copy doesn't read its source either
+					if (dead)
+						dead->push_back(i);
+					continue;
+				}
+				std::fill(live.begin() + start, live.begin() + end, false);
+			}
+		}
+
+		const IrAddress* read = nullptr;
+		int read_size = 0;
+		if (instruction.opcode == IrOpcode::Load)
+		{
+			read = &instruction.address;
+			read_size = ir_type_size(instruction.type);
+		}
+		else if (instruction.opcode == IrOpcode::Copy)
+		{
+			read = &instruction.source;
+			read_size = (int)instruction.immediate;
+		}
+
+		if (read && read->kind == IrAddressKind::Frame)
+		{
+			auto bytes = frame_bytes(function, frame, *read, read_size);
+			if (bytes.has_value())
+				std::fill(live.begin() + bytes->first, live.begin() + bytes->second, true);
+		}
+	}
+}
+
+bool eliminate_dead_stores(IrFunction& function)
+{
+	auto& objects = function.frame_objects;
+	size_t num_blocks = function.blocks.size();
+
+	DeadStoreFrame frame;
+	frame.first_byte.resize(objects.size(), 0);
+	for (auto& block : function.blocks)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			if (instruction.opcode == IrOpcode::FrameAddress && instruction.address.frame_object >= 0)
+				frame.first_byte[instruction.address.frame_object] = -1;
+		}
+	}
+
+	for (size_t o = 0; o < objects.size(); o++)
+	{
+		if (frame.first_byte[o] < 0)
+			continue;
+		frame.first_byte[o] = (int)frame.num_bytes;
+		frame.num_bytes += objects[o].size;
+	}
+	if (frame.num_bytes == 0)
+		return false;
+
+	// Bytes live at the start of each block. Nothing is live when the function returns.
+	std::vector<std::vector<bool>> live_in(num_blocks, std::vector<bool>(frame.num_bytes));
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (size_t b = num_blocks; b-- > 0;)
+		{
+			std::vector<bool> live(frame.num_bytes);
+			for (auto s : block_successors(function.blocks[b]))
+			{
+				for (size_t byte = 0; byte < frame.num_bytes; byte++)
+					live[byte] = live[byte] || live_in[s][byte];
+			}
+
+			walk_block(function, frame, b, live, nullptr);
+			if (live != live_in[b])
+			{
+				live_in[b] = std::move(live);
+				changed = true;
+			}
+		}
+	}
+
+	bool removed = false;
+	for (size_t b = 0; b < num_blocks; b++)
+	{
+		std::vector<bool> live(frame.num_bytes);
+		for (auto s : block_successors(function.blocks[b]))
+		{
+			for (size_t byte = 0; byte < frame.num_bytes; byte++)
+				live[byte] = live[byte] || live_in[s][byte];
+		}
+
+		std::vector<size_t> dead;
+		walk_block(function, frame, b, live, &dead);
+
+		// The indices are in decreasing order, so erasing one doesn't move the rest
+		auto& instructions = function.blocks[b].instructions;
+		for (auto i : dead)
+		{
+			add_statistic(instructions[i].opcode == IrOpcode::Zero ? "dead-stores.zeroes" : "dead-stores.stores");
+			instructions.erase(instructions.begin() + i);
+			removed = true;
+		}
+	}
+
+	return removed;
+}
@@ -0,0 +1,294 @@
+#include "optimiser.h"
+
+#include "errors.h"
+#include "sizer.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <numeric>
+
+// Stack slot colouring. The sizer gives every variable in a scope its own slot for the whole
+// function, and variables which were promoted to values still have one. This lays the frame
+// out again from the variables which are still accessed, letting variables share memory when
+// they're never live at the same time.
+//
+// A variable is live from a load back to the stores which last wrote all of it. Variables
+// whose address is taken could be accessed through a pointer anywhere, so they're treated as
+// live for the whole function.
+
+struct FrameAccess
+{
+	size_t instruction;
+	int object;
+	bool is_load;
+};
+
+struct SlotBlock
+{
+	std::vector<FrameAccess> accesses;
+	// Instructions where the object is completely written before anything in the block reads
+	// it, which is where it stops being live going backwards
+	std::vector<std::pair<size_t, int>> kills;
+	std::vector<bool> use;
+	std::vector<bool> def;
+};
+
+bool colour_stack_slots(IrFunction& function)
+{
+	auto& objects = function.frame_objects;
+	size_t num_objects = objects.size();
+	size_t num_blocks = function.blocks.size();
+
+	std::vector<bool> accessed(num_objects);
+	std::vector<bool> escapes(num_objects);
+	std::vector<SlotBlock> blocks(num_blocks);
+	for (size_t b = 0; b < num_blocks; b++)
+	{
+		auto& slot_block = blocks[b];
+		slot_block.use.resize(num_objects);
+		slot_block.def.resize(num_objects);
+
+		// Bytes of each object written in this block so far, until something reads it
+		std::vector<std::vector<bool>> written(num_objects);
+		std::vector<size_t> first_write(num_objects);
+
+		auto add_access = [&](size_t i, const IrAddress& address, bool is_load, int size)
+		{
+			int object = address.frame_object;
+			if (object < 0)
+				internal_error("Frame access without a frame object");
+			accessed[object] = true;
+
+			slot_block.accesses.push_back({ i, object, is_load });
+			if (slot_block.use[object] || slot_block.def[object])
+				return;
+
+			if (is_load)
+			{
+				slot_block.use[object] = true;
+				return;
+			}
+
+			auto& bytes = written[object];
+			if (bytes.empty())
+			{
+				bytes.resize(objects[object].size);
+				first_write[object] = i;
+			}
+
+			uint32_t start = objects[object].stack_offset - address.stack_offset;
+			for (int byte = 0; byte < size; byte++)
+				bytes[start + byte] = true;
+
+			if (std::all_of(bytes.begin(), bytes.end(), [](bool byte) { return byte; }))
+			{
+				slot_block.def[object] = true;
+				slot_block.kills.push_back({ first_write[object], object });
+			}
+		};
+
+		auto& instructions = function.blocks[b].instructions;
+		for (size_t i = 0; i < instructions.size(); i++)
+		{
+			auto& instruction = instructions[i];
+
+			// A copy reads all of its source before writing anything
+			if (instruction.source.kind == IrAddressKind::Frame)
+				add_access(i, instruction.source, true, 0);
+
+			if (instruction.address.kind != IrAddressKind::Frame)
+				continue;
+
+			if (instruction.opcode == IrOpcode::FrameAddress)
+			{
+				if (instruction.address.frame_object < 0)
+					internal_error("Frame access without a frame object");
+				accessed[instruction.address.frame_object] = true;
+				escapes[instruction.address.frame_object] = true;
+				continue;
+			}
+
+			bool is_load = instruction.opcode == IrOpcode::Load;
+			add_access(i, instruction.address, is_load, is_load ? 0 : memory_write_size(instruction));
+		}
+	}
+
+	uint32_t old_stack_size = function.stack_size;
+
+	// Liveness of the objects which don't escape, at block boundaries
+	std::vector<std::vector<bool>> live_in(num_blocks, std::vector<bool>(num_objects));
+	std::vector<std::vector<bool>> live_out(num_blocks, std::vector<bool>(num_objects));
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (size_t b = num_blocks; b-- > 0;)
+		{
+			for (auto s : block_successors(function.blocks[b]))
+			{
+				for (size_t o = 0; o < num_objects; o++)
+				{
+					if (live_in[s][o] && !live_out[b][o])
+					{
+						live_out[b][o] = true;
+						changed = true;
+					}
+				}
+			}
+
+			for (size_t o = 0; o < num_objects; o++)
+			{
+				bool in = !escapes[o] && (blocks[b].use[o] || (live_out[b][o] && !blocks[b].def[o]));
+				if (in && !live_in[b][o])
+				{
+					live_in[b][o] = true;
+					changed = true;
+				}
+			}
+		}
+	}
+
+	// Objects interfere when one is accessed while the other is live, or both are live at once.
+	// Escaping objects interfere with everything.
+	std::vector<std::vector<bool>> interferes(num_objects, std::vector<bool>(num_objects));
+	auto add_interference = [&](int a, int b)
+	{
+		interferes[a][b] = true;
+		interferes[b][a] = true;
+	};
+
+	for (size_t o = 0; o < num_objects; o++)
+	{
+		if (!escapes[o] || !accessed[o])
+			continue;
+		for (size_t other = 0; other < num_objects; other++)
+		{
+			if (other != o && accessed[other])
+				add_interference(o, other);
+		}
+	}
+
+	// The two sides of a copy can't partly overlap
+	for (auto& block : function.blocks)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			if (instruction.opcode == IrOpcode::Copy && instruction.address.kind == IrAddressKind::Frame
+				&& instruction.source.kind == IrAddressKind::Frame && instruction.address.frame_object != instruction.source.frame_object)
+				add_interference(instruction.address.frame_object, instruction.source.frame_object);
+		}
+	}
+
+	for (size_t b = 0; b < num_blocks; b++)
+	{
+		std::vector<bool> live = live_out[b];
+		for (size_t o = 0; o < num_objects; o++)
+		{
+			for (size_t other = o + 1; other < num_objects && live[o]; other++)
+			{
+				if (live[other])
+					add_interference(o, other);
+			}
+		}
+
+		// Walk the accesses backwards, so the live set is what's live after each one
+		auto& slot_block = blocks[b];
+		for (size_t a = slot_block.accesses.size(); a-- > 0;)
+		{
+			auto& access = slot_block.accesses[a];
+			for (size_t other = 0; other < num_objects; other++)
+			{
+				if (live[other] && (int)other != access.object)
+					add_interference(access.object, other);
+			}
+
+			for (auto [kill_instruction, object] : slot_block.kills)
+			{
+				if (kill_instruction == access.instruction && object == access.object)
+					live[object] = false;
+			}
+			if (access.is_load && !escapes[access.object])
+				live[access.object] = true;
+		}
+	}
+
+	// Place the largest objects first, each at the lowest offset clear of every object it
+	// interferes with
+	std::vector<size_t> order;
+	for (size_t o = 0; o < num_objects; o++)
+	{
+		if (accessed[o])
+			order.push_back(o);
+	}
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return objects[a].size > objects[b].size; });
+
+	std::vector<uint32_t> new_offsets(num_objects);
+	std::vector<bool> placed(num_objects);
+	uint32_t new_stack_size = 0;
+	for (auto o : order)
+	{
+		auto& object = objects[o];
+
+		std::vector<uint32_t> candidates = { align_up(object.size, object.alignment) };
+		for (auto other : order)
+		{
+			if (placed[other] && interferes[o][other])
+				candidates.push_back(align_up(new_offsets[other] + object.size, object.alignment));
+		}
+		std::sort(candidates.begin(), candidates.end());
+
+		for (auto candidate : candidates)
+		{
+			bool clear = true;
+			for (auto other : order)
+			{
+				if (!placed[other] || !interferes[o][other])
+					continue;
+
+				// Each object covers (offset - size, offset] below the frame base
+				uint32_t other_low = new_offsets[other] - objects[other].size;
+				if (candidate > other_low && candidate - object.size < new_offsets[other])
+					clear = false;
+			}
+
+			if (clear)
+			{
+				new_offsets[o] = candidate;
+				break;
+			}
+		}
+
+		placed[o] = true;
+		new_stack_size = std::max(new_stack_size, new_offsets[o]);
+	}
+	new_stack_size = align_up(new_stack_size, 16);
+
+	bool moved = new_stack_size != old_stack_size;
+	for (auto& block : function.blocks)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			for (auto address : { &instruction.address, &instruction.source })
+			{
+				if (address->kind != IrAddressKind::Frame)
+					continue;
+
+				auto& object = objects[address->frame_object];
+				uint32_t new_offset = address->stack_offset - object.stack_offset + new_offsets[address->frame_object];
+				moved |= new_offset != address->stack_offset;
+				address->stack_offset = new_offset;
+			}
+		}
+	}
+
+	for (size_t o = 0; o < num_objects; o++)
+	{
+		if (accessed[o])
+			objects[o].stack_offset = new_offsets[o];
+	}
+	function.stack_size = new_stack_size;
+
+	add_statistic("stack-slots.frame-bytes-before", old_stack_size);
+	add_statistic("stack-slots.frame-bytes-after", new_stack_size);
+	return moved;
+}
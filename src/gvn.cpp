@@ -0,0 +1,290 @@
+#include "optimiser.h"
+
+#include "errors.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <tuple>
+
+// Global value numbering. Walks the dominator tree keeping the expressions computed so far, and
+// replaces an instruction with an earlier one computing the same thing from the same values.
+// Each value gets a number, the value which first computed it, so a + b and b + a match, and so
+// do equal constants (which are left where they are, since they end up as immediates).
+//
+// Loads are also numbered, as the value at their address, until something might write to it.
+// A store gives the value at its address, so a load after it gets the stored value. Loads only
+// carry on into a block whose only predecessor is its dominator, where memory is as it was at the
+// end of the dominator; at a join it could have been written on the other path.
+
+struct ValueKey
+{
+	IrOpcode opcode;
+	IrType type;
+	std::vector<int> operands; // Value numbers
+	int64_t immediate;
+	uint64_t float_bits;
+	std::string symbol;
+	IrAddressKind address_kind;
+	uint32_t stack_offset;
+	std::string address_symbol;
+
+	bool operator<(const ValueKey& other) const
+	{
+		return std::tie(opcode, type, operands, immediate, float_bits, symbol, address_kind, stack_offset, address_symbol)
+			< std::tie(other.opcode, other.type, other.operands, other.immediate, other.float_bits, other.symbol,
+				other.address_kind, other.stack_offset, other.address_symbol);
+	}
+};
+
+struct ValueNumbering
+{
+	ValueNumbering(IrFunction& function) : function(function) {}
+
+	IrFunction& function;
+	std::vector<size_t> idom;
+	std::vector<std::vector<size_t>> dominated;
+	bool frame_escapes = false;
+
+	// The value which first computed each value, or the value itself
+	std::vector<int> numbers;
+	std::vector<int> replacements;
+
+	// Pure expressions available in the current block, from it and its dominators
+	std::map<ValueKey, int> expressions;
+	// Loads (and stores, as loads of what they stored) at the end of each block
+	std::vector<std::map<ValueKey, int>> block_loads;
+	std::map<ValueKey, int> constants;
+};
+
+bool is_numbered(IrOpcode opcode)
+{
+	switch (opcode)
+	{
+		case IrOpcode::SymbolAddress:
+		case IrOpcode::FrameAddress:
+		case IrOpcode::Add:
+		case IrOpcode::Sub:
+		case IrOpcode::Mul:
+		case IrOpcode::Div:
+		case IrOpcode::And:
+		case IrOpcode::Or:
+		case IrOpcode::CmpEq:
+		case IrOpcode::CmpNe:
+		case IrOpcode::CmpGt:
+		case IrOpcode::CmpGe:
+		case IrOpcode::CmpLt:
+		case IrOpcode::CmpLe:
+		case IrOpcode::Convert:
+		case IrOpcode::Select:
+		case IrOpcode::Min:
+		case IrOpcode::Max:
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool is_commutative(IrOpcode opcode)
+{
+	return opcode == IrOpcode::Add || opcode == IrOpcode::Mul || opcode == IrOpcode::And || opcode == IrOpcode::Or
+		|| opcode == IrOpcode::CmpEq || opcode == IrOpcode::CmpNe;
+}
+
+ValueKey key_for(ValueNumbering& numbering, const IrInstruction& instruction)
+{
+	ValueKey key;
+	key.opcode = instruction.opcode;
+	key.type = instruction.type;
+	for (auto operand : instruction.operands)
+		key.operands.push_back(numbering.numbers[operand]);
+	if (is_commutative(instruction.opcode))
+		std::sort(key.operands.begin(), key.operands.end());
+
+	key.immediate = instruction.immediate;
+	std::memcpy(&key.float_bits, &instruction.float_immediate, sizeof(key.float_bits));
+	key.symbol = instruction.symbol;
+	key.address_kind = instruction.address.kind;
+	key.stack_offset = instruction.address.stack_offset;
+	key.address_symbol = instruction.address.symbol;
+	return key;
+}
+
+// The key of a load of type from the address of a load or store. A store's pointer is its last operand
+ValueKey load_key(ValueNumbering& numbering, const IrInstruction& instruction, IrType type)
+{
+	ValueKey key = {};
+	key.opcode = IrOpcode::Load;
+	key.type = type;
+	if (instruction.address.kind == IrAddressKind::Pointer)
+		key.operands.push_back(numbering.numbers[instruction.operands.back()]);
+	key.address_kind = instruction.address.kind;
+	key.stack_offset = instruction.address.stack_offset;
+	key.address_symbol = instruction.address.symbol;
+	return key;
+}
+
+// Forgets the loads which a write of size bytes to address (or a call, if address is null) might change
+void invalidate_loads(ValueNumbering& numbering, std::map<ValueKey, int>& loads, const IrAddress* address, int size)
+{
+	// Pointers can point at globals, and at the frame when its address is taken. Calls can
+	// write to all of those.
+	auto reachable = [&](IrAddressKind kind) { return kind != IrAddressKind::Frame || numbering.frame_escapes; };
+
+	for (auto it = loads.begin(); it != loads.end();)
+	{
+		auto& load = it->first;
+
+		bool may_alias;
+		if (!address || address->kind == IrAddressKind::Pointer)
+			may_alias = reachable(load.address_kind);
+		else if (load.address_kind == IrAddressKind::Pointer)
+			may_alias = reachable(address->kind);
+		else if (address->kind != load.address_kind)
+			may_alias = false;
+		else if (address->kind == IrAddressKind::Global)
+			may_alias = address->symbol == load.address_symbol;
+		else
+			may_alias = frame_ranges_overlap(load.stack_offset, ir_type_size(load.type), address->stack_offset, size);
+
+		if (may_alias)
+			it = loads.erase(it);
+		else
+			++it;
+	}
+}
+
+// Numbers the instructions of a block, returning the expressions it made available
+std::vector<ValueKey> number_block(ValueNumbering& numbering, size_t b)
+{
+	auto& function = numbering.function;
+	auto& block = function.blocks[b];
+
+	// Memory is as the dominator left it when it's the only way in
+	std::map<ValueKey, int> loads;
+	if (b != 0 && block.predecessors.size() == 1 && block.predecessors[0] == numbering.idom[b])
+		loads = numbering.block_loads[numbering.idom[b]];
+
+	std::vector<ValueKey> added;
+	for (auto& instruction : block.instructions)
+	{
+		if (instruction.dest >= 0)
+			numbering.numbers[instruction.dest] = instruction.dest;
+
+		if (instruction.opcode == IrOpcode::Const || instruction.opcode == IrOpcode::ConstFloat)
+		{
+			// Equal constants get the same number, but stay where they are
+			auto [it, inserted] = numbering.constants.insert({ key_for(numbering, instruction), instruction.dest });
+			numbering.numbers[instruction.dest] = it->second;
+		}
+		else if (is_numbered(instruction.opcode))
+		{
+			auto key = key_for(numbering, instruction);
+			auto it = numbering.expressions.find(key);
+			if (it != numbering.expressions.end())
+			{
+				numbering.replacements[instruction.dest] = it->second;
+				numbering.numbers[instruction.dest] = numbering.numbers[it->second];
+				add_statistic("gvn.expressions");
+			}
+			else
+			{
+				numbering.expressions[key] = instruction.dest;
+				added.push_back(key);
+			}
+		}
+		else if (instruction.opcode == IrOpcode::Load)
+		{
+			auto key = load_key(numbering, instruction, instruction.type);
+			auto it = loads.find(key);
+			if (it != loads.end())
+			{
+				numbering.replacements[instruction.dest] = it->second;
+				numbering.numbers[instruction.dest] = numbering.numbers[it->second];
+				add_statistic("gvn.loads");
+			}
+			else
+				loads[key] = instruction.dest;
+		}
+		else if (instruction.opcode == IrOpcode::Call || instruction.opcode == IrOpcode::TailCall)
+		{
+			invalidate_loads(numbering, loads, nullptr, 0);
+			if (writes_memory(instruction))
+				invalidate_loads(numbering, loads, &instruction.address, memory_write_size(instruction));
+		}
+		else if (writes_memory(instruction))
+		{
+			invalidate_loads(numbering, loads, &instruction.address, memory_write_size(instruction));
+			if (instruction.opcode == IrOpcode::Store)
+				loads[load_key(numbering, instruction, instruction.type)] = instruction.operands[0];
+		}
+	}
+
+	numbering.block_loads[b] = std::move(loads);
+	return added;
+}
+
+// Walks the dominator tree depth first. The tree can be as deep as the function is long, so
+// this keeps its own stack rather than recursing
+void number_dominator_tree(ValueNumbering& numbering)
+{
+	struct Visit
+	{
+		size_t block;
+		size_t next_child;
+		std::vector<ValueKey> added;
+	};
+
+	std::vector<Visit> stack;
+	stack.push_back({ 0, 0, number_block(numbering, 0) });
+	while (!stack.empty())
+	{
+		auto& visit = stack.back();
+		auto& children = numbering.dominated[visit.block];
+		if (visit.next_child < children.size())
+		{
+			size_t child = children[visit.next_child++];
+			stack.push_back({ child, 0, number_block(numbering, child) });
+			continue;
+		}
+
+		// The expressions from this block aren't available in the blocks it doesn't dominate
+		for (auto& key : visit.added)
+			numbering.expressions.erase(key);
+		numbering.block_loads[visit.block].clear();
+		stack.pop_back();
+	}
+}
+
+bool eliminate_common_subexpressions(IrFunction& function)
+{
+	ValueNumbering numbering(function);
+	numbering.idom = compute_dominators(function);
+	numbering.dominated.resize(function.blocks.size());
+	for (size_t b = 1; b < function.blocks.size(); b++)
+	{
+		if (numbering.idom[b] != SIZE_MAX)
+			numbering.dominated[numbering.idom[b]].push_back(b);
+	}
+	numbering.frame_escapes = frame_may_escape(function);
+	numbering.numbers.resize(function.value_types.size(), -1);
+	numbering.replacements.resize(function.value_types.size(), -1);
+	numbering.block_loads.resize(function.blocks.size());
+
+	number_dominator_tree(numbering);
+
+	bool changed = false;
+	for (auto& block : function.blocks)
+	{
+		auto& instructions = block.instructions;
+		auto removed = std::remove_if(instructions.begin(), instructions.end(),
+			[&](IrInstruction& instruction) { return instruction.dest >= 0 && numbering.replacements[instruction.dest] >= 0; });
+		changed |= removed != instructions.end();
+		instructions.erase(removed, instructions.end());
+	}
+
+	if (changed)
+		replace_values(function, numbering.replacements);
+	return changed;
+}
@@ -0,0 +1,247 @@
+#include "optimiser.h"
+
+#include "errors.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <optional>
+
+// If-conversion. When the arms of a branch only compute values for the phis where they join,
+// and nothing in them can fault or be seen from outside, both arms are run and the phis
+// become selects, which are conditional moves rather than a branch which can be mispredicted.
+// Diamonds (if with else) and triangles (if without else, where one side comes straight from
+// the branch) are converted.
+//
+// Running both arms costs their instructions on every path, so only arms which fit in a small
+// budget are converted, unless the if is marked #branchless. Float phis are only converted when
+// they pick the smaller or larger of the two values which were compared, which is minsd or
+// maxsd; there's no conditional move for xmm registers.
+
+constexpr int speculation_budget = 6;             // Arm instructions plus selects
+constexpr int branchless_speculation_budget = 64;
+
+// Whether an instruction can run when the branch wouldn't have gone its way
+bool can_speculate(const IrInstruction& instruction, const std::vector<const IrInstruction*>& definitions)
+{
+	switch (instruction.opcode)
+	{
+		case IrOpcode::Const:
+		case IrOpcode::ConstFloat:
+		case IrOpcode::SymbolAddress:
+		case IrOpcode::FrameAddress:
+		case IrOpcode::Add:
+		case IrOpcode::Sub:
+		case IrOpcode::Mul:
+		case IrOpcode::And:
+		case IrOpcode::Or:
+		case IrOpcode::CmpEq:
+		case IrOpcode::CmpNe:
+		case IrOpcode::CmpGt:
+		case IrOpcode::CmpGe:
+		case IrOpcode::CmpLt:
+		case IrOpcode::CmpLe:
+		case IrOpcode::Convert:
+		case IrOpcode::Select:
+		case IrOpcode::Min:
+		case IrOpcode::Max:
+			return true;
+		case IrOpcode::Div:
+		{
+			// Integer division faults on zero, and on overflow dividing by -1
+			if (is_float_ir_type(instruction.type))
+				return true;
+			auto* divisor = definitions[instruction.operands[1]];
+			return divisor && divisor->opcode == IrOpcode::Const && divisor->immediate != 0
+				&& sign_extend_from_size(divisor->immediate, ir_type_size(instruction.type)) != -1;
+		}
+		case IrOpcode::Load:
+			// The frame and globals are always there, but a pointer might not be valid
+			return instruction.address.kind != IrAddressKind::Pointer;
+		default:
+			return false;
+	}
+}
+
+// The instruction which picks between the phi's values, or nullopt if it can't be converted
+std::optional<IrInstruction> select_for_phi(const IrInstruction& phi, int condition, int if_true, int if_false,
+	const std::vector<const IrInstruction*>& definitions)
+{
+	IrInstruction select;
+	select.dest = phi.dest;
+	select.type = phi.type;
+
+	if (!is_float_ir_type(phi.type))
+	{
+		select.opcode = IrOpcode::Select;
+		select.operands = { condition, if_true, if_false };
+		return select;
+	}
+
+	// a < b ? a : b is min(a, b), a < b ? b : a is max(b, a), and the same the other way round for >
+	auto* compare = definitions[condition];
+	if (!compare || (compare->opcode != IrOpcode::CmpLt && compare->opcode != IrOpcode::CmpGt) || compare->type != phi.type)
+		return std::nullopt;
+
+	int a = compare->operands[0];
+	int b = compare->operands[1];
+	bool less = compare->opcode == IrOpcode::CmpLt;
+	if (if_true == a && if_false == b)
+	{
+		select.opcode = less ? IrOpcode::Min : IrOpcode::Max;
+		select.operands = { a, b };
+	}
+	else if (if_true == b && if_false == a)
+	{
+		select.opcode = less ? IrOpcode::Max : IrOpcode::Min;
+		select.operands = { b, a };
+	}
+	else
+		return std::nullopt;
+
+	return select;
+}
+
+// Converts the branch at the end of block b, if it's the head of a diamond or triangle
+bool convert_branch(IrFunction& function, size_t b, const std::vector<const IrInstruction*>& definitions)
+{
+	auto& branch = function.blocks[b].terminator();
+	if (branch.opcode != IrOpcode::Branch || branch.targets[0] == branch.targets[1])
+		return false;
+
+	// An arm is only reached from the branch, and jumps on to the join
+	auto is_arm = [&](size_t a)
+	{
+		auto& arm = function.blocks[a];
+		return a != b && arm.predecessors.size() == 1 && arm.terminator().opcode == IrOpcode::Jump;
+	};
+	auto jump_target = [&](size_t a) { return function.blocks[a].terminator().targets[0]; };
+
+	size_t true_target = branch.targets[0];
+	size_t false_target = branch.targets[1];
+	size_t join;
+	std::vector<size_t> arms;
+	if (is_arm(true_target) && is_arm(false_target) && jump_target(true_target) == jump_target(false_target))
+	{
+		join = jump_target(true_target);
+		arms = { true_target, false_target };
+	}
+	else if (is_arm(true_target) && jump_target(true_target) == false_target)
+	{
+		join = false_target;
+		arms = { true_target };
+	}
+	else if (is_arm(false_target) && jump_target(false_target) == true_target)
+	{
+		join = true_target;
+		arms = { false_target };
+	}
+	else
+		return false;
+
+	auto& join_block = function.blocks[join];
+	if (join == b || join_block.predecessors.size() != 2 || std::find(arms.begin(), arms.end(), join) != arms.end())
+		return false;
+
+	int cost = 0;
+	for (auto a : arms)
+	{
+		auto& instructions = function.blocks[a].instructions;
+		for (size_t i = 0; i + 1 < instructions.size(); i++)
+		{
+			if (instructions[i].opcode == IrOpcode::Phi || !can_speculate(instructions[i], definitions))
+				return false;
+			if (instructions[i].opcode != IrOpcode::Const)
+				cost++;
+		}
+	}
+
+	// Where each side of the branch comes into the join from
+	size_t true_edge = arms[0] == true_target ? true_target : b;
+	size_t false_edge = arms.back() == false_target ? false_target : b;
+
+	int condition = branch.operands[0];
+	std::vector<IrInstruction> selects;
+	for (auto& instruction : join_block.instructions)
+	{
+		if (instruction.opcode != IrOpcode::Phi)
+			break;
+
+		int if_true = -1;
+		int if_false = -1;
+		for (size_t i = 0; i < instruction.operands.size(); i++)
+		{
+			if (instruction.phi_blocks[i] == true_edge)
+				if_true = instruction.operands[i];
+			else if (instruction.phi_blocks[i] == false_edge)
+				if_false = instruction.operands[i];
+		}
+		if (if_true < 0 || if_false < 0)
+			internal_error("Phi is missing an incoming value");
+
+		auto select = select_for_phi(instruction, condition, if_true, if_false, definitions);
+		if (!select.has_value())
+			return false;
+		selects.push_back(select.value());
+		cost++;
+	}
+
+	if (cost > (join_block.branchless_hint ? branchless_speculation_budget : speculation_budget))
+		return false;
+
+	// Run the arms at the end of the head, then go straight to the join
+	auto& head = function.blocks[b].instructions;
+	head.pop_back();
+	for (auto a : arms)
+	{
+		auto& instructions = function.blocks[a].instructions;
+		head.insert(head.end(), std::make_move_iterator(instructions.begin()), std::make_move_iterator(instructions.end() - 1));
+
+		// The arm is unreachable now, leave it jumping to itself until it's removed
+		instructions.clear();
+		auto& self_jump = instructions.emplace_back();
+		self_jump.opcode = IrOpcode::Jump;
+		self_jump.targets = { a };
+		function.blocks[a].predecessors = { a };
+	}
+	join_block.predecessors = { b };
+
+	auto& jump = head.emplace_back();
+	jump.opcode = IrOpcode::Jump;
+	jump.targets = { join };
+
+	for (size_t i = 0; i < selects.size(); i++)
+		join_block.instructions[i] = selects[i];
+
+	add_statistic("if-conversion.branches");
+	add_statistic("if-conversion.selects", selects.size());
+	return true;
+}
+
+bool convert_branches(IrFunction& function)
+{
+	std::vector<const IrInstruction*> definitions(function.value_types.size(), nullptr);
+	auto find_definitions = [&](IrBlock& block)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			if (instruction.dest >= 0)
+				definitions[instruction.dest] = &instruction;
+		}
+	};
+	for (auto& block : function.blocks)
+		find_definitions(block);
+
+	// Converting an inner if can make the one around it a diamond, so the later blocks go first
+	bool changed = false;
+	for (size_t b = function.blocks.size(); b-- > 0;)
+	{
+		if (convert_branch(function, b, definitions))
+		{
+			// Moving the arms' instructions into the head leaves the pointers to them dangling
+			find_definitions(function.blocks[b]);
+			changed = true;
+		}
+	}
+
+	return changed;
+}
@@ -0,0 +1,331 @@
+#include "optimiser.h"
+
+#include "errors.h"
+
+#include <functional>
+#include <unordered_map>
+
+// Callees are inlined when their size, less a bonus for what is likely to fold away
+// at the call site, is under a threshold. Functions with a single call site are
+// removed entirely once they are inlined, so they get a larger budget.
+constexpr int inline_threshold = 30;
+constexpr int single_call_site_threshold = 150;
+constexpr int call_overhead_bonus = 6;
+constexpr int constant_argument_bonus = 4;
+// Stop inlining into a function once it gets this big
+constexpr int max_caller_size = 2000;
+
+int function_size(IrFunction& function)
+{
+	int size = 0;
+	for (auto& block : function.blocks)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			if (instruction.opcode != IrOpcode::Parameter && instruction.opcode != IrOpcode::Phi)
+				size++;
+		}
+	}
+	return size;
+}
+
+// Recursive functions aren't inlined, and neither are functions with tail calls, which
+// would leave the caller's frame
+bool can_inline(IrFunction& function)
+{
+	for (auto& block : function.blocks)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			if (instruction.opcode == IrOpcode::TailCall)
+				return false;
+			if (instruction.opcode == IrOpcode::Call && instruction.symbol == function.asm_name)
+				return false;
+		}
+	}
+	return true;
+}
+
+// Copies the callee into the caller in place of the call at block_index/instruction_index.
+// The instructions after the call move to a new block, which is returned.
+size_t inline_call(IrFunction& caller, size_t block_index, size_t instruction_index, IrFunction& callee)
+{
+	IrInstruction call = caller.blocks[block_index].instructions[instruction_index];
+
+	int value_offset = (int)caller.value_types.size();
+	size_t block_offset = caller.blocks.size();
+	caller.value_types.insert(caller.value_types.end(), callee.value_types.begin(), callee.value_types.end());
+
+	// The callee's variables in memory go after the caller's, keeping 16 byte alignment
+	uint32_t stack_offset = (caller.stack_size + 15) & ~15u;
+	caller.stack_size = stack_offset + callee.stack_size;
+
+	int object_offset = (int)caller.frame_objects.size();
+	for (auto object : callee.frame_objects)
+	{
+		object.stack_offset += stack_offset;
+		caller.frame_objects.push_back(object);
+	}
+
+	// Parameters are numbered separately for integer and float arguments
+	std::vector<int> int_arguments;
+	std::vector<int> float_arguments;
+	for (auto argument : call.operands)
+	{
+		if (is_float_ir_type(caller.value_types[argument]))
+			float_arguments.push_back(argument);
+		else
+			int_arguments.push_back(argument);
+	}
+
+	// Move the rest of the block into the continuation block
+	size_t continuation = block_offset + callee.blocks.size();
+	std::vector<IrInstruction> rest(caller.blocks[block_index].instructions.begin() + instruction_index + 1, caller.blocks[block_index].instructions.end());
+	caller.blocks[block_index].instructions.resize(instruction_index);
+
+	for (auto successor : rest.back().targets)
+	{
+		for (auto& instruction : caller.blocks[successor].instructions)
+		{
+			for (auto& phi_block : instruction.phi_blocks)
+			{
+				if (phi_block == block_index)
+					phi_block = continuation;
+			}
+		}
+	}
+
+	std::vector<int> replacements(caller.value_types.size(), -1);
+	IrInstruction return_phi;
+	return_phi.opcode = IrOpcode::Phi;
+	return_phi.type = call.type;
+	return_phi.dest = call.dest;
+
+	std::vector<IrBlock> new_blocks(callee.blocks.size() + 1);
+	for (size_t b = 0; b < callee.blocks.size(); b++)
+	{
+		new_blocks[b].unroll_hint = callee.blocks[b].unroll_hint;
+		new_blocks[b].branchless_hint = callee.blocks[b].branchless_hint;
+		for (auto instruction : callee.blocks[b].instructions)
+		{
+			if (instruction.dest >= 0)
+				instruction.dest += value_offset;
+			for (auto& operand : instruction.operands)
+				operand += value_offset;
+			for (auto& target : instruction.targets)
+				target += block_offset;
+			for (auto& phi_block : instruction.phi_blocks)
+				phi_block += block_offset;
+			for (auto address : { &instruction.address, &instruction.source })
+			{
+				if (address->kind == IrAddressKind::Frame)
+				{
+					address->stack_offset += stack_offset;
+					address->frame_object += object_offset;
+				}
+			}
+
+			if (instruction.opcode == IrOpcode::Parameter)
+			{
+				auto& arguments = is_float_ir_type(instruction.type) ? float_arguments : int_arguments;
+				if (instruction.immediate >= (int64_t)arguments.size())
+					internal_error("Inlined call has too few arguments");
+				replacements[instruction.dest] = arguments[instruction.immediate];
+				continue;
+			}
+
+			if (instruction.opcode == IrOpcode::Return)
+			{
+				if (call.dest >= 0)
+				{
+					// Falling off the end of a function which returns a value
+					if (instruction.operands.empty())
+					{
+						IrInstruction zero;
+						zero.opcode = is_float_ir_type(call.type) ? IrOpcode::ConstFloat : IrOpcode::Const;
+						zero.type = call.type;
+						zero.dest = caller.make_value(call.type);
+						instruction.operands.push_back(zero.dest);
+						new_blocks[b].instructions.push_back(zero);
+					}
+
+					return_phi.operands.push_back(instruction.operands[0]);
+					return_phi.phi_blocks.push_back(block_offset + b);
+				}
+				else if (call.address.kind == IrAddressKind::Frame)
+				{
+					// A struct result is stored where the call would have stored its registers
+					for (size_t i = 0; i < instruction.operands.size(); i++)
+					{
+						IrInstruction store;
+						store.opcode = IrOpcode::Store;
+						store.type = caller.value_types[instruction.operands[i]];
+						store.operands = { instruction.operands[i] };
+						store.address = call.address;
+						store.address.stack_offset -= (uint32_t)i * 8;
+						new_blocks[b].instructions.push_back(store);
+					}
+				}
+
+				instruction.opcode = IrOpcode::Jump;
+				instruction.type = IrType::None;
+				instruction.operands.clear();
+				instruction.targets = { continuation };
+			}
+
+			new_blocks[b].instructions.push_back(std::move(instruction));
+		}
+	}
+
+	// The call's result is now defined by a phi of the returned values
+	if (call.dest >= 0)
+		new_blocks.back().instructions.push_back(return_phi);
+	for (auto& instruction : rest)
+		new_blocks.back().instructions.push_back(std::move(instruction));
+
+	IrInstruction jump;
+	jump.opcode = IrOpcode::Jump;
+	jump.targets = { block_offset };
+	caller.blocks[block_index].instructions.push_back(jump);
+
+	for (auto& block : new_blocks)
+		caller.blocks.push_back(std::move(block));
+
+	replacements.resize(caller.value_types.size(), -1);
+	replace_values(caller, replacements);
+	return continuation;
+}
+
+bool is_constant_value(IrFunction& function, int value)
+{
+	for (auto& block : function.blocks)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			if (instruction.dest == value)
+				return instruction.opcode == IrOpcode::Const || instruction.opcode == IrOpcode::ConstFloat;
+		}
+	}
+	return false;
+}
+
+bool inline_functions(IrProgram& program, SymbolTable& symbol_table)
+{
+	std::unordered_map<std::string, size_t> functions_by_name;
+	for (size_t i = 0; i < program.functions.size(); i++)
+		functions_by_name[program.functions[i].asm_name] = i;
+
+	// Count the call sites of each function. Functions which have their address taken
+	// are never counted as having a single call site, since they can't be removed.
+	std::vector<int> call_sites(program.functions.size());
+	for (auto& function : program.functions)
+	{
+		for (auto& block : function.blocks)
+		{
+			for (auto& instruction : block.instructions)
+			{
+				if (instruction.opcode != IrOpcode::Call && instruction.opcode != IrOpcode::TailCall && instruction.opcode != IrOpcode::SymbolAddress)
+					continue;
+
+				auto it = functions_by_name.find(instruction.symbol);
+				if (it != functions_by_name.end())
+					call_sites[it->second] += instruction.opcode == IrOpcode::SymbolAddress ? 2 : 1;
+			}
+		}
+	}
+
+	// Process callees before their callers, so calls are inlined with their own calls already inlined
+	std::vector<size_t> order;
+	std::vector<bool> visited(program.functions.size());
+	std::function<void(size_t)> visit = [&](size_t f)
+	{
+		visited[f] = true;
+		for (auto& block : program.functions[f].blocks)
+		{
+			for (auto& instruction : block.instructions)
+			{
+				if (instruction.opcode != IrOpcode::Call && instruction.opcode != IrOpcode::TailCall)
+					continue;
+
+				auto it = functions_by_name.find(instruction.symbol);
+				if (it != functions_by_name.end() && !visited[it->second])
+					visit(it->second);
+			}
+		}
+		order.push_back(f);
+	};
+	for (size_t f = 0; f < program.functions.size(); f++)
+	{
+		if (!visited[f])
+			visit(f);
+	}
+
+	bool changed = false;
+	for (auto f : order)
+	{
+		auto& caller = program.functions[f];
+		int caller_size = function_size(caller);
+		bool inlined_any = false;
+
+		// Calls in the inlined code have already been considered when the callee was processed,
+		// so only the caller's original blocks and the continuation blocks are scanned
+		std::vector<size_t> worklist;
+		for (size_t b = caller.blocks.size(); b > 0; b--)
+			worklist.push_back(b - 1);
+
+		while (!worklist.empty())
+		{
+			size_t b = worklist.back();
+			worklist.pop_back();
+
+			for (size_t i = 0; i < caller.blocks[b].instructions.size(); i++)
+			{
+				auto& instruction = caller.blocks[b].instructions[i];
+				if (instruction.opcode != IrOpcode::Call)
+					continue;
+
+				auto it = functions_by_name.find(instruction.symbol);
+				if (it == functions_by_name.end() || it->second == f)
+					continue;
+
+				auto& callee = program.functions[it->second];
+				auto hint = symbol_table.functions[callee.function_index].inline_hint;
+				if (hint == InlineHint::Never || !can_inline(callee))
+					continue;
+
+				int callee_size = function_size(callee);
+				if (hint != InlineHint::Always)
+				{
+					if (caller_size + callee_size > max_caller_size)
+						continue;
+
+					int benefit = call_overhead_bonus;
+					for (auto argument : instruction.operands)
+					{
+						if (is_constant_value(caller, argument))
+							benefit += constant_argument_bonus;
+					}
+
+					int threshold = call_sites[it->second] == 1 ? single_call_site_threshold : inline_threshold;
+					if (callee_size - benefit > threshold)
+						continue;
+				}
+
+				worklist.push_back(inline_call(caller, b, i, callee));
+				caller_size += callee_size;
+				inlined_any = true;
+				break;
+			}
+		}
+
+		if (inlined_any)
+		{
+			compute_predecessors(caller);
+			remove_unreachable_blocks(caller);
+			remove_trivial_phis(caller);
+			changed = true;
+		}
+	}
+
+	return changed;
+}
@@ -0,0 +1,592 @@
+#include "ir.h"
+
+#include "errors.h"
+
+#include <inttypes.h>
+
+#include <algorithm>
+
+int IrFunction::make_value(IrType type)
+{
+	value_types.push_back(type);
+	return value_types.size() - 1;
+}
+
+bool is_float_ir_type(IrType type)
+{
+	return type == IrType::F32 || type == IrType::F64;
+}
+
+int ir_type_size(IrType type)
+{
+	switch (type)
+	{
+		case IrType::I8: return 1;
+		case IrType::I16: return 2;
+		case IrType::I32: return 4;
+		case IrType::I64: return 8;
+		case IrType::F32: return 4;
+		case IrType::F64: return 8;
+		default:
+			internal_error("IR type has no size");
+	}
+}
+
+bool is_terminator(IrOpcode opcode)
+{
+	return opcode == IrOpcode::Jump || opcode == IrOpcode::Branch || opcode == IrOpcode::Return || opcode == IrOpcode::TailCall;
+}
+
+bool is_compare(IrOpcode opcode)
+{
+	return opcode == IrOpcode::CmpEq || opcode == IrOpcode::CmpNe
+		|| opcode == IrOpcode::CmpGt || opcode == IrOpcode::CmpGe
+		|| opcode == IrOpcode::CmpLt || opcode == IrOpcode::CmpLe;
+}
+
+bool writes_memory(const IrInstruction& instruction)
+{
+	switch (instruction.opcode)
+	{
+		case IrOpcode::Store:
+		case IrOpcode::Zero:
+		case IrOpcode::Copy:
+			return true;
+		case IrOpcode::Call:
+			return instruction.address.kind != IrAddressKind::None;
+		default:
+			return false;
+	}
+}
+
+int memory_write_size(const IrInstruction& instruction)
+{
+	if (instruction.opcode == IrOpcode::Store)
+		return ir_type_size(instruction.type);
+	return (int)instruction.immediate;
+}
+
+bool frame_ranges_overlap(uint32_t stack_offset, int size, uint32_t other_stack_offset, int other_size)
+{
+	// Frame data at stack offset s covers [rbp - s, rbp - s + size)
+	int64_t start = -(int64_t)stack_offset;
+	int64_t other_start = -(int64_t)other_stack_offset;
+	return other_start < start + size && start < other_start + other_size;
+}
+
+bool has_side_effects(const IrInstruction& instruction)
+{
+	return writes_memory(instruction)
+		|| instruction.opcode == IrOpcode::Call
+		|| is_terminator(instruction.opcode);
+}
+
+std::vector<size_t> block_successors(IrBlock& block)
+{
+	if (block.instructions.empty() || !is_terminator(block.terminator().opcode))
+		internal_error("IR block is missing a terminator");
+
+	return block.terminator().targets;
+}
+
+void compute_predecessors(IrFunction& function)
+{
+	for (auto& block : function.blocks)
+		block.predecessors.clear();
+
+	for (size_t b = 0; b < function.blocks.size(); b++)
+	{
+		for (auto s : block_successors(function.blocks[b]))
+		{
+			auto& preds = function.blocks[s].predecessors;
+			// A branch with both targets the same block is one edge
+			if (preds.empty() || preds.back() != b)
+				preds.push_back(b);
+		}
+	}
+}
+
+std::vector<size_t> reverse_post_order(IrFunction& function)
+{
+	std::vector<size_t> order;
+	std::vector<bool> visited(function.blocks.size());
+
+	// Iterative depth first search, (block, next successor to visit)
+	std::vector<std::pair<size_t, size_t>> stack;
+	stack.push_back({ 0, 0 });
+	visited[0] = true;
+	while (!stack.empty())
+	{
+		auto& [b, next] = stack.back();
+		auto successors = block_successors(function.blocks[b]);
+		if (next < successors.size())
+		{
+			size_t s = successors[next++];
+			if (!visited[s])
+			{
+				visited[s] = true;
+				stack.push_back({ s, 0 });
+			}
+		}
+		else
+		{
+			order.push_back(b);
+			stack.pop_back();
+		}
+	}
+
+	std::reverse(order.begin(), order.end());
+	return order;
+}
+
+void replace_values(IrFunction& function, std::vector<int>& replacements)
+{
+	auto resolve = [&](int value)
+	{
+		while (value >= 0 && (size_t)value < replacements.size() && replacements[value] >= 0)
+			value = replacements[value];
+		return value;
+	};
+
+	for (auto& block : function.blocks)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			for (auto& operand : instruction.operands)
+				operand = resolve(operand);
+		}
+	}
+}
+
+bool remove_trivial_phis(IrFunction& function)
+{
+	std::vector<int> replacements(function.value_types.size(), -1);
+	auto resolve = [&](int value)
+	{
+		while (replacements[value] >= 0)
+			value = replacements[value];
+		return value;
+	};
+
+	// Removing one phi can make another trivial, e.g. in nested loops
+	bool any_removed = false;
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (auto& block : function.blocks)
+		{
+			for (auto& instruction : block.instructions)
+			{
+				if (instruction.opcode != IrOpcode::Phi || replacements[instruction.dest] >= 0)
+					continue;
+
+				int same = -1;
+				bool trivial = true;
+				for (auto operand : instruction.operands)
+				{
+					operand = resolve(operand);
+					if (operand == instruction.dest || operand == same)
+						continue;
+					if (same >= 0)
+					{
+						trivial = false;
+						break;
+					}
+					same = operand;
+				}
+
+				if (trivial && same >= 0)
+				{
+					replacements[instruction.dest] = same;
+					changed = true;
+					any_removed = true;
+				}
+			}
+		}
+	}
+
+	if (!any_removed)
+		return false;
+
+	for (auto& block : function.blocks)
+	{
+		auto& instructions = block.instructions;
+		instructions.erase(std::remove_if(instructions.begin(), instructions.end(), [&](IrInstruction& instruction)
+		{
+			return instruction.opcode == IrOpcode::Phi && replacements[instruction.dest] >= 0;
+		}), instructions.end());
+	}
+
+	replace_values(function, replacements);
+	return true;
+}
+
+bool remove_unreachable_blocks(IrFunction& function)
+{
+	auto order = reverse_post_order(function);
+	if (order.size() == function.blocks.size())
+		return false;
+
+	std::vector<bool> reachable(function.blocks.size());
+	for (auto b : order)
+		reachable[b] = true;
+
+	std::vector<size_t> new_index(function.blocks.size());
+	std::vector<IrBlock> blocks;
+	for (size_t b = 0; b < function.blocks.size(); b++)
+	{
+		if (!reachable[b]) continue;
+
+		new_index[b] = blocks.size();
+		blocks.push_back(std::move(function.blocks[b]));
+	}
+
+	for (auto& block : blocks)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			for (auto& target : instruction.targets)
+				target = new_index[target];
+
+			if (instruction.opcode != IrOpcode::Phi)
+				continue;
+
+			// Drop the incoming values from deleted predecessors
+			std::vector<int> operands;
+			std::vector<size_t> phi_blocks;
+			for (size_t i = 0; i < instruction.operands.size(); i++)
+			{
+				if (!reachable[instruction.phi_blocks[i]]) continue;
+
+				operands.push_back(instruction.operands[i]);
+				phi_blocks.push_back(new_index[instruction.phi_blocks[i]]);
+			}
+			instruction.operands = std::move(operands);
+			instruction.phi_blocks = std::move(phi_blocks);
+		}
+	}
+
+	function.blocks = std::move(blocks);
+	compute_predecessors(function);
+	remove_trivial_phis(function);
+	return true;
+}
+
+size_t insert_block(IrFunction& function, size_t position)
+{
+	for (auto& block : function.blocks)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			for (auto& target : instruction.targets)
+			{
+				if (target >= position) target++;
+			}
+			for (auto& phi_block : instruction.phi_blocks)
+			{
+				if (phi_block >= position) phi_block++;
+			}
+		}
+	}
+
+	function.blocks.insert(function.blocks.begin() + position, IrBlock());
+	for (auto& block : function.blocks)
+	{
+		for (auto& predecessor : block.predecessors)
+		{
+			if (predecessor >= position) predecessor++;
+		}
+	}
+	return position;
+}
+
+// Cooper, Harvey & Kennedy, "A Simple, Fast Dominance Algorithm"
+std::vector<size_t> compute_dominators(IrFunction& function)
+{
+	auto order = reverse_post_order(function);
+	std::vector<size_t> order_index(function.blocks.size(), SIZE_MAX);
+	for (size_t i = 0; i < order.size(); i++)
+		order_index[order[i]] = i;
+
+	std::vector<size_t> idom(function.blocks.size(), SIZE_MAX);
+	idom[0] = 0;
+
+	auto intersect = [&](size_t a, size_t b)
+	{
+		while (a != b)
+		{
+			while (order_index[a] > order_index[b]) a = idom[a];
+			while (order_index[b] > order_index[a]) b = idom[b];
+		}
+		return a;
+	};
+
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (size_t i = 1; i < order.size(); i++)
+		{
+			size_t b = order[i];
+			size_t new_idom = SIZE_MAX;
+			for (auto p : function.blocks[b].predecessors)
+			{
+				if (idom[p] == SIZE_MAX) continue;
+				new_idom = new_idom == SIZE_MAX ? p : intersect(p, new_idom);
+			}
+
+			if (new_idom != idom[b])
+			{
+				idom[b] = new_idom;
+				changed = true;
+			}
+		}
+	}
+
+	return idom;
+}
+
+bool dominates(const std::vector<size_t>& idom, size_t a, size_t b)
+{
+	if (idom[b] == SIZE_MAX)
+		return false;
+
+	while (b != a && b != 0)
+		b = idom[b];
+	return b == a;
+}
+
+bool IrLoop::contains(size_t block) const
+{
+	return std::binary_search(blocks.begin(), blocks.end(), block);
+}
+
+std::vector<IrLoop> find_loops(IrFunction& function)
+{
+	auto idom = compute_dominators(function);
+
+	// Back edges go to a block which dominates their source. Back edges to the same header form one loop.
+	std::vector<IrLoop> loops;
+	for (size_t b = 0; b < function.blocks.size(); b++)
+	{
+		for (auto p : function.blocks[b].predecessors)
+		{
+			if (!dominates(idom, b, p))
+				continue;
+
+			auto it = std::find_if(loops.begin(), loops.end(), [b](IrLoop& loop) { return loop.header == b; });
+			if (it == loops.end())
+			{
+				it = loops.insert(loops.end(), IrLoop());
+				it->header = b;
+			}
+			it->latches.push_back(p);
+		}
+	}
+
+	// The loop body is everything which reaches a latch backwards without going through the header
+	for (auto& loop : loops)
+	{
+		std::vector<bool> in_loop(function.blocks.size());
+		in_loop[loop.header] = true;
+		std::vector<size_t> worklist = loop.latches;
+		while (!worklist.empty())
+		{
+			size_t b = worklist.back();
+			worklist.pop_back();
+			if (in_loop[b]) continue;
+
+			in_loop[b] = true;
+			for (auto p : function.blocks[b].predecessors)
+			{
+				if (idom[p] != SIZE_MAX)
+					worklist.push_back(p);
+			}
+		}
+
+		for (size_t b = 0; b < function.blocks.size(); b++)
+		{
+			if (in_loop[b])
+				loop.blocks.push_back(b);
+		}
+	}
+
+	// A loop inside another has fewer blocks
+	std::stable_sort(loops.begin(), loops.end(), [](const IrLoop& a, const IrLoop& b) { return a.blocks.size() < b.blocks.size(); });
+	return loops;
+}
+
+const char* ir_type_name(IrType type)
+{
+	switch (type)
+	{
+		case IrType::None: return "void";
+		case IrType::I8: return "i8";
+		case IrType::I16: return "i16";
+		case IrType::I32: return "i32";
+		case IrType::I64: return "i64";
+		case IrType::F32: return "f32";
+		case IrType::F64: return "f64";
+	}
+	return "";
+}
+
+const char* ir_opcode_names[] =
+{
+	"param",
+	"const",
+	"fconst",
+	"symaddr",
+	"frameaddr",
+	"add",
+	"sub",
+	"mul",
+	"div",
+	"and",
+	"or",
+	"cmpeq",
+	"cmpne",
+	"cmpgt",
+	"cmpge",
+	"cmplt",
+	"cmple",
+	"convert",
+	"select",
+	"min",
+	"max",
+	"load",
+	"store",
+	"zero",
+	"copy",
+	"call",
+	"phi",
+	"jump",
+	"branch",
+	"ret",
+	"tailcall"
+};
+
+void dump_ir_address(FILE* output, IrInstruction& instruction, bool source = false)
+{
+	auto& address = source ? instruction.source : instruction.address;
+	if (address.kind == IrAddressKind::Frame)
+		fprintf(output, "[frame - %u]", address.stack_offset);
+	else if (address.kind == IrAddressKind::Global)
+		fprintf(output, "[%s]", address.symbol.c_str());
+	else if (address.kind == IrAddressKind::Pointer)
+		fprintf(output, "[v%d]", source ? instruction.operands.front() : instruction.operands.back());
+	else
+		internal_error("IR memory access without an address");
+}
+
+void dump_ir_function(FILE* output, IrFunction& function)
+{
+	fprintf(output, "fn %s\n", function.name.c_str());
+
+	for (size_t b = 0; b < function.blocks.size(); b++)
+	{
+		auto& block = function.blocks[b];
+		fprintf(output, ".b%zu:", b);
+		if (!block.predecessors.empty())
+		{
+			fprintf(output, " ; preds");
+			for (auto p : block.predecessors)
+				fprintf(output, " .b%zu", p);
+		}
+		if (block.unroll_hint != 0)
+			fprintf(output, " ; unroll %d", block.unroll_hint);
+		if (block.branchless_hint)
+			fprintf(output, " ; branchless");
+		fprintf(output, "\n");
+
+		for (auto& instruction : block.instructions)
+		{
+			fprintf(output, "    ");
+			if (instruction.dest >= 0)
+				fprintf(output, "v%d = ", instruction.dest);
+
+			fprintf(output, "%s", ir_opcode_names[(int)instruction.opcode]);
+			if (instruction.type != IrType::None)
+				fprintf(output, ".%s", ir_type_name(instruction.type));
+
+			switch (instruction.opcode)
+			{
+				case IrOpcode::Parameter:
+				case IrOpcode::Const:
+					fprintf(output, " %" PRId64, instruction.immediate);
+					break;
+				case IrOpcode::ConstFloat:
+					fprintf(output, " %f", instruction.float_immediate);
+					break;
+				case IrOpcode::SymbolAddress:
+					fprintf(output, " %s", instruction.symbol.c_str());
+					break;
+				case IrOpcode::FrameAddress:
+					fprintf(output, " ");
+					dump_ir_address(output, instruction);
+					break;
+				case IrOpcode::Load:
+					fprintf(output, " ");
+					dump_ir_address(output, instruction);
+					break;
+				case IrOpcode::Store:
+					fprintf(output, " ");
+					dump_ir_address(output, instruction);
+					fprintf(output, ", v%d", instruction.operands[0]);
+					break;
+				case IrOpcode::Zero:
+					fprintf(output, " ");
+					dump_ir_address(output, instruction);
+					fprintf(output, ", %" PRId64, instruction.immediate);
+					break;
+				case IrOpcode::Copy:
+					fprintf(output, " ");
+					dump_ir_address(output, instruction);
+					fprintf(output, ", ");
+					dump_ir_address(output, instruction, true);
+					fprintf(output, ", %" PRId64, instruction.immediate);
+					break;
+				case IrOpcode::Call:
+				case IrOpcode::TailCall:
+					fprintf(output, " %s(", instruction.symbol.c_str());
+					for (size_t i = 0; i < instruction.operands.size(); i++)
+						fprintf(output, "%sv%d", i == 0 ? "" : ", ", instruction.operands[i]);
+					fprintf(output, ")");
+					if (instruction.address.kind != IrAddressKind::None)
+					{
+						fprintf(output, " -> ");
+						dump_ir_address(output, instruction);
+						for (size_t i = 0; i < instruction.result_types.size(); i++)
+							fprintf(output, "%s%s", i == 0 ? " (" : ", ", ir_type_name(instruction.result_types[i]));
+						fprintf(output, ")");
+					}
+					break;
+				case IrOpcode::Phi:
+					for (size_t i = 0; i < instruction.operands.size(); i++)
+						fprintf(output, "%s[v%d, .b%zu]", i == 0 ? " " : ", ", instruction.operands[i], instruction.phi_blocks[i]);
+					break;
+				case IrOpcode::Jump:
+					fprintf(output, " .b%zu", instruction.targets[0]);
+					break;
+				case IrOpcode::Branch:
+					fprintf(output, " v%d, .b%zu, .b%zu", instruction.operands[0], instruction.targets[0], instruction.targets[1]);
+					break;
+				default:
+					for (size_t i = 0; i < instruction.operands.size(); i++)
+						fprintf(output, "%sv%d", i == 0 ? " " : ", ", instruction.operands[i]);
+					break;
+			}
+
+			fprintf(output, "\n");
+		}
+	}
+
+	fprintf(output, "\n");
+}
+
+void dump_ir(FILE* output, IrProgram& program)
+{
+	for (auto& function : program.functions)
+		dump_ir_function(output, function);
+}
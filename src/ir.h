@@ -0,0 +1,190 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+// Mid-level IR in SSA form. Each instruction defines at most one value, and
+// every value is defined exactly once. Values are identified by index into
+// IrFunction::value_types.
+
+enum class IrType
+{
+	None,
+	I8,
+	I16,
+	I32,
+	I64,
+	F32,
+	F64
+};
+
+enum class IrOpcode
+{
+	Parameter,     // immediate = index among the integer or float parameters
+	Const,         // immediate
+	ConstFloat,    // float_immediate
+	SymbolAddress, // Address of symbol, e.g. a string constant or a function
+	FrameAddress,  // Address of the stack data at address.stack_offset
+	Add,
+	Sub,
+	Mul,
+	Div,           // Signed for integers
+	And,
+	Or,
+	CmpEq,         // Compares produce an I8 bool, type is the type of the operands
+	CmpNe,
+	CmpGt,         // Signed for integers
+	CmpGe,
+	CmpLt,
+	CmpLe,
+	Convert,       // f64 to f32
+	Select,        // operands[1] if operands[0] is true, else operands[2]. Integers only
+	Min,           // Floats only, as minsd: operands[0] if it's less than operands[1], else operands[1]
+	Max,           // Floats only, as maxsd: operands[0] if it's greater than operands[1], else operands[1]
+	Load,          // type is the type loaded
+	Store,         // operands[0] is the value stored, type is the type stored
+	Zero,          // Sets immediate bytes at the address to zero
+	Copy,          // Copies immediate bytes to the address from the source address
+	Call,          // operands are the arguments, type is the return type or None. A struct returned
+	               // in registers is stored to the address instead, immediate bytes of it
+	Phi,           // operands[i] comes from phi_blocks[i]
+
+	// Terminators, exactly one at the end of each block
+	Jump,          // targets[0]
+	Branch,        // operands[0] is the condition, targets[0] if true else targets[1]
+	Return,        // operands[0] is the return value if there is one
+	TailCall       // Call which reuses the caller's return address, operands are the arguments
+};
+
+enum class IrAddressKind
+{
+	None,
+	Frame,   // [rbp - stack_offset]
+	Global,  // [symbol]
+	Pointer  // [operand], the last operand of the load or store. The source of a copy uses the first
+};
+
+struct IrAddress
+{
+	IrAddressKind kind = IrAddressKind::None;
+	uint32_t stack_offset = 0;
+	// Frame: index into IrFunction::frame_objects of the variable being accessed
+	int frame_object = -1;
+	std::string symbol;
+};
+
+// A variable in memory, which occupies the size bytes starting stack_offset bytes below the
+// frame base
+struct IrFrameObject
+{
+	uint32_t stack_offset;
+	uint32_t size;
+	uint32_t alignment;
+};
+
+struct IrInstruction
+{
+	IrOpcode opcode;
+	IrType type = IrType::None;
+	int dest = -1;
+	std::vector<int> operands;
+
+	int64_t immediate = 0;
+	double float_immediate = 0.0;
+	std::string symbol;
+	IrAddress address;
+	// Copy: where the bytes are copied from
+	IrAddress source;
+	// Call with a struct result: the type of each eightbyte of it, in the order they're returned
+	std::vector<IrType> result_types;
+
+	std::vector<size_t> targets;
+	std::vector<size_t> phi_blocks;
+};
+
+struct IrBlock
+{
+	std::vector<IrInstruction> instructions;
+	std::vector<size_t> predecessors;
+
+	// N from #unroll(N) when the block is a loop header, 0 if there isn't one
+	int unroll_hint = 0;
+	// Set on the block where the arms of an if marked #branchless join
+	bool branchless_hint = false;
+
+	IrInstruction& terminator() { return instructions.back(); }
+};
+
+struct IrFunction
+{
+	std::string name;
+	std::string asm_name;
+	size_t function_index;
+
+	// Block 0 is the entry block
+	std::vector<IrBlock> blocks;
+	std::vector<IrType> value_types;
+
+	// Bytes of the frame used by variables in memory, as computed by the sizer until the
+	// stack slots are coloured
+	uint32_t stack_size = 0;
+	std::vector<IrFrameObject> frame_objects;
+
+	int make_value(IrType type);
+};
+
+struct IrProgram
+{
+	std::vector<IrFunction> functions;
+};
+
+bool is_float_ir_type(IrType type);
+int ir_type_size(IrType type);
+bool is_terminator(IrOpcode opcode);
+bool is_compare(IrOpcode opcode);
+// Store, Zero, Copy and calls returning a struct, which write to memory at the instruction's address
+bool writes_memory(const IrInstruction& instruction);
+// Bytes written by an instruction which writes to memory
+int memory_write_size(const IrInstruction& instruction);
+// Whether size bytes of the frame at stack_offset overlap other_size bytes at other_stack_offset
+bool frame_ranges_overlap(uint32_t stack_offset, int size, uint32_t other_stack_offset, int other_size);
+// Instructions which can be deleted if their result isn't used
+bool has_side_effects(const IrInstruction& instruction);
+
+std::vector<size_t> block_successors(IrBlock& block);
+void compute_predecessors(IrFunction& function);
+// Blocks in reverse post order from the entry block. Unreachable blocks are not included
+std::vector<size_t> reverse_post_order(IrFunction& function);
+
+// Rewrites every use of a value according to replacements (-1 for no replacement), following chains
+void replace_values(IrFunction& function, std::vector<int>& replacements);
+// Removes phis whose operands are all the same value (or the phi itself)
+bool remove_trivial_phis(IrFunction& function);
+// Deletes blocks which can't be reached from the entry block and renumbers the rest, keeping their order
+bool remove_unreachable_blocks(IrFunction& function);
+
+// Inserts an empty block at position, renumbering the blocks from there on. Returns position
+size_t insert_block(IrFunction& function, size_t position);
+
+// Immediate dominator of each block. The entry block is its own, unreachable blocks get SIZE_MAX
+std::vector<size_t> compute_dominators(IrFunction& function);
+bool dominates(const std::vector<size_t>& idom, size_t a, size_t b);
+
+// A natural loop: the header dominates every block in the loop, and the latches branch back to it
+struct IrLoop
+{
+	size_t header;
+	std::vector<size_t> blocks; // Sorted, including the header
+	std::vector<size_t> latches;
+
+	bool contains(size_t block) const;
+};
+
+// Inner loops come before the loops containing them
+std::vector<IrLoop> find_loops(IrFunction& function);
+
+void dump_ir_function(FILE* output, IrFunction& function);
+void dump_ir(FILE* output, IrProgram& program);
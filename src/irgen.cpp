@@ -0,0 +1,1244 @@
+#include "irgen.h"
+
+#include "sizer.h"
+#include "errors.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+
+// SSA construction follows "Simple and Efficient Construction of Static Single Assignment
+// Form" (Braun et al.). Scalar local variables whose address is never taken are never
+// stored to memory: each assignment just records the current value of the variable in
+// the current block, and reads look the definition up through the predecessors, adding
+// phis where control flow merges. Everything else lives in memory and is accessed with
+// loads and stores.
+
+using VariableKey = std::pair<size_t, size_t>; // (scope index, variable index)
+
+struct IrBuilder
+{
+	IrBuilder(SymbolTable& symbol_table, Ast& ast, IrFunction& function)
+		: symbol_table(symbol_table), ast(ast), function(function) {}
+
+	SymbolTable& symbol_table;
+	Ast& ast;
+	IrFunction& function;
+
+	size_t current_block = 0;
+
+	// Local variables which must stay in memory because their address is taken
+	std::set<VariableKey> address_taken;
+
+	std::map<VariableKey, std::map<size_t, int>> current_def;
+	std::vector<bool> sealed;
+	std::map<size_t, std::vector<std::pair<VariableKey, int>>> incomplete_phis;
+	std::map<VariableKey, IrType> variable_types;
+	// Index into IrFunction::frame_objects of each variable in memory
+	std::map<VariableKey, int> frame_objects;
+	// The pointer to write the result through, for a function returning a struct in memory
+	int return_pointer = -1;
+
+	size_t make_block()
+	{
+		function.blocks.emplace_back();
+		sealed.push_back(false);
+		return function.blocks.size() - 1;
+	}
+
+	IrInstruction& add(IrOpcode opcode, IrType type = IrType::None)
+	{
+		auto& instruction = function.blocks[current_block].instructions.emplace_back();
+		instruction.opcode = opcode;
+		instruction.type = type;
+		return instruction;
+	}
+
+	int add_value(IrOpcode opcode, IrType type, std::vector<int> operands = {})
+	{
+		int dest = function.make_value(type);
+		auto& instruction = add(opcode, type);
+		instruction.dest = dest;
+		instruction.operands = std::move(operands);
+		return dest;
+	}
+
+	void add_edge(size_t from, size_t to)
+	{
+		function.blocks[to].predecessors.push_back(from);
+	}
+
+	void add_jump(size_t target)
+	{
+		add(IrOpcode::Jump).targets = { target };
+		add_edge(current_block, target);
+	}
+
+	void add_branch(int condition, size_t true_target, size_t false_target)
+	{
+		auto& instruction = add(IrOpcode::Branch);
+		instruction.operands = { condition };
+		instruction.targets = { true_target, false_target };
+		add_edge(current_block, true_target);
+		add_edge(current_block, false_target);
+	}
+
+	int add_phi(size_t block, IrType type)
+	{
+		int dest = function.make_value(type);
+
+		// Phis go before any other instruction in the block
+		auto& instructions = function.blocks[block].instructions;
+		auto position = instructions.begin();
+		while (position != instructions.end() && position->opcode == IrOpcode::Phi)
+			++position;
+
+		IrInstruction phi;
+		phi.opcode = IrOpcode::Phi;
+		phi.type = type;
+		phi.dest = dest;
+		instructions.insert(position, phi);
+		return dest;
+	}
+
+	IrInstruction& find_phi(size_t block, int dest)
+	{
+		for (auto& instruction : function.blocks[block].instructions)
+		{
+			if (instruction.opcode == IrOpcode::Phi && instruction.dest == dest)
+				return instruction;
+		}
+		internal_error("Phi not found");
+	}
+
+	void write_variable(VariableKey variable, size_t block, int value)
+	{
+		current_def[variable][block] = value;
+	}
+
+	int read_variable(VariableKey variable, size_t block)
+	{
+		auto& defs = current_def[variable];
+		auto it = defs.find(block);
+		if (it != defs.end())
+			return it->second;
+
+		return read_variable_recursive(variable, block);
+	}
+
+	int read_variable_recursive(VariableKey variable, size_t block)
+	{
+		IrType type = variable_types.at(variable);
+		auto& predecessors = function.blocks[block].predecessors;
+
+		int value;
+		if (!sealed[block])
+		{
+			// Not all predecessors are known yet, the operands are filled in when the block is sealed
+			value = add_phi(block, type);
+			incomplete_phis[block].push_back({ variable, value });
+		}
+		else if (predecessors.empty())
+		{
+			// Read before any assignment, or in unreachable code
+			size_t saved_block = current_block;
+			current_block = block;
+			IrInstruction instruction;
+			instruction.opcode = is_float_ir_type(type) ? IrOpcode::ConstFloat : IrOpcode::Const;
+			instruction.type = type;
+			instruction.dest = value = function.make_value(type);
+			auto& instructions = function.blocks[block].instructions;
+			instructions.insert(instructions.begin(), instruction);
+			current_block = saved_block;
+		}
+		else if (predecessors.size() == 1)
+			value = read_variable(variable, predecessors[0]);
+		else
+		{
+			// Break cycles through loops with an operandless phi
+			value = add_phi(block, type);
+			write_variable(variable, block, value);
+			add_phi_operands(variable, block, value);
+		}
+
+		write_variable(variable, block, value);
+		return value;
+	}
+
+	void add_phi_operands(VariableKey variable, size_t block, int phi)
+	{
+		// Copy the predecessors, reading variables can insert instructions into other blocks
+		auto predecessors = function.blocks[block].predecessors;
+		for (auto predecessor : predecessors)
+		{
+			int operand = read_variable(variable, predecessor);
+
+			auto& instruction = find_phi(block, phi);
+			instruction.operands.push_back(operand);
+			instruction.phi_blocks.push_back(predecessor);
+		}
+	}
+
+	void seal_block(size_t block)
+	{
+		auto it = incomplete_phis.find(block);
+		if (it != incomplete_phis.end())
+		{
+			auto phis = std::move(it->second);
+			incomplete_phis.erase(it);
+			for (auto [variable, phi] : phis)
+				add_phi_operands(variable, block, phi);
+		}
+
+		sealed[block] = true;
+	}
+
+	// Code after a return is unreachable, but still needs a block to go in
+	void start_unreachable_block()
+	{
+		current_block = make_block();
+		seal_block(current_block);
+	}
+};
+
+IrType ir_type_for(SymbolTable& symbol_table, TypeAnnotation& ta)
+{
+	if (is_float_32_type(ta))
+		return IrType::F32;
+	if (is_float_type(ta))
+		return IrType::F64;
+
+	if (ta.special)
+	{
+		if (ta.type_index == TypeAnnotation::special_type_index_literal_int)
+			return IrType::I64;
+		else
+			return IrType::I8;
+	}
+
+	switch (get_data_size(symbol_table, ta))
+	{
+		case 1: return IrType::I8;
+		case 2: return IrType::I16;
+		case 4: return IrType::I32;
+		default: return IrType::I64;
+	}
+}
+
+IrType int_type_for_size(size_t size)
+{
+	switch (size)
+	{
+		case 1: return IrType::I8;
+		case 2: return IrType::I16;
+		case 4: return IrType::I32;
+		case 8: return IrType::I64;
+		default:
+			internal_error("Invalid integer size");
+	}
+}
+
+// Returns the variable key if the given local variable doesn't need to live in memory
+std::optional<VariableKey> promotable_variable(IrBuilder& builder, size_t scope_index, size_t variable_index)
+{
+	VariableKey key = { scope_index, variable_index };
+	auto& variable = builder.symbol_table.scopes[scope_index].local_variables[variable_index];
+	if (is_struct_type(builder.symbol_table, variable.type_annotation) || builder.address_taken.count(key) != 0)
+		return std::nullopt;
+
+	builder.variable_types[key] = ir_type_for(builder.symbol_table, variable.type_annotation);
+	return key;
+}
+
+void find_address_taken_variables(IrBuilder& builder)
+{
+	auto& ast = builder.ast;
+	for (auto& node : ast.nodes)
+	{
+		if (node.type != AstNodeType::AddressOf)
+			continue;
+
+		// Taking the address of a field pins the whole struct, which is in memory anyway
+		size_t variable_node_index = node.child0;
+		while (ast[variable_node_index].type == AstNodeType::Selector)
+			variable_node_index = ast[variable_node_index].child0;
+
+		if (ast[variable_node_index].type == AstNodeType::Variable)
+		{
+			auto& data = ast[variable_node_index].data_variable;
+			builder.address_taken.insert({ data.scope_index, data.variable_index });
+		}
+	}
+}
+
+// Returns (stack_offset, data_size) for the data referred to by the given
+// variable or selector ast node.
+// stack_offset is the number of bytes below the stack pointer where the
+// first (low) byte of the struct sits.
+std::pair<uint32_t, size_t> compute_stack_offset_and_size(Ast& ast, SymbolTable& symbol_table, size_t node_index)
+{
+	auto& ast_node = ast[node_index];
+	if (ast_node.type != AstNodeType::Variable && ast_node.type != AstNodeType::Selector)
+		internal_error("compute_stack_offset_and_size invalid ast node");
+
+	auto& scope = symbol_table.scopes[ast_node.data_variable.scope_index];
+	auto& variable = scope.local_variables[ast_node.data_variable.variable_index];
+	auto data_size = get_data_size(symbol_table, variable.type_annotation);
+
+	if (ast_node.type == AstNodeType::Selector)
+	{
+		// Subtract the selector's offset from the parent, because
+		// we want to climb upwards in the stack - which is subtraction
+		// to this stack_offset. Add data_size to get to the low byte of
+		// the selector variable. Struct scopes are inverted compared
+		// to normal scopes which causes this confusion.
+		uint32_t stack_offset = compute_stack_offset_and_size(ast, symbol_table, ast_node.child0).first - variable.stack_offset + data_size;
+		return { stack_offset, data_size };
+	}
+	else
+	{
+		return { variable.stack_offset, data_size };
+	}
+}
+
+// The frame object holding a variable in memory, made when the variable is first accessed
+int frame_object(IrBuilder& builder, VariableKey key)
+{
+	auto it = builder.frame_objects.find(key);
+	if (it != builder.frame_objects.end())
+		return it->second;
+
+	auto& variable = builder.symbol_table.scopes[key.first].local_variables[key.second];
+	auto& object = builder.function.frame_objects.emplace_back();
+	object.stack_offset = variable.stack_offset;
+	object.size = (uint32_t)get_data_size(builder.symbol_table, variable.type_annotation);
+	object.alignment = (uint32_t)get_alignment(builder.symbol_table, variable.type_annotation);
+
+	int index = (int)builder.function.frame_objects.size() - 1;
+	builder.frame_objects[key] = index;
+	return index;
+}
+
+IrAddress frame_address(uint32_t stack_offset, int object)
+{
+	IrAddress address;
+	address.kind = IrAddressKind::Frame;
+	address.stack_offset = stack_offset;
+	address.frame_object = object;
+	return address;
+}
+
+// The address of the data referred to by the given variable or selector ast node
+IrAddress frame_address_of(IrBuilder& builder, size_t node_index)
+{
+	auto& ast = builder.ast;
+	size_t variable_node_index = node_index;
+	while (ast[variable_node_index].type == AstNodeType::Selector)
+		variable_node_index = ast[variable_node_index].child0;
+
+	auto& data = ast[variable_node_index].data_variable;
+	auto [stack_offset, data_size] = compute_stack_offset_and_size(ast, builder.symbol_table, node_index);
+	return frame_address(stack_offset, frame_object(builder, { data.scope_index, data.variable_index }));
+}
+
+IrAddress global_address(size_t variable_index)
+{
+	IrAddress address;
+	address.kind = IrAddressKind::Global;
+	address.symbol = "GVAR" + std::to_string(variable_index);
+	return address;
+}
+
+int irgen_load(IrBuilder& builder, IrType type, const IrAddress& address, std::vector<int> operands = {})
+{
+	int dest = builder.add_value(IrOpcode::Load, type, std::move(operands));
+	builder.function.blocks[builder.current_block].instructions.back().address = address;
+	return dest;
+}
+
+void irgen_store(IrBuilder& builder, IrType type, const IrAddress& address, std::vector<int> operands)
+{
+	auto& instruction = builder.add(IrOpcode::Store, type);
+	instruction.operands = std::move(operands);
+	instruction.address = address;
+}
+
+int irgen_expr(IrBuilder& builder, size_t index);
+int irgen_call(IrBuilder& builder, size_t index, const IrAddress* result = nullptr, int result_pointer = -1);
+
+// How a struct is passed or returned by value, following the System V ABI. Structs of up to
+// 16 bytes are split into eightbytes, each passed in an xmm register if it only holds floats
+// and in a general purpose register otherwise. Bigger structs are in memory: an argument is
+// passed as a pointer to a copy, and a result is written through a pointer from the caller,
+// which is passed before the other arguments and returned in rax.
+struct StructPassing
+{
+	bool in_memory = false;
+	std::vector<IrType> eightbytes;
+	uint32_t size = 0;
+	uint32_t alignment = 0;
+	// Bytes covered by the eightbytes' types. When this is more than the size, the struct is
+	// moved through a temporary big enough for all of them
+	uint32_t moved_size = 0;
+};
+
+void find_integer_eightbytes(SymbolTable& symbol_table, TypeAnnotation& ta, uint32_t offset, std::vector<bool>& is_integer)
+{
+	if (is_struct_type(symbol_table, ta))
+	{
+		auto& type = symbol_table.types[ta.type_index];
+		for (auto& member : symbol_table.scopes[type.scope].local_variables)
+		{
+			uint32_t member_offset = member.stack_offset - (uint32_t)get_data_size(symbol_table, member.type_annotation);
+			find_integer_eightbytes(symbol_table, member.type_annotation, offset + member_offset, is_integer);
+		}
+	}
+	else if (!is_float_type(ta))
+		is_integer[offset / 8] = true;
+}
+
+StructPassing classify_struct(SymbolTable& symbol_table, TypeAnnotation& ta)
+{
+	StructPassing passing;
+	passing.size = (uint32_t)get_data_size(symbol_table, ta);
+	passing.alignment = (uint32_t)get_alignment(symbol_table, ta);
+	if (passing.size > 16)
+	{
+		passing.in_memory = true;
+		return passing;
+	}
+
+	std::vector<bool> is_integer((passing.size + 7) / 8);
+	find_integer_eightbytes(symbol_table, ta, 0, is_integer);
+	for (uint32_t i = 0; i < is_integer.size(); i++)
+	{
+		uint32_t bytes = std::min(passing.size - i * 8, 8u);
+		IrType type;
+		if (!is_integer[i])
+			type = bytes <= 4 ? IrType::F32 : IrType::F64;
+		else if (bytes <= 2)
+			type = int_type_for_size(bytes);
+		else
+			type = bytes <= 4 ? IrType::I32 : IrType::I64;
+
+		passing.eightbytes.push_back(type);
+		passing.moved_size = i * 8 + ir_type_size(type);
+	}
+	return passing;
+}
+
+// Frame memory which doesn't belong to a variable, placed after the sizer's variables
+IrAddress temporary_frame_address(IrBuilder& builder, uint32_t size, uint32_t alignment)
+{
+	auto& function = builder.function;
+	auto& object = function.frame_objects.emplace_back();
+	object.stack_offset = (function.stack_size + alignment - 1) / alignment * alignment + size;
+	object.size = size;
+	object.alignment = alignment;
+	function.stack_size = (object.stack_offset + 15) & ~15u;
+	return frame_address(object.stack_offset, (int)function.frame_objects.size() - 1);
+}
+
+// The frame address offset bytes on from the given one
+IrAddress offset_frame_address(IrAddress address, uint32_t offset)
+{
+	address.stack_offset -= offset;
+	return address;
+}
+
+int irgen_frame_address(IrBuilder& builder, const IrAddress& address)
+{
+	int dest = builder.add_value(IrOpcode::FrameAddress, IrType::I64);
+	builder.function.blocks[builder.current_block].instructions.back().address = address;
+	return dest;
+}
+
+// operands holds the source's pointer, if it has one, then the destination's
+void irgen_copy(IrBuilder& builder, const IrAddress& address, const IrAddress& source, std::vector<int> operands, uint32_t size)
+{
+	auto& instruction = builder.add(IrOpcode::Copy);
+	instruction.immediate = size;
+	instruction.operands = std::move(operands);
+	instruction.address = address;
+	instruction.source = source;
+}
+
+// The memory holding a struct value, which is copied as a whole rather than loaded. A pointer
+// to it is added to operands
+IrAddress irgen_struct_address(IrBuilder& builder, size_t index, std::vector<int>& operands)
+{
+	auto& ast = builder.ast;
+	if (ast[index].type == AstNodeType::Variable || ast[index].type == AstNodeType::Selector)
+		return frame_address_of(builder, index);
+	else if (ast[index].type == AstNodeType::VariableGlobal)
+		return global_address(ast[index].data_variable.variable_index);
+	else if (ast[index].type == AstNodeType::Dereference)
+	{
+		operands.push_back(irgen_expr(builder, ast[index].child0));
+
+		IrAddress address;
+		address.kind = IrAddressKind::Pointer;
+		return address;
+	}
+	else if (ast[index].type == AstNodeType::FunctionCall)
+	{
+		auto passing = classify_struct(builder.symbol_table, ast[index].type_annotation.value());
+		IrAddress result = temporary_frame_address(builder, std::max(passing.size, passing.moved_size), passing.alignment);
+		irgen_call(builder, index, &result);
+		return result;
+	}
+	else
+		log_error(ast[index], "Struct value can't be copied from this expression");
+}
+
+// The memory holding a struct value in the frame, where its eightbytes can be loaded from.
+// Structs elsewhere are copied to a temporary first.
+IrAddress irgen_struct_in_frame(IrBuilder& builder, size_t index, StructPassing& passing)
+{
+	std::vector<int> operands;
+	IrAddress address = irgen_struct_address(builder, index, operands);
+	if (address.kind == IrAddressKind::Frame && passing.moved_size == passing.size)
+		return address;
+
+	IrAddress temporary = temporary_frame_address(builder, std::max(passing.size, passing.moved_size), passing.alignment);
+	irgen_copy(builder, temporary, address, std::move(operands), passing.size);
+	return temporary;
+}
+
+// The Sethi-Ullman number of an expression: how many registers evaluating it needs when the
+// side which needs more is evaluated first. Expressions with calls or branches in them give
+// -1, since their order can be seen and has to be kept.
+int register_need(Ast& ast, size_t index)
+{
+	switch (ast[index].type)
+	{
+		case AstNodeType::LiteralInt:
+		case AstNodeType::LiteralFloat:
+		case AstNodeType::LiteralBool:
+		case AstNodeType::LiteralChar:
+		case AstNodeType::LiteralString:
+		case AstNodeType::Variable:
+		case AstNodeType::VariableGlobal:
+		case AstNodeType::Selector:
+		case AstNodeType::AddressOf:
+			return 1;
+		case AstNodeType::Dereference:
+			return register_need(ast, ast[index].child0);
+		case AstNodeType::BinOpAdd:
+		case AstNodeType::BinOpSub:
+		case AstNodeType::BinOpMul:
+		case AstNodeType::BinOpDiv:
+		case AstNodeType::BinCompGreater:
+		case AstNodeType::BinCompGreaterEqual:
+		case AstNodeType::BinCompLess:
+		case AstNodeType::BinCompLessEqual:
+		case AstNodeType::BinCompEqual:
+		case AstNodeType::BinCompNotEqual:
+		{
+			int lhs = register_need(ast, ast[index].child1);
+			int rhs = register_need(ast, ast[index].child0);
+			if (lhs < 0 || rhs < 0)
+				return -1;
+			return lhs == rhs ? lhs + 1 : std::max(lhs, rhs);
+		}
+		default:
+			return -1;
+	}
+}
+
+// Generates an expression which is used as the given type. Float literals are f64 but are
+// compatible with f32, so they're made as f32 constants directly, and anything else which
+// is f64 is converted.
+int irgen_expr_as(IrBuilder& builder, size_t index, TypeAnnotation& target_ta)
+{
+	auto& ast = builder.ast;
+	if (!is_float_32_type(target_ta))
+		return irgen_expr(builder, index);
+
+	if (ast[index].type == AstNodeType::LiteralFloat)
+	{
+		int dest = builder.add_value(IrOpcode::ConstFloat, IrType::F32);
+		auto float_index = ast[index].data_literal_float.constant_float_index;
+		builder.function.blocks[builder.current_block].instructions.back().float_immediate = (float)builder.symbol_table.constant_floats[float_index];
+		return dest;
+	}
+
+	int value = irgen_expr(builder, index);
+	if (builder.function.value_types[value] == IrType::F64)
+		return builder.add_value(IrOpcode::Convert, IrType::F32, { value });
+	return value;
+}
+
+// A call, whose struct result is written to result if there is one. Results in memory can be
+// written through result_pointer instead, which is passed on from the caller's caller.
+int irgen_call(IrBuilder& builder, size_t index, const IrAddress* result, int result_pointer)
+{
+	auto& ast = builder.ast;
+	auto& symbol_table = builder.symbol_table;
+
+	auto func_index = ast[index].data_function_call.function_index;
+	auto& func = symbol_table.functions[func_index];
+	auto& func_scope = symbol_table.scopes[func.scope];
+
+	std::optional<StructPassing> result_passing;
+	IrAddress temporary_result;
+	if (func.return_type.has_value() && is_struct_type(symbol_table, func.return_type.value()))
+	{
+		result_passing = classify_struct(symbol_table, func.return_type.value());
+		if (result == nullptr)
+		{
+			temporary_result = temporary_frame_address(builder, std::max(result_passing->size, result_passing->moved_size), result_passing->alignment);
+			result = &temporary_result;
+		}
+	}
+
+	std::vector<int> args;
+	if (result_passing.has_value() && result_passing->in_memory)
+		args.push_back(result_pointer >= 0 ? result_pointer : irgen_frame_address(builder, *result));
+
+	if (func.parameters.size() != 0)
+	{
+		auto current_arg_node = ast[index].child0;
+		for (auto param_variable_index : func.parameters)
+		{
+			auto arg_node = ast[current_arg_node].child0;
+			auto& ta = func_scope.local_variables[param_variable_index].type_annotation;
+			if (!is_struct_type(symbol_table, ta))
+				args.push_back(irgen_expr_as(builder, arg_node, ta));
+			else
+			{
+				auto passing = classify_struct(symbol_table, ta);
+				if (passing.in_memory)
+				{
+					// The callee is free to change its copy
+					if (func.is_external)
+						log_error(ast[arg_node], "Structs bigger than 16 bytes can't be passed to external functions");
+
+					std::vector<int> operands;
+					IrAddress source = irgen_struct_address(builder, arg_node, operands);
+					IrAddress copy = temporary_frame_address(builder, passing.size, passing.alignment);
+					irgen_copy(builder, copy, source, std::move(operands), passing.size);
+					args.push_back(irgen_frame_address(builder, copy));
+				}
+				else
+				{
+					IrAddress address = irgen_struct_in_frame(builder, arg_node, passing);
+					for (uint32_t i = 0; i < passing.eightbytes.size(); i++)
+						args.push_back(irgen_load(builder, passing.eightbytes[i], offset_frame_address(address, i * 8)));
+				}
+			}
+
+			current_arg_node = ast[current_arg_node].next.value_or(current_arg_node);
+		}
+	}
+
+	IrType return_type = IrType::None;
+	if (func.return_type.has_value() && !result_passing.has_value())
+		return_type = ir_type_for(symbol_table, func.return_type.value());
+
+	int dest = -1;
+	if (return_type != IrType::None)
+		dest = builder.function.make_value(return_type);
+
+	auto& instruction = builder.add(IrOpcode::Call, return_type);
+	instruction.dest = dest;
+	instruction.operands = std::move(args);
+	instruction.symbol = func.asm_name;
+	if (result_passing.has_value() && !result_passing->in_memory)
+	{
+		instruction.address = *result;
+		instruction.immediate = result_passing->moved_size;
+		instruction.result_types = result_passing->eightbytes;
+	}
+	return dest;
+}
+
+int irgen_expr(IrBuilder& builder, size_t index)
+{
+	auto& ast = builder.ast;
+	auto& symbol_table = builder.symbol_table;
+
+	if (ast[index].type == AstNodeType::LiteralInt)
+	{
+		int dest = builder.add_value(IrOpcode::Const, IrType::I64);
+		builder.function.blocks[builder.current_block].instructions.back().immediate = ast[index].data_literal_int.value;
+		return dest;
+	}
+	else if (ast[index].type == AstNodeType::LiteralBool)
+	{
+		int dest = builder.add_value(IrOpcode::Const, IrType::I8);
+		builder.function.blocks[builder.current_block].instructions.back().immediate = ast[index].data_literal_bool.value ? 1 : 0;
+		return dest;
+	}
+	else if (ast[index].type == AstNodeType::LiteralChar)
+	{
+		int dest = builder.add_value(IrOpcode::Const, IrType::I8);
+		builder.function.blocks[builder.current_block].instructions.back().immediate = ast[index].data_literal_int.value;
+		return dest;
+	}
+	else if (ast[index].type == AstNodeType::LiteralString)
+	{
+		int dest = builder.add_value(IrOpcode::SymbolAddress, IrType::I64);
+		auto str_index = ast[index].data_literal_string.constant_string_index;
+		builder.function.blocks[builder.current_block].instructions.back().symbol = "LSTR" + std::to_string(str_index);
+		return dest;
+	}
+	else if (ast[index].type == AstNodeType::LiteralFloat)
+	{
+		int dest = builder.add_value(IrOpcode::ConstFloat, IrType::F64);
+		auto float_index = ast[index].data_literal_float.constant_float_index;
+		builder.function.blocks[builder.current_block].instructions.back().float_immediate = symbol_table.constant_floats[float_index];
+		return dest;
+	}
+	else if (ast[index].type == AstNodeType::BinLogicalAnd || ast[index].type == AstNodeType::BinLogicalOr)
+	{
+		// The right hand side is only evaluated if the left doesn't decide the result, in
+		// which case the left hand side is the result
+		bool is_and = ast[index].type == AstNodeType::BinLogicalAnd;
+		size_t rhs_block = builder.make_block();
+		size_t end_block = builder.make_block();
+
+		int lhs = irgen_expr(builder, ast[index].child1);
+		size_t lhs_end = builder.current_block;
+		builder.add_branch(lhs, is_and ? rhs_block : end_block, is_and ? end_block : rhs_block);
+
+		builder.seal_block(rhs_block);
+		builder.current_block = rhs_block;
+		int rhs = irgen_expr(builder, ast[index].child0);
+		size_t rhs_end = builder.current_block;
+		builder.add_jump(end_block);
+
+		builder.seal_block(end_block);
+		builder.current_block = end_block;
+		int dest = builder.add_phi(end_block, IrType::I8);
+		auto& phi = builder.find_phi(end_block, dest);
+		phi.operands = { lhs, rhs };
+		phi.phi_blocks = { lhs_end, rhs_end };
+		return dest;
+	}
+	else if (ast[index].type == AstNodeType::BinOpAdd
+		  || ast[index].type == AstNodeType::BinOpSub
+		  || ast[index].type == AstNodeType::BinOpMul
+		  || ast[index].type == AstNodeType::BinOpDiv
+		  || ast[index].type == AstNodeType::BinCompGreater
+		  || ast[index].type == AstNodeType::BinCompGreaterEqual
+		  || ast[index].type == AstNodeType::BinCompLess
+		  || ast[index].type == AstNodeType::BinCompLessEqual
+		  || ast[index].type == AstNodeType::BinCompEqual
+		  || ast[index].type == AstNodeType::BinCompNotEqual
+		)
+	{
+		// child1 is the left operand in the source and child0 the right
+		auto& left = ast[ast[index].child1];
+		auto& right = ast[ast[index].child0];
+
+		// The right hand side comes first, unless the left needs more registers and nothing in
+		// either side cares about the order
+		int left_need = register_need(ast, ast[index].child1);
+		int right_need = register_need(ast, ast[index].child0);
+		bool left_first = left_need > right_need && right_need >= 0;
+
+		// Float operations are f32 when either side is, with a float literal on the other
+		IrType type;
+		int r0, r1;
+		if (is_float_type(right.type_annotation.value()))
+		{
+			auto& float_ta = is_float_32_type(left.type_annotation.value()) ? left.type_annotation.value() : right.type_annotation.value();
+			type = ir_type_for(symbol_table, float_ta);
+			if (left_first)
+			{
+				r0 = irgen_expr_as(builder, ast[index].child1, float_ta);
+				r1 = irgen_expr_as(builder, ast[index].child0, float_ta);
+			}
+			else
+			{
+				r1 = irgen_expr_as(builder, ast[index].child0, float_ta);
+				r0 = irgen_expr_as(builder, ast[index].child1, float_ta);
+			}
+		}
+		else
+		{
+			size_t arg_size = 8;
+			if (right.type_annotation->special == false)
+				arg_size = symbol_table.types[right.type_annotation->type_index].data_size;
+			else if (left.type_annotation->special == false)
+				arg_size = symbol_table.types[left.type_annotation->type_index].data_size;
+			type = int_type_for_size(arg_size);
+			if (left_first)
+			{
+				r0 = irgen_expr(builder, ast[index].child1);
+				r1 = irgen_expr(builder, ast[index].child0);
+			}
+			else
+			{
+				r1 = irgen_expr(builder, ast[index].child0);
+				r0 = irgen_expr(builder, ast[index].child1);
+			}
+		}
+
+		IrOpcode opcode;
+		switch (ast[index].type)
+		{
+			case AstNodeType::BinOpAdd: opcode = IrOpcode::Add; break;
+			case AstNodeType::BinOpSub: opcode = IrOpcode::Sub; break;
+			case AstNodeType::BinOpMul: opcode = IrOpcode::Mul; break;
+			case AstNodeType::BinOpDiv: opcode = IrOpcode::Div; break;
+			case AstNodeType::BinCompGreater: opcode = IrOpcode::CmpGt; break;
+			case AstNodeType::BinCompGreaterEqual: opcode = IrOpcode::CmpGe; break;
+			case AstNodeType::BinCompLess: opcode = IrOpcode::CmpLt; break;
+			case AstNodeType::BinCompLessEqual: opcode = IrOpcode::CmpLe; break;
+			case AstNodeType::BinCompEqual: opcode = IrOpcode::CmpEq; break;
+			case AstNodeType::BinCompNotEqual: opcode = IrOpcode::CmpNe; break;
+			default:
+				internal_error("Unhandled binary operator");
+		}
+
+		// Compares take the type of their operands but always produce a bool
+		int dest = builder.function.make_value(is_compare(opcode) ? IrType::I8 : type);
+		auto& instruction = builder.add(opcode, type);
+		instruction.dest = dest;
+		instruction.operands = { r0, r1 };
+		return dest;
+	}
+	else if (ast[index].type == AstNodeType::Variable || ast[index].type == AstNodeType::Selector)
+	{
+		if (ast[index].type == AstNodeType::Variable)
+		{
+			auto& data = ast[index].data_variable;
+			auto key = promotable_variable(builder, data.scope_index, data.variable_index);
+			if (key.has_value())
+				return builder.read_variable(key.value(), builder.current_block);
+		}
+
+		return irgen_load(builder, ir_type_for(symbol_table, ast[index].type_annotation.value()), frame_address_of(builder, index));
+	}
+	else if (ast[index].type == AstNodeType::VariableGlobal)
+	{
+		auto variable_index = ast[index].data_variable.variable_index;
+		return irgen_load(builder, ir_type_for(symbol_table, ast[index].type_annotation.value()), global_address(variable_index));
+	}
+	else if (ast[index].type == AstNodeType::FunctionCall)
+	{
+		return irgen_call(builder, index);
+	}
+	else if (ast[index].type == AstNodeType::AddressOf)
+	{
+		size_t variable_node_index = ast[index].child0;
+
+		if (ast[variable_node_index].type == AstNodeType::Variable || ast[variable_node_index].type == AstNodeType::Selector)
+		{
+			int dest = builder.add_value(IrOpcode::FrameAddress, IrType::I64);
+			builder.function.blocks[builder.current_block].instructions.back().address = frame_address_of(builder, variable_node_index);
+			return dest;
+		}
+		else if (ast[variable_node_index].type == AstNodeType::Function)
+		{
+			auto func_index = ast[variable_node_index].data_function_call.function_index;
+			auto& func = symbol_table.functions[func_index];
+
+			int dest = builder.add_value(IrOpcode::SymbolAddress, IrType::I64);
+			builder.function.blocks[builder.current_block].instructions.back().symbol = func.asm_name;
+			return dest;
+		}
+		else
+			internal_error("AddressOf non-variable node");
+	}
+	else if (ast[index].type == AstNodeType::Dereference)
+	{
+		int pointer = irgen_expr(builder, ast[index].child0);
+
+		IrAddress address;
+		address.kind = IrAddressKind::Pointer;
+		return irgen_load(builder, ir_type_for(symbol_table, ast[index].type_annotation.value()), address, { pointer });
+	}
+	else
+	{
+		internal_error("Unhandled AST node type in IR generation (irgen_expr)");
+	}
+}
+
+// Branches on a condition, with && and || going straight to the target which decides
+// the result instead of computing a bool
+void irgen_branch_on(IrBuilder& builder, size_t index, size_t true_target, size_t false_target)
+{
+	auto& ast = builder.ast;
+
+	if (ast[index].type == AstNodeType::BinLogicalAnd || ast[index].type == AstNodeType::BinLogicalOr)
+	{
+		bool is_and = ast[index].type == AstNodeType::BinLogicalAnd;
+		size_t rhs_block = builder.make_block();
+
+		irgen_branch_on(builder, ast[index].child1, is_and ? rhs_block : true_target, is_and ? false_target : rhs_block);
+
+		builder.seal_block(rhs_block);
+		builder.current_block = rhs_block;
+		irgen_branch_on(builder, ast[index].child0, true_target, false_target);
+		return;
+	}
+
+	int condition = irgen_expr(builder, index);
+	builder.add_branch(condition, true_target, false_target);
+}
+
+void irgen_statement(IrBuilder& builder, size_t index)
+{
+	auto& ast = builder.ast;
+	auto& symbol_table = builder.symbol_table;
+
+	if (ast[index].type == AstNodeType::Assignment && is_struct_type(symbol_table, ast[ast[index].child0].type_annotation.value()))
+	{
+		auto& target_ta = ast[ast[index].child0].type_annotation.value();
+		auto passing = classify_struct(symbol_table, target_ta);
+		auto& var_node = ast[ast[index].child0];
+		if (ast[ast[index].child1].type == AstNodeType::FunctionCall && !passing.in_memory && passing.moved_size == passing.size
+			&& (var_node.type == AstNodeType::Variable || var_node.type == AstNodeType::Selector))
+		{
+			// The result registers can be stored straight to the variable
+			IrAddress address = frame_address_of(builder, ast[index].child0);
+			irgen_call(builder, ast[index].child1, &address);
+		}
+		else
+		{
+			// The source pointer comes first in the operands, then the destination's
+			std::vector<int> operands;
+			IrAddress source = irgen_struct_address(builder, ast[index].child1, operands);
+			IrAddress address = irgen_struct_address(builder, ast[index].child0, operands);
+			irgen_copy(builder, address, source, std::move(operands), passing.size);
+		}
+
+		if (ast[index].next.has_value())
+			irgen_statement(builder, ast[index].next.value());
+	}
+	else if (ast[index].type == AstNodeType::Assignment)
+	{
+		auto& target_ta = ast[ast[index].child0].type_annotation.value();
+		int r = irgen_expr_as(builder, ast[index].child1, target_ta);
+
+		auto& var_node = ast[ast[index].child0];
+		if (var_node.type == AstNodeType::Variable || var_node.type == AstNodeType::Selector)
+		{
+			std::optional<VariableKey> key;
+			if (var_node.type == AstNodeType::Variable)
+				key = promotable_variable(builder, var_node.data_variable.scope_index, var_node.data_variable.variable_index);
+
+			if (key.has_value())
+				builder.write_variable(key.value(), builder.current_block, r);
+			else
+			{
+				irgen_store(builder, ir_type_for(symbol_table, target_ta), frame_address_of(builder, ast[index].child0), { r });
+			}
+		}
+		else if (var_node.type == AstNodeType::VariableGlobal)
+		{
+			auto variable_index = var_node.data_variable.variable_index;
+			auto& variable = symbol_table.global_variables[variable_index];
+			irgen_store(builder, ir_type_for(symbol_table, variable.type_annotation), global_address(variable_index), { r });
+		}
+		else
+			internal_error("Unhandled AstNodeType in IR generation (assignment)");
+
+		if (ast[index].next.has_value())
+			irgen_statement(builder, ast[index].next.value());
+	}
+	else if (ast[index].type == AstNodeType::ZeroInitialise || ast[index].type == AstNodeType::Uninitialised)
+	{
+		auto variable_node = ast[index].child0;
+		if (ast[variable_node].type != AstNodeType::Variable)
+			log_error(ast[variable_node], "Zero initialise only supported for variable");
+
+		auto& data = ast[variable_node].data_variable;
+		auto& scope = symbol_table.scopes[data.scope_index];
+		auto& variable = scope.local_variables[data.variable_index];
+		auto data_size = get_data_size(symbol_table, variable.type_annotation);
+
+		// A promoted variable still needs a value to read before it's assigned, and zero costs
+		// nothing once it's overwritten
+		auto key = promotable_variable(builder, data.scope_index, data.variable_index);
+		if (key.has_value())
+		{
+			IrType type = builder.variable_types[key.value()];
+			int zero = builder.add_value(is_float_ir_type(type) ? IrOpcode::ConstFloat : IrOpcode::Const, type);
+			builder.write_variable(key.value(), builder.current_block, zero);
+		}
+		else if (ast[index].type == AstNodeType::ZeroInitialise)
+		{
+			auto& instruction = builder.add(IrOpcode::Zero);
+			instruction.immediate = data_size;
+			instruction.address = frame_address(variable.stack_offset, frame_object(builder, { data.scope_index, data.variable_index }));
+		}
+
+		if (ast[index].next.has_value())
+			irgen_statement(builder, ast[index].next.value());
+	}
+	else if (ast[index].type == AstNodeType::ExpressionStatement)
+	{
+		irgen_expr(builder, ast[index].child0);
+
+		if (ast[index].next.has_value())
+			irgen_statement(builder, ast[index].next.value());
+	}
+	else if (ast[index].type == AstNodeType::Return && ast[index].data_return.tail_call)
+	{
+		// The callee reuses this function's frame, so nothing in it can be pointed to
+		if (!builder.address_taken.empty())
+			log_error(ast[index], "Tail call not possible because the address of a local variable is taken");
+
+		// Big struct arguments are passed as pointers to copies in this function's frame
+		auto call_node = ast[index].aux.value();
+		auto& callee = symbol_table.functions[ast[call_node].data_function_call.function_index];
+		for (auto param_variable_index : callee.parameters)
+		{
+			auto& ta = symbol_table.scopes[callee.scope].local_variables[param_variable_index].type_annotation;
+			if (is_struct_type(symbol_table, ta) && classify_struct(symbol_table, ta).in_memory)
+				log_error(ast[index], "Tail call not possible because a struct argument is passed in memory");
+		}
+
+		// A struct result in registers is left there for the caller, one in memory goes
+		// through the pointer this function was given
+		irgen_call(builder, call_node, nullptr, builder.return_pointer);
+
+		auto& call = builder.function.blocks[builder.current_block].instructions.back();
+		if (call.opcode != IrOpcode::Call)
+			internal_error("Expected a call for tail call");
+
+		call.opcode = IrOpcode::TailCall;
+		call.type = IrType::None;
+		call.dest = -1;
+		call.address = IrAddress();
+		call.result_types.clear();
+		builder.start_unreachable_block();
+	}
+	else if (ast[index].type == AstNodeType::Return)
+	{
+		std::vector<int> operands;
+		if (ast[index].aux.has_value())
+		{
+			auto& func = symbol_table.functions[builder.function.function_index];
+			if (!func.return_type.has_value())
+				internal_error("Missing return type index");
+
+			auto& return_ta = func.return_type.value();
+			if (!is_struct_type(symbol_table, return_ta))
+				operands.push_back(irgen_expr_as(builder, ast[index].aux.value(), return_ta));
+			else
+			{
+				auto passing = classify_struct(symbol_table, return_ta);
+				if (passing.in_memory)
+				{
+					std::vector<int> copy_operands;
+					IrAddress source = irgen_struct_address(builder, ast[index].aux.value(), copy_operands);
+					copy_operands.push_back(builder.return_pointer);
+
+					IrAddress address;
+					address.kind = IrAddressKind::Pointer;
+					irgen_copy(builder, address, source, std::move(copy_operands), passing.size);
+					operands.push_back(builder.return_pointer);
+				}
+				else
+				{
+					IrAddress address = irgen_struct_in_frame(builder, ast[index].aux.value(), passing);
+					for (uint32_t i = 0; i < passing.eightbytes.size(); i++)
+						operands.push_back(irgen_load(builder, passing.eightbytes[i], offset_frame_address(address, i * 8)));
+				}
+			}
+		}
+
+		builder.add(IrOpcode::Return).operands = operands;
+		builder.start_unreachable_block();
+	}
+	else if (ast[index].type == AstNodeType::If)
+	{
+		// Else branch is stored in aux
+		bool else_branch = ast[index].aux.has_value();
+
+		size_t if_block = builder.make_block();
+		size_t else_block = else_branch ? builder.make_block() : 0;
+		size_t end_block = builder.make_block();
+		builder.function.blocks[end_block].branchless_hint = ast[index].data_if.branchless;
+
+		irgen_branch_on(builder, ast[index].child0, if_block, else_branch ? else_block : end_block);
+
+		// If branch code
+		builder.seal_block(if_block);
+		builder.current_block = if_block;
+		irgen_statement(builder, ast[index].child1);
+		builder.add_jump(end_block);
+
+		if (else_branch)
+		{
+			// Else branch code
+			builder.seal_block(else_block);
+			builder.current_block = else_block;
+			irgen_statement(builder, ast[index].aux.value());
+			builder.add_jump(end_block);
+		}
+
+		builder.seal_block(end_block);
+		builder.current_block = end_block;
+
+		if (ast[index].next.has_value())
+			irgen_statement(builder, ast[index].next.value());
+	}
+	else if (ast[index].type == AstNodeType::While || ast[index].type == AstNodeType::For)
+	{
+		std::optional<size_t> incr_node;
+		size_t cond_node;
+		size_t body_node = ast[index].child1;
+
+		if (ast[index].type == AstNodeType::For)
+		{
+			auto init_node = ast[index].child0;
+			cond_node = ast[init_node].aux.value();
+			incr_node = ast[cond_node].aux.value();
+
+			// Initialiser
+			irgen_statement(builder, init_node);
+		}
+		else
+			cond_node = ast[index].child0;
+
+		// The header isn't sealed until the back edge from the end of the body is added
+		size_t header_block = builder.make_block();
+		builder.function.blocks[header_block].unroll_hint = ast[index].data_loop.unroll;
+		builder.add_jump(header_block);
+		builder.current_block = header_block;
+
+		// Evaluate the condition
+		size_t body_block = builder.make_block();
+		size_t end_block = builder.make_block();
+		irgen_branch_on(builder, cond_node, body_block, end_block);
+
+		// Body
+		builder.seal_block(body_block);
+		builder.current_block = body_block;
+		irgen_statement(builder, body_node);
+
+		// Incrementer
+		if (incr_node.has_value())
+			irgen_statement(builder, incr_node.value());
+
+		builder.add_jump(header_block);
+		builder.seal_block(header_block);
+
+		builder.seal_block(end_block);
+		builder.current_block = end_block;
+
+		if (ast[index].next.has_value())
+			irgen_statement(builder, ast[index].next.value());
+	}
+	else
+	{
+		internal_error("Unhandled AST node type in IR generation (irgen_statement)");
+	}
+}
+
+void generate_function_ir(SymbolTable& symbol_table, size_t function_index, IrFunction& function)
+{
+	auto& func = symbol_table.functions[function_index];
+	auto& ast = func.ast;
+	auto index = func.ast_node_root;
+	auto& func_scope = symbol_table.scopes[func.scope];
+
+	if (ast[index].type != AstNodeType::FunctionDefinition)
+		internal_error("Expected root node for function ast to be function definition");
+
+	function.name = func.name;
+	function.asm_name = func.asm_name;
+	function.function_index = function_index;
+	function.stack_size = ast[index].data_function_definition.stack_size;
+
+	IrBuilder builder(symbol_table, ast, function);
+	find_address_taken_variables(builder);
+
+	builder.current_block = builder.make_block();
+	builder.seal_block(builder.current_block);
+
+	int non_float_iter = 0;
+	int float_iter = 0;
+	auto add_parameter = [&](IrType type)
+	{
+		int value = builder.add_value(IrOpcode::Parameter, type);
+		builder.function.blocks[builder.current_block].instructions.back().immediate = is_float_ir_type(type) ? float_iter++ : non_float_iter++;
+		return value;
+	};
+
+	if (func.return_type.has_value() && is_struct_type(symbol_table, func.return_type.value()) && classify_struct(symbol_table, func.return_type.value()).in_memory)
+		builder.return_pointer = add_parameter(IrType::I64);
+
+	// All of the parameters are read first, since copying a struct can use the registers they're in
+	std::vector<std::vector<int>> parameter_values;
+	for (auto param_variable_index : func.parameters)
+	{
+		auto& variable = func_scope.local_variables[param_variable_index];
+		auto& values = parameter_values.emplace_back();
+		if (!is_struct_type(symbol_table, variable.type_annotation))
+			values.push_back(add_parameter(ir_type_for(symbol_table, variable.type_annotation)));
+		else if (classify_struct(symbol_table, variable.type_annotation).in_memory)
+			values.push_back(add_parameter(IrType::I64));
+		else
+		{
+			for (auto type : classify_struct(symbol_table, variable.type_annotation).eightbytes)
+				values.push_back(add_parameter(type));
+		}
+	}
+
+	for (size_t p = 0; p < func.parameters.size(); p++)
+	{
+		auto param_variable_index = func.parameters[p];
+		auto& variable = func_scope.local_variables[param_variable_index];
+		auto& values = parameter_values[p];
+		if (is_struct_type(symbol_table, variable.type_annotation))
+		{
+			// Structs are put back together in their variable's memory
+			IrAddress address = frame_address(variable.stack_offset, frame_object(builder, { func.scope, param_variable_index }));
+			auto passing = classify_struct(symbol_table, variable.type_annotation);
+			if (passing.in_memory)
+			{
+				IrAddress source;
+				source.kind = IrAddressKind::Pointer;
+				irgen_copy(builder, address, source, { values[0] }, passing.size);
+				continue;
+			}
+
+			IrAddress eightbytes_address = address;
+			if (passing.moved_size != passing.size)
+				eightbytes_address = temporary_frame_address(builder, passing.moved_size, passing.alignment);
+
+			for (uint32_t i = 0; i < passing.eightbytes.size(); i++)
+				irgen_store(builder, passing.eightbytes[i], offset_frame_address(eightbytes_address, i * 8), { values[i] });
+
+			if (passing.moved_size != passing.size)
+				irgen_copy(builder, address, eightbytes_address, {}, passing.size);
+			continue;
+		}
+
+		IrType type = ir_type_for(symbol_table, variable.type_annotation);
+		auto key = promotable_variable(builder, func.scope, param_variable_index);
+		if (key.has_value())
+			builder.write_variable(key.value(), builder.current_block, values[0]);
+		else
+			irgen_store(builder, type, frame_address(variable.stack_offset, frame_object(builder, { func.scope, param_variable_index })), { values[0] });
+	}
+
+	if (ast[index].next.has_value())
+		irgen_statement(builder, ast[index].next.value());
+
+	builder.add(IrOpcode::Return);
+
+	remove_trivial_phis(function);
+	compute_predecessors(function);
+}
+
+IrProgram generate_ir(SymbolTable& symbol_table)
+{
+	IrProgram program;
+
+	for (size_t i = 0; i < symbol_table.functions.size(); i++)
+	{
+		auto& func = symbol_table.functions[i];
+		if (!func.intrinsic && !func.is_external)
+			generate_function_ir(symbol_table, i, program.functions.emplace_back());
+	}
+
+	return program;
+}
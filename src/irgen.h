@@ -0,0 +1,7 @@
+#pragma once
+
+#include "ast.h"
+#include "ir.h"
+
+// Lowers every user function in the typechecked symbol table to SSA form
+IrProgram generate_ir(SymbolTable& symbol_table);
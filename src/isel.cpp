@@ -0,0 +1,1090 @@
+#include "isel.h"
+
+#include "errors.h"
+
+#include <algorithm>
+#include <cmath>
+#include <optional>
+
+// Each IR value gets the virtual register first_virtual_register + value. Phis are
+// removed by giving each one a temporary register, which every predecessor writes
+// just before its terminator and the phi's block copies out of at its start. The
+// register allocator's copy hints usually put all of these in the same register.
+//
+// Some machine instructions cover more than one IR instruction. Constants which fit go
+// straight into the instructions using them as immediates, a load used once by the next
+// instruction which could see it change becomes that instruction's memory operand, and
+// an add of a multiply by 2, 4 or 8 is one lea.
+
+int register_for_parameter(int i)
+{
+         if (i == 0) return 5;
+	else if (i == 1) return 4;
+	else if (i == 2) return 3;
+	else if (i == 3) return 2;
+	else if (i == 4) return 8;
+	else if (i == 5) return 9;
+	else
+		internal_error("Register overflow");
+}
+
+int xmm_register_for_parameter(int i)
+{
+	if (i < 0 || i >= 8) internal_error("Float parameter register overflow");
+
+	return 16 + i;
+}
+
+// Values are returned in rax then rdx, or xmm0 then xmm1. Only structs use the second
+int register_for_return(bool is_float, int i)
+{
+	if (i < 0 || i >= 2) internal_error("Return register overflow");
+
+	if (is_float)
+		return 16 + i;
+	return i == 0 ? 0 : 3;
+}
+
+uint32_t register_mask(int reg)
+{
+	return 1u << reg;
+}
+
+// Every register which a call is allowed to overwrite
+uint32_t call_clobbered_registers()
+{
+	uint32_t mask = 0;
+	for (auto r : caller_saved_registers)
+		mask |= register_mask(r);
+	for (int r = 16; r < 32; r++)
+		mask |= register_mask(r);
+	return mask;
+}
+
+struct SelectionContext
+{
+	SelectionContext(IrFunction& function, SymbolTable& symbol_table, MachineFunction& mf)
+		: function(function), symbol_table(symbol_table), mf(mf) {}
+
+	IrFunction& function;
+	SymbolTable& symbol_table;
+	MachineFunction& mf;
+
+	// Temporary register for each phi, indexed by the phi's value
+	std::vector<int> phi_temps;
+	// Values of the integer constants, indexed by value
+	std::vector<std::optional<int64_t>> constants;
+
+	// Compares which are only used by the branch or select straight after them, indexed by
+	// value. These set the flags for a conditional jump or move instead of producing a bool.
+	std::vector<bool> fused_compares;
+
+	// The instruction defining each value, and how many instructions use it
+	std::vector<const IrInstruction*> definitions;
+	std::vector<int> use_counts;
+	// Loads which the instruction using them reads as a memory operand, indexed by value
+	std::vector<bool> folded_loads;
+	// Multiplies by 2, 4 or 8 which the add using them does with a scaled index, indexed by value
+	std::vector<bool> folded_scales;
+
+	int reg(int value)
+	{
+		return first_virtual_register + value;
+	}
+};
+
+MachineOperand select_memory(SelectionContext& ctx, const IrAddress& address, int pointer, int size)
+{
+	if (address.kind == IrAddressKind::Frame)
+		return machine_stack(address.stack_offset, size);
+	else if (address.kind == IrAddressKind::Global)
+		return machine_global(address.symbol, size);
+	else if (address.kind == IrAddressKind::Pointer)
+		return machine_memory(ctx.reg(pointer), 0, size);
+	else
+		internal_error("IR memory access without an address");
+}
+
+MachineOperand select_address(SelectionContext& ctx, const IrInstruction& instruction, int size)
+{
+	return select_memory(ctx, instruction.address, instruction.operands.empty() ? -1 : instruction.operands.back(), size);
+}
+
+// The memory offset bytes on from a memory operand, accessed at a different size
+MachineOperand memory_at(MachineOperand op, int offset, int size)
+{
+	op.value += offset;
+	op.size = size;
+	return op;
+}
+
+// Sizes above this are zeroed and copied with rep stosb and rep movsb, which have a fixed
+// start up cost but then move whole cache lines at a time
+constexpr int bulk_memory_inline_limit = 128;
+
+// Zero and Copy. Up to the limit, the bytes go through an xmm register 16 at a time, with an
+// overlapping last move for the remainder, or through a general purpose register when there
+// are fewer than 16
+void select_bulk_memory(SelectionContext& ctx, IrInstruction& instruction)
+{
+	auto& mf = ctx.mf;
+	bool is_copy = instruction.opcode == IrOpcode::Copy;
+	int size = (int)instruction.immediate;
+
+	auto destination = select_address(ctx, instruction, 8);
+	MachineOperand source;
+	if (is_copy)
+		source = select_memory(ctx, instruction.source, instruction.operands.empty() ? -1 : instruction.operands.front(), 8);
+
+	if (size > bulk_memory_inline_limit)
+	{
+		mf.add(MachineOpcode::Lea, machine_register(5, 8), destination);
+		if (is_copy)
+			mf.add(MachineOpcode::Lea, machine_register(4, 8), source);
+		else
+			mf.add(MachineOpcode::Mov, machine_register(0, 8), machine_immediate(0));
+		mf.add(MachineOpcode::Mov, machine_register(2, 8), machine_immediate(size));
+
+		mf.add(is_copy ? MachineOpcode::RepMovsb : MachineOpcode::RepStosb);
+		mf.instructions.back().implicit_uses = register_mask(5) | register_mask(2) | register_mask(is_copy ? 4 : 0);
+		mf.instructions.back().implicit_defs = register_mask(5) | register_mask(2) | (is_copy ? register_mask(4) : 0);
+		return;
+	}
+
+	if (size >= 16)
+	{
+		// xmm0 is written here and used straight away, so it's never spilled at the wrong size
+		int vector = 16;
+		if (!is_copy)
+			mf.add(MachineOpcode::Xorps, machine_register(vector), machine_register(vector));
+
+		for (int offset = 0; offset < size; offset += 16)
+		{
+			int at = std::min(offset, size - 16);
+			if (is_copy)
+				mf.add(MachineOpcode::Movdqu, machine_register(vector), memory_at(source, at, 16));
+			mf.add(MachineOpcode::Movdqu, memory_at(destination, at, 16), machine_register(vector));
+		}
+		return;
+	}
+
+	int zero = -1;
+	if (!is_copy)
+	{
+		zero = mf.make_virtual_register(false);
+		mf.add(MachineOpcode::Mov, machine_register(zero, 8), machine_immediate(0));
+	}
+
+	for (int offset = 0; offset < size;)
+	{
+		int chunk = 1;
+		if (size - offset >= 8) chunk = 8;
+		else if (size - offset >= 4) chunk = 4;
+		else if (size - offset >= 2) chunk = 2;
+
+		int value = zero;
+		if (is_copy)
+		{
+			value = mf.make_virtual_register(false);
+			mf.add(MachineOpcode::Mov, machine_register(value, chunk), memory_at(source, offset, chunk));
+		}
+		mf.add(MachineOpcode::Mov, memory_at(destination, offset, chunk), machine_register(value, chunk));
+		offset += chunk;
+	}
+}
+
+// Symbols are functions or data in the program, or external functions
+MachineOperand select_symbol(SelectionContext& ctx, const std::string& symbol)
+{
+	MachineOperand op = machine_symbol(symbol);
+	for (auto& func : ctx.symbol_table.functions)
+	{
+		if (func.is_external && func.asm_name == symbol)
+			op.external = true;
+	}
+	return op;
+}
+
+// The operand of a multiply which is 2, 4 or 8, the scales an address can have, or -1
+int scale_operand(SelectionContext& ctx, const IrInstruction& multiply)
+{
+	for (int i = 0; i < 2; i++)
+	{
+		auto factor = ctx.constants[multiply.operands[i]];
+		if (factor.has_value() && (factor.value() == 2 || factor.value() == 4 || factor.value() == 8))
+			return i;
+	}
+	return -1;
+}
+
+// Which operand of a binary operation goes second in the machine instruction, where it can
+// be an immediate or memory. Commutative operations and integer compares put a constant or
+// a load there when only the first operand is one.
+int source_operand(SelectionContext& ctx, const IrInstruction& instruction)
+{
+	bool is_float = is_float_ir_type(instruction.type);
+	if (is_float && (instruction.opcode == IrOpcode::CmpLt || instruction.opcode == IrOpcode::CmpLe))
+		return 0; // Compared the other way round, see select_compare
+
+	bool can_swap = instruction.opcode == IrOpcode::Add || instruction.opcode == IrOpcode::Mul
+		|| instruction.opcode == IrOpcode::And || instruction.opcode == IrOpcode::Or
+		|| (is_compare(instruction.opcode) && !is_float);
+	if (!can_swap)
+		return 1;
+
+	auto is_load = [&](int value) { return ctx.definitions[value] && ctx.definitions[value]->opcode == IrOpcode::Load; };
+	int a = instruction.operands[0];
+	int b = instruction.operands[1];
+	if (ctx.constants[b].has_value())
+		return 1;
+	if (ctx.constants[a].has_value() || (is_load(a) && !is_load(b)))
+		return 0;
+	return 1;
+}
+
+// A value as the second operand of an instruction on size bytes: an immediate if it's a
+// constant which fits, memory if its load is folded, otherwise its register
+MachineOperand select_source(SelectionContext& ctx, int value, int size)
+{
+	if (ctx.folded_loads[value])
+		return select_address(ctx, *ctx.definitions[value], size);
+	if (is_float_ir_type(ctx.function.value_types[value]))
+		return machine_register(ctx.reg(value));
+
+	auto constant = ctx.constants[value];
+	if (constant.has_value() && immediate_fits(constant.value(), size))
+		return machine_immediate(constant.value());
+	return machine_register(ctx.reg(value), size);
+}
+
+void select_copy(SelectionContext& ctx, int dst, int src, IrType type)
+{
+	if (is_float_ir_type(type))
+		ctx.mf.add(MachineOpcode::Movaps, machine_register(dst), machine_register(src));
+	else
+		ctx.mf.add(MachineOpcode::Mov, machine_register(dst, 8), machine_register(src, 8));
+}
+
+// Emits the cmp or comisd for a compare, returning the setcc which gives its result
+MachineOpcode select_compare(SelectionContext& ctx, const IrInstruction& instruction)
+{
+	auto& mf = ctx.mf;
+
+	int arg_size = ir_type_size(instruction.type);
+	int s = source_operand(ctx, instruction);
+	int first = ctx.reg(instruction.operands[1 - s]);
+	auto source = select_source(ctx, instruction.operands[s], arg_size);
+
+	if (!is_float_ir_type(instruction.type))
+	{
+		// With the operands swapped, the condition is mirrored
+		mf.add(MachineOpcode::Cmp, machine_register(first, arg_size), source);
+		switch (instruction.opcode)
+		{
+			case IrOpcode::CmpGt: return s == 1 ? MachineOpcode::Setg : MachineOpcode::Setl;
+			case IrOpcode::CmpGe: return s == 1 ? MachineOpcode::Setge : MachineOpcode::Setle;
+			case IrOpcode::CmpLt: return s == 1 ? MachineOpcode::Setl : MachineOpcode::Setg;
+			case IrOpcode::CmpLe: return s == 1 ? MachineOpcode::Setle : MachineOpcode::Setge;
+			case IrOpcode::CmpEq: return MachineOpcode::Sete;
+			case IrOpcode::CmpNe: return MachineOpcode::Setne;
+			default:
+				internal_error("Unhandled binary compare");
+		}
+	}
+
+	// comisd and ucomiss only have unsigned conditions, so less than is greater than with the operands swapped
+	auto compare = instruction.type == IrType::F32 ? MachineOpcode::Ucomiss : MachineOpcode::Comisd;
+	mf.add(compare, machine_register(first), source);
+	if (instruction.opcode == IrOpcode::CmpLt || instruction.opcode == IrOpcode::CmpLe)
+		return instruction.opcode == IrOpcode::CmpLt ? MachineOpcode::Seta : MachineOpcode::Setnb;
+
+	switch (instruction.opcode)
+	{
+		case IrOpcode::CmpGt: return MachineOpcode::Seta;
+		case IrOpcode::CmpGe: return MachineOpcode::Setnb;
+		case IrOpcode::CmpEq: return MachineOpcode::Sete;
+		case IrOpcode::CmpNe: return MachineOpcode::Setne;
+		default:
+			internal_error("Unhandled float binary operation");
+	}
+}
+
+// The conditional jump taken when the setcc would give 1, or 0 if inverted
+MachineOpcode jump_for_condition(MachineOpcode setcc, bool inverted)
+{
+	switch (setcc)
+	{
+		case MachineOpcode::Sete:  return inverted ? MachineOpcode::Jne : MachineOpcode::Je;
+		case MachineOpcode::Setne: return inverted ? MachineOpcode::Je : MachineOpcode::Jne;
+		case MachineOpcode::Setg:  return inverted ? MachineOpcode::Jle : MachineOpcode::Jg;
+		case MachineOpcode::Setge: return inverted ? MachineOpcode::Jl : MachineOpcode::Jge;
+		case MachineOpcode::Setl:  return inverted ? MachineOpcode::Jge : MachineOpcode::Jl;
+		case MachineOpcode::Setle: return inverted ? MachineOpcode::Jg : MachineOpcode::Jle;
+		case MachineOpcode::Seta:  return inverted ? MachineOpcode::Jbe : MachineOpcode::Ja;
+		case MachineOpcode::Setnb: return inverted ? MachineOpcode::Jb : MachineOpcode::Jae;
+		default:
+			internal_error("Unhandled condition");
+	}
+}
+
+// The conditional move done when the setcc would give 1
+MachineOpcode cmov_for_condition(MachineOpcode setcc)
+{
+	switch (setcc)
+	{
+		case MachineOpcode::Sete:  return MachineOpcode::Cmove;
+		case MachineOpcode::Setne: return MachineOpcode::Cmovne;
+		case MachineOpcode::Setg:  return MachineOpcode::Cmovg;
+		case MachineOpcode::Setge: return MachineOpcode::Cmovge;
+		case MachineOpcode::Setl:  return MachineOpcode::Cmovl;
+		case MachineOpcode::Setle: return MachineOpcode::Cmovle;
+		case MachineOpcode::Seta:  return MachineOpcode::Cmova;
+		case MachineOpcode::Setnb: return MachineOpcode::Cmovae;
+		default:
+			internal_error("Unhandled condition");
+	}
+}
+
+// Multiplier and shift for signed division by a constant d > 1, from Hacker's Delight
+// (Warren, section 10-4), for 64 bit operands
+struct DivisionMagic
+{
+	int64_t multiplier;
+	int shift;
+};
+
+DivisionMagic signed_division_magic(int64_t d)
+{
+	const uint64_t two63 = uint64_t(1) << 63;
+	uint64_t ad = (uint64_t)d;
+	uint64_t anc = two63 - 1 - (two63 % ad); // Absolute value of nc
+	int p = 63;
+	uint64_t q1 = two63 / anc;
+	uint64_t r1 = two63 - q1 * anc;
+	uint64_t q2 = two63 / ad;
+	uint64_t r2 = two63 - q2 * ad;
+	uint64_t delta;
+	do
+	{
+		p++;
+		q1 = 2 * q1;
+		r1 = 2 * r1;
+		if (r1 >= anc) { q1++; r1 -= anc; }
+		q2 = 2 * q2;
+		r2 = 2 * r2;
+		if (r2 >= ad) { q2++; r2 -= ad; }
+		delta = ad - r2;
+	} while (q1 < delta || (q1 == delta && r1 == 0));
+
+	return { (int64_t)(q2 + 1), p - 64 };
+}
+
+bool is_power_of_two(int64_t value)
+{
+	return value > 0 && (value & (value - 1)) == 0;
+}
+
+int log2_of(int64_t value)
+{
+	int result = 0;
+	while (value > 1)
+	{
+		value >>= 1;
+		result++;
+	}
+	return result;
+}
+
+// Signed division of r0 by a constant divisor > 1, which fits in arg_size bytes
+void select_constant_division(SelectionContext& ctx, int result, int r0, int64_t divisor, int arg_size)
+{
+	auto& mf = ctx.mf;
+
+	// Work on the dividend sign extended to 64 bits, the quotient's low bytes are the same
+	int dividend = r0;
+	if (arg_size < 8)
+	{
+		dividend = mf.make_virtual_register(false);
+		mf.add(arg_size == 4 ? MachineOpcode::Movsxd : MachineOpcode::Movsx, machine_register(dividend, 8), machine_register(r0, arg_size));
+	}
+
+	if (is_power_of_two(divisor))
+	{
+		// Shifting rounds towards negative infinity, so negative dividends have divisor - 1 added first
+		int k = log2_of(divisor);
+		int bias = mf.make_virtual_register(false);
+		mf.add(MachineOpcode::Mov, machine_register(bias, 8), machine_register(dividend, 8));
+		mf.add(MachineOpcode::Sar, machine_register(bias, 8), machine_immediate(63));
+		mf.add(MachineOpcode::Shr, machine_register(bias, 8), machine_immediate(64 - k));
+		mf.add(MachineOpcode::Add, machine_register(bias, 8), machine_register(dividend, 8));
+		mf.add(MachineOpcode::Sar, machine_register(bias, 8), machine_immediate(k));
+		mf.add(MachineOpcode::Mov, machine_register(result, 8), machine_register(bias, 8));
+		return;
+	}
+
+	// The high half of the product with the magic number, corrected and shifted, then one
+	// is added for negative dividends to round towards zero
+	auto magic = signed_division_magic(divisor);
+	mf.add(MachineOpcode::Mov, machine_register(0, 8), machine_immediate(magic.multiplier));
+	mf.add(MachineOpcode::ImulWide, machine_register(dividend, 8));
+	mf.instructions.back().implicit_uses = register_mask(0);
+	mf.instructions.back().implicit_defs = register_mask(0) | register_mask(3);
+
+	int quotient = mf.make_virtual_register(false);
+	mf.add(MachineOpcode::Mov, machine_register(quotient, 8), machine_register(3, 8));
+	if (magic.multiplier < 0)
+		mf.add(MachineOpcode::Add, machine_register(quotient, 8), machine_register(dividend, 8));
+	if (magic.shift > 0)
+		mf.add(MachineOpcode::Sar, machine_register(quotient, 8), machine_immediate(magic.shift));
+
+	int sign = mf.make_virtual_register(false);
+	mf.add(MachineOpcode::Mov, machine_register(sign, 8), machine_register(dividend, 8));
+	mf.add(MachineOpcode::Shr, machine_register(sign, 8), machine_immediate(63));
+	mf.add(MachineOpcode::Add, machine_register(quotient, 8), machine_register(sign, 8));
+	mf.add(MachineOpcode::Mov, machine_register(result, 8), machine_register(quotient, 8));
+}
+
+// Multiplication by powers of two becomes a shift, and by 3, 5 or 9 an lea. Returns false
+// if the factor needs an imul.
+bool select_constant_multiply(SelectionContext& ctx, int result, int r0, int64_t factor, int arg_size)
+{
+	auto& mf = ctx.mf;
+
+	if (is_power_of_two(factor))
+	{
+		mf.add(MachineOpcode::Mov, machine_register(result, 8), machine_register(r0, 8));
+		if (factor != 1)
+			mf.add(MachineOpcode::Shl, machine_register(result, arg_size), machine_immediate(log2_of(factor)));
+		return true;
+	}
+
+	if (factor == 3 || factor == 5 || factor == 9)
+	{
+		// The low bytes of the 64 bit result are the same for smaller operands
+		mf.add(MachineOpcode::Lea, machine_register(result, 8), machine_indexed(r0, r0, (int)factor - 1, 0, 8));
+		return true;
+	}
+
+	return false;
+}
+
+void select_binop(SelectionContext& ctx, IrInstruction& instruction)
+{
+	auto& mf = ctx.mf;
+
+	int result = ctx.reg(instruction.dest);
+	int r0 = ctx.reg(instruction.operands[0]);
+	int r1 = ctx.reg(instruction.operands[1]);
+	int arg_size = ir_type_size(instruction.type);
+
+	if (instruction.opcode == IrOpcode::Div)
+	{
+		auto divisor = ctx.constants[instruction.operands[1]];
+		if (divisor.has_value() && divisor.value() > 1 && (arg_size == 8 || divisor.value() < (int64_t(1) << (arg_size * 8 - 1))))
+		{
+			select_constant_division(ctx, result, r0, divisor.value(), arg_size);
+			return;
+		}
+
+		// result = r0 / r1
+		// The dividend is sign extended into rdx:rax (edx:eax) because the division is signed
+		int divisor_register = r1;
+		if (arg_size < 4)
+		{
+			// There's no need for the 8/16 bit forms (which put the remainder in ah), widen instead
+			divisor_register = mf.make_virtual_register(false);
+			mf.add(MachineOpcode::Movsx, machine_register(0, 4), machine_register(r0, arg_size));
+			mf.add(MachineOpcode::Movsx, machine_register(divisor_register, 4), machine_register(r1, arg_size));
+			arg_size = 4;
+		}
+		else
+			mf.add(MachineOpcode::Mov, machine_register(0, 8), machine_register(r0, 8));
+
+		mf.add(arg_size == 8 ? MachineOpcode::Cqo : MachineOpcode::Cdq);
+		mf.instructions.back().implicit_uses = register_mask(0);
+		mf.instructions.back().implicit_defs = register_mask(3);
+
+		mf.add(MachineOpcode::Idiv, machine_register(divisor_register, arg_size));
+		mf.instructions.back().implicit_uses = register_mask(0) | register_mask(3);
+		mf.instructions.back().implicit_defs = register_mask(0) | register_mask(3);
+
+		mf.add(MachineOpcode::Mov, machine_register(result, 8), machine_register(0, 8));
+		return;
+	}
+
+	if (instruction.opcode == IrOpcode::Mul)
+	{
+		// Multiplication is commutative, so the constant can be on either side
+		int other = r0;
+		auto factor = ctx.constants[instruction.operands[1]];
+		if (!factor.has_value())
+		{
+			factor = ctx.constants[instruction.operands[0]];
+			other = r1;
+		}
+
+		if (factor.has_value() && select_constant_multiply(ctx, result, other, factor.value(), arg_size))
+			return;
+	}
+
+	int s = source_operand(ctx, instruction);
+	int first_value = instruction.operands[1 - s];
+	int first = ctx.reg(first_value);
+	int source_value = instruction.operands[s];
+
+	if (instruction.opcode == IrOpcode::Add)
+	{
+		// x + y * scale
+		for (int i = 0; i < 2; i++)
+		{
+			if (!ctx.folded_scales[instruction.operands[i]])
+				continue;
+
+			auto& multiply = *ctx.definitions[instruction.operands[i]];
+			int scale = scale_operand(ctx, multiply);
+			int64_t factor = ctx.constants[multiply.operands[scale]].value();
+			int index = ctx.reg(multiply.operands[1 - scale]);
+			mf.add(MachineOpcode::Lea, machine_register(result, 8), machine_indexed(ctx.reg(instruction.operands[1 - i]), index, (int)factor, 0, 8));
+			return;
+		}
+	}
+
+	// When the first operand is used again it can't be overwritten, and the copy into the
+	// result can be saved by adding with lea
+	if ((instruction.opcode == IrOpcode::Add || instruction.opcode == IrOpcode::Sub) && ctx.use_counts[first_value] > 1 && !ctx.folded_loads[source_value])
+	{
+		auto constant = ctx.constants[source_value];
+		if (constant.has_value() && instruction.opcode == IrOpcode::Sub)
+			constant = -constant.value();
+
+		if (constant.has_value() && immediate_fits(constant.value(), 8))
+		{
+			mf.add(MachineOpcode::Lea, machine_register(result, 8), machine_memory(first, (int32_t)constant.value(), 8));
+			return;
+		}
+		if (instruction.opcode == IrOpcode::Add && !ctx.constants[source_value].has_value())
+		{
+			mf.add(MachineOpcode::Lea, machine_register(result, 8), machine_indexed(first, ctx.reg(source_value), 1, 0, 8));
+			return;
+		}
+	}
+
+	MachineOpcode opcode;
+	if (instruction.opcode == IrOpcode::Add)
+		opcode = MachineOpcode::Add;
+	else if (instruction.opcode == IrOpcode::Sub)
+		opcode = MachineOpcode::Sub;
+	else if (instruction.opcode == IrOpcode::Mul)
+	{
+		opcode = MachineOpcode::Imul;
+		// There is no two operand 8 bit imul
+		if (arg_size == 1) arg_size = 4;
+	}
+	else if (instruction.opcode == IrOpcode::And)
+		opcode = MachineOpcode::And;
+	else if (instruction.opcode == IrOpcode::Or)
+		opcode = MachineOpcode::Or;
+	else
+	{
+		mf.add(select_compare(ctx, instruction), machine_register(result, 1));
+		return;
+	}
+
+	// Two address form, the operands might still be needed
+	mf.add(MachineOpcode::Mov, machine_register(result, 8), machine_register(first, 8));
+	mf.add(opcode, machine_register(result, arg_size), select_source(ctx, source_value, arg_size));
+}
+
+void select_binop_float(SelectionContext& ctx, IrInstruction& instruction)
+{
+	auto& mf = ctx.mf;
+
+	int result = ctx.reg(instruction.dest);
+
+	bool single = instruction.type == IrType::F32;
+	MachineOpcode opcode;
+	if (instruction.opcode == IrOpcode::Add)
+		opcode = single ? MachineOpcode::Addss : MachineOpcode::Addsd;
+	else if (instruction.opcode == IrOpcode::Sub)
+		opcode = single ? MachineOpcode::Subss : MachineOpcode::Subsd;
+	else if (instruction.opcode == IrOpcode::Mul)
+		opcode = single ? MachineOpcode::Mulss : MachineOpcode::Mulsd;
+	else if (instruction.opcode == IrOpcode::Div)
+		opcode = single ? MachineOpcode::Divss : MachineOpcode::Divsd;
+	else
+	{
+		mf.add(select_compare(ctx, instruction), machine_register(result, 1));
+		return;
+	}
+
+	int s = source_operand(ctx, instruction);
+	mf.add(MachineOpcode::Movaps, machine_register(result), machine_register(ctx.reg(instruction.operands[1 - s])));
+	mf.add(opcode, machine_register(result), select_source(ctx, instruction.operands[s], ir_type_size(instruction.type)));
+}
+
+// The false value, then a conditional move of the true value over it
+void select_select(SelectionContext& ctx, const IrInstruction& instruction)
+{
+	auto& mf = ctx.mf;
+
+	int result = ctx.reg(instruction.dest);
+	int size = ir_type_size(instruction.type);
+	int condition = instruction.operands[0];
+	mf.add(MachineOpcode::Mov, machine_register(result, 8), select_source(ctx, instruction.operands[2], 8));
+
+	MachineOpcode setcc = MachineOpcode::Setne;
+	if (ctx.fused_compares[condition])
+		setcc = select_compare(ctx, *ctx.definitions[condition]);
+	else
+		mf.add(MachineOpcode::Test, machine_register(ctx.reg(condition), 1), machine_register(ctx.reg(condition), 1));
+
+	// There's no byte sized cmov
+	int move_size = std::max(size, 4);
+	mf.add(cmov_for_condition(setcc), machine_register(result, move_size), machine_register(ctx.reg(instruction.operands[1]), move_size));
+}
+
+// Copies the arguments of a call into the parameter registers, returning the registers used
+uint32_t select_call_arguments(SelectionContext& ctx, IrInstruction& instruction)
+{
+	auto& function = ctx.function;
+
+	// The arguments are all computed already, so loading the parameter registers can't be interrupted
+	uint32_t param_registers = 0;
+	int non_float_iter = 0;
+	int float_iter = 0;
+	for (auto arg : instruction.operands)
+	{
+		IrType type = function.value_types[arg];
+
+		int param_register;
+		if (is_float_ir_type(type))
+			param_register = xmm_register_for_parameter(float_iter++);
+		else
+			param_register = register_for_parameter(non_float_iter++);
+
+		select_copy(ctx, param_register, ctx.reg(arg), type);
+		param_registers |= register_mask(param_register);
+	}
+
+	return param_registers;
+}
+
+void select_call(SelectionContext& ctx, IrInstruction& instruction)
+{
+	auto& mf = ctx.mf;
+
+	uint32_t param_registers = select_call_arguments(ctx, instruction);
+	mf.add(MachineOpcode::Call, select_symbol(ctx, instruction.symbol));
+	mf.instructions.back().implicit_uses = param_registers;
+	mf.instructions.back().implicit_defs = call_clobbered_registers();
+
+	// Move the result out of the return register
+	if (instruction.dest >= 0)
+		select_copy(ctx, ctx.reg(instruction.dest), is_float_ir_type(instruction.type) ? 16 : 0, instruction.type);
+
+	// A struct in registers is stored to memory an eightbyte at a time
+	int int_results = 0;
+	int float_results = 0;
+	for (size_t i = 0; i < instruction.result_types.size(); i++)
+	{
+		IrType type = instruction.result_types[i];
+		int size = ir_type_size(type);
+		auto address = memory_at(select_address(ctx, instruction, size), (int)i * 8, size);
+		if (type == IrType::F64)
+			mf.add(MachineOpcode::Movsd, address, machine_register(register_for_return(true, float_results++)));
+		else if (type == IrType::F32)
+			mf.add(MachineOpcode::Movss, address, machine_register(register_for_return(true, float_results++)));
+		else
+			mf.add(MachineOpcode::Mov, address, machine_register(register_for_return(false, int_results++), size));
+	}
+}
+
+void select_float_constant(SelectionContext& ctx, IrInstruction& instruction)
+{
+	auto& mf = ctx.mf;
+	int result = ctx.reg(instruction.dest);
+
+	// Zero doesn't need a load from the constant pool
+	if (instruction.float_immediate == 0.0 && !std::signbit(instruction.float_immediate))
+	{
+		mf.add(MachineOpcode::Xorps, machine_register(result), machine_register(result));
+		return;
+	}
+
+	// Load the constant straight from the constant pool. f32 constants have their own pool
+	if (instruction.type == IrType::F32)
+	{
+		auto float_index = ctx.symbol_table.find_add_float_32((float)instruction.float_immediate);
+		mf.add(MachineOpcode::Movss, machine_register(result), machine_global("LFLT32_" + std::to_string(float_index), 4));
+	}
+	else
+	{
+		auto float_index = ctx.symbol_table.find_add_float(instruction.float_immediate);
+		mf.add(MachineOpcode::Movsd, machine_register(result), machine_global("LFLT" + std::to_string(float_index), 8));
+	}
+}
+
+// Fills in the phi temporaries of the successors, for the edges leaving this block
+void select_phi_copies(SelectionContext& ctx, size_t block_index)
+{
+	auto& function = ctx.function;
+
+	auto successors = block_successors(function.blocks[block_index]);
+	for (size_t i = 0; i < successors.size(); i++)
+	{
+		// Both targets of a branch can be the same block
+		if (i > 0 && successors[i] == successors[0])
+			continue;
+
+		for (auto& phi : function.blocks[successors[i]].instructions)
+		{
+			if (phi.opcode != IrOpcode::Phi)
+				break;
+
+			for (size_t p = 0; p < phi.phi_blocks.size(); p++)
+			{
+				if (phi.phi_blocks[p] == block_index)
+					select_copy(ctx, ctx.phi_temps[phi.dest], ctx.reg(phi.operands[p]), phi.type);
+			}
+		}
+	}
+}
+
+void select_instruction(SelectionContext& ctx, size_t block_index, IrInstruction& instruction)
+{
+	auto& mf = ctx.mf;
+
+	switch (instruction.opcode)
+	{
+		case IrOpcode::Parameter:
+		{
+			if (is_float_ir_type(instruction.type))
+				select_copy(ctx, ctx.reg(instruction.dest), xmm_register_for_parameter(instruction.immediate), instruction.type);
+			else
+				select_copy(ctx, ctx.reg(instruction.dest), register_for_parameter(instruction.immediate), instruction.type);
+			break;
+		}
+		case IrOpcode::Const:
+			mf.add(MachineOpcode::Mov, machine_register(ctx.reg(instruction.dest), 8), machine_immediate(instruction.immediate));
+			break;
+		case IrOpcode::ConstFloat:
+			select_float_constant(ctx, instruction);
+			break;
+		case IrOpcode::SymbolAddress:
+		{
+			// Addresses are RIP-relative, except external functions whose address is in the GOT
+			auto address = machine_global(instruction.symbol, 8);
+			address.external = select_symbol(ctx, instruction.symbol).external;
+			mf.add(address.external ? MachineOpcode::Mov : MachineOpcode::Lea, machine_register(ctx.reg(instruction.dest), 8), address);
+			break;
+		}
+		case IrOpcode::FrameAddress:
+			mf.add(MachineOpcode::Lea, machine_register(ctx.reg(instruction.dest), 8), select_address(ctx, instruction, 8));
+			break;
+		case IrOpcode::Add:
+		case IrOpcode::Sub:
+		case IrOpcode::Mul:
+		case IrOpcode::Div:
+		case IrOpcode::And:
+		case IrOpcode::Or:
+		case IrOpcode::CmpEq:
+		case IrOpcode::CmpNe:
+		case IrOpcode::CmpGt:
+		case IrOpcode::CmpGe:
+		case IrOpcode::CmpLt:
+		case IrOpcode::CmpLe:
+		{
+			if (is_compare(instruction.opcode) && ctx.fused_compares[instruction.dest])
+				break;
+			if (instruction.opcode == IrOpcode::Mul && ctx.folded_scales[instruction.dest])
+				break;
+
+			if (is_float_ir_type(instruction.type))
+				select_binop_float(ctx, instruction);
+			else
+				select_binop(ctx, instruction);
+			break;
+		}
+		case IrOpcode::Convert:
+			mf.add(MachineOpcode::Cvtsd2ss, machine_register(ctx.reg(instruction.dest)), machine_register(ctx.reg(instruction.operands[0])));
+			break;
+		case IrOpcode::Select:
+			select_select(ctx, instruction);
+			break;
+		case IrOpcode::Min:
+		case IrOpcode::Max:
+		{
+			bool single = instruction.type == IrType::F32;
+			MachineOpcode opcode;
+			if (instruction.opcode == IrOpcode::Min)
+				opcode = single ? MachineOpcode::Minss : MachineOpcode::Minsd;
+			else
+				opcode = single ? MachineOpcode::Maxss : MachineOpcode::Maxsd;
+
+			int result = ctx.reg(instruction.dest);
+			mf.add(MachineOpcode::Movaps, machine_register(result), machine_register(ctx.reg(instruction.operands[0])));
+			mf.add(opcode, machine_register(result), machine_register(ctx.reg(instruction.operands[1])));
+			break;
+		}
+		case IrOpcode::Load:
+		{
+			if (ctx.folded_loads[instruction.dest])
+				break;
+
+			int size = ir_type_size(instruction.type);
+			if (instruction.type == IrType::F64)
+				mf.add(MachineOpcode::Movsd, machine_register(ctx.reg(instruction.dest)), select_address(ctx, instruction, size));
+			else if (instruction.type == IrType::F32)
+				mf.add(MachineOpcode::Movss, machine_register(ctx.reg(instruction.dest)), select_address(ctx, instruction, size));
+			else
+				mf.add(MachineOpcode::Mov, machine_register(ctx.reg(instruction.dest), size), select_address(ctx, instruction, size));
+			break;
+		}
+		case IrOpcode::Store:
+		{
+			int size = ir_type_size(instruction.type);
+			int value = ctx.reg(instruction.operands[0]);
+			auto constant = ctx.constants[instruction.operands[0]];
+			if (constant.has_value() && immediate_fits(constant.value(), size))
+			{
+				// Nothing else gives the size of the store
+				auto address = select_address(ctx, instruction, size);
+				address.explicit_size = true;
+				mf.add(MachineOpcode::Mov, address, machine_immediate(constant.value()));
+			}
+			else if (instruction.type == IrType::F64)
+				mf.add(MachineOpcode::Movsd, select_address(ctx, instruction, size), machine_register(value));
+			else if (instruction.type == IrType::F32)
+				mf.add(MachineOpcode::Movss, select_address(ctx, instruction, size), machine_register(value));
+			else
+				mf.add(MachineOpcode::Mov, select_address(ctx, instruction, size), machine_register(value, size));
+			break;
+		}
+		case IrOpcode::Zero:
+		case IrOpcode::Copy:
+			select_bulk_memory(ctx, instruction);
+			break;
+		case IrOpcode::Call:
+			select_call(ctx, instruction);
+			break;
+		case IrOpcode::Phi:
+			select_copy(ctx, ctx.reg(instruction.dest), ctx.phi_temps[instruction.dest], instruction.type);
+			break;
+		case IrOpcode::Jump:
+		{
+			select_phi_copies(ctx, block_index);
+			if (instruction.targets[0] != block_index + 1)
+				mf.add(MachineOpcode::Jmp, machine_label(instruction.targets[0]));
+			break;
+		}
+		case IrOpcode::Branch:
+		{
+			select_phi_copies(ctx, block_index);
+
+			// The phi copies are only moves, so they can go between the compare and the jump
+			MachineOpcode setcc = MachineOpcode::Setne;
+			if (ctx.fused_compares[instruction.operands[0]])
+			{
+				auto& instructions = ctx.function.blocks[block_index].instructions;
+				setcc = select_compare(ctx, instructions[instructions.size() - 2]);
+			}
+			else
+			{
+				int condition = ctx.reg(instruction.operands[0]);
+				mf.add(MachineOpcode::Test, machine_register(condition, 1), machine_register(condition, 1));
+			}
+
+			// Jump on the true condition when the false target comes next
+			if (instruction.targets[1] == block_index + 1)
+				mf.add(jump_for_condition(setcc, false), machine_label(instruction.targets[0]));
+			else
+			{
+				mf.add(jump_for_condition(setcc, true), machine_label(instruction.targets[1]));
+				if (instruction.targets[0] != block_index + 1)
+					mf.add(MachineOpcode::Jmp, machine_label(instruction.targets[0]));
+			}
+			break;
+		}
+		case IrOpcode::Return:
+		{
+			// More than one value is a struct returned in registers, an eightbyte in each
+			uint32_t return_registers = 0;
+			int int_results = 0;
+			int float_results = 0;
+			for (auto value : instruction.operands)
+			{
+				IrType type = ctx.function.value_types[value];
+				int return_register = register_for_return(is_float_ir_type(type), is_float_ir_type(type) ? float_results++ : int_results++);
+				select_copy(ctx, return_register, ctx.reg(value), type);
+				return_registers |= register_mask(return_register);
+			}
+
+			mf.add(MachineOpcode::Ret);
+			mf.instructions.back().implicit_uses = return_registers;
+			break;
+		}
+		case IrOpcode::TailCall:
+		{
+			uint32_t param_registers = select_call_arguments(ctx, instruction);
+			mf.add(MachineOpcode::TailJmp, select_symbol(ctx, instruction.symbol));
+			mf.instructions.back().implicit_uses = param_registers;
+			break;
+		}
+	}
+}
+
+bool is_binary_operation(IrOpcode opcode)
+{
+	switch (opcode)
+	{
+		case IrOpcode::Add:
+		case IrOpcode::Sub:
+		case IrOpcode::Mul:
+		case IrOpcode::Div:
+		case IrOpcode::And:
+		case IrOpcode::Or:
+			return true;
+		default:
+			return is_compare(opcode);
+	}
+}
+
+// Whether the second operand of the machine instruction for a binary operation can be memory
+bool takes_memory_source(SelectionContext& ctx, const IrInstruction& instruction)
+{
+	if (is_float_ir_type(instruction.type))
+		return true;
+	if (instruction.opcode == IrOpcode::Div)
+		return false;
+
+	// Multiplies by constants are shifts and leas, and there's no 8 bit two operand imul
+	if (instruction.opcode == IrOpcode::Mul)
+	{
+		return ir_type_size(instruction.type) > 1 && !ctx.constants[instruction.operands[0]].has_value()
+			&& !ctx.constants[instruction.operands[1]].has_value();
+	}
+	return true;
+}
+
+// Marks a multiply by 2, 4 or 8 which is only used by the add to be done by its lea
+bool select_scale_tile(SelectionContext& ctx, const IrInstruction& add)
+{
+	for (int i = 0; i < 2; i++)
+	{
+		auto* multiply = ctx.definitions[add.operands[i]];
+		if (!multiply || multiply->opcode != IrOpcode::Mul || ctx.use_counts[add.operands[i]] != 1)
+			continue;
+		if (ctx.constants[add.operands[1 - i]].has_value())
+			continue;
+
+		if (scale_operand(ctx, *multiply) >= 0)
+		{
+			ctx.folded_scales[add.operands[i]] = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+void select_instructions(IrFunction& function, SymbolTable& symbol_table, MachineFunction& mf)
+{
+	SelectionContext ctx(function, symbol_table, mf);
+
+	mf.stack_size = function.stack_size;
+
+	for (auto type : function.value_types)
+		mf.make_virtual_register(is_float_ir_type(type));
+
+	ctx.phi_temps.resize(function.value_types.size(), -1);
+	for (auto& block : function.blocks)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			if (instruction.opcode == IrOpcode::Phi)
+				ctx.phi_temps[instruction.dest] = mf.make_virtual_register(is_float_ir_type(instruction.type));
+		}
+	}
+
+	auto& use_counts = ctx.use_counts;
+	use_counts.resize(function.value_types.size());
+	ctx.definitions.resize(function.value_types.size());
+	for (auto& block : function.blocks)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			for (auto operand : instruction.operands)
+				use_counts[operand]++;
+			if (instruction.dest >= 0)
+				ctx.definitions[instruction.dest] = &instruction;
+		}
+	}
+
+	ctx.constants.resize(function.value_types.size());
+	for (auto& block : function.blocks)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			if (instruction.opcode == IrOpcode::Const)
+				ctx.constants[instruction.dest] = instruction.immediate;
+		}
+	}
+
+	ctx.fused_compares.resize(function.value_types.size());
+	for (auto& block : function.blocks)
+	{
+		auto& instructions = block.instructions;
+		for (size_t i = 1; i < instructions.size(); i++)
+		{
+			auto& user = instructions[i];
+			if (user.opcode != IrOpcode::Branch && user.opcode != IrOpcode::Select)
+				continue;
+
+			auto& compare = instructions[i - 1];
+			if (is_compare(compare.opcode) && compare.dest == user.operands[0] && use_counts[compare.dest] == 1)
+				ctx.fused_compares[compare.dest] = true;
+		}
+	}
+
+	ctx.folded_scales.resize(function.value_types.size());
+	ctx.folded_loads.resize(function.value_types.size());
+	for (auto& block : function.blocks)
+	{
+		auto& instructions = block.instructions;
+		for (size_t i = 0; i < instructions.size(); i++)
+		{
+			auto& instruction = instructions[i];
+			if (!is_binary_operation(instruction.opcode))
+				continue;
+
+			if (instruction.opcode == IrOpcode::Add && !is_float_ir_type(instruction.type) && select_scale_tile(ctx, instruction))
+				continue;
+			if (!takes_memory_source(ctx, instruction))
+				continue;
+
+			// The load moves down to where it's used, so nothing in between can write memory
+			int value = instruction.operands[source_operand(ctx, instruction)];
+			auto* load = ctx.definitions[value];
+			if (!load || load->opcode != IrOpcode::Load || use_counts[value] != 1 || load->type != instruction.type)
+				continue;
+
+			for (size_t j = i; j-- > 0;)
+			{
+				if (&instructions[j] == load)
+				{
+					ctx.folded_loads[value] = true;
+					break;
+				}
+				if (has_side_effects(instructions[j]))
+					break;
+			}
+		}
+	}
+
+	for (size_t b = 0; b < function.blocks.size(); b++)
+	{
+		mf.add(MachineOpcode::Label, machine_label(b));
+
+		for (auto& instruction : function.blocks[b].instructions)
+			select_instruction(ctx, b, instruction);
+	}
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "ast.h"
+#include "ir.h"
+#include "machine.h"
+
+// Lowers an IR function to machine instructions over virtual registers, one per IR value
+void select_instructions(IrFunction& function, SymbolTable& symbol_table, MachineFunction& mf);
@@ -0,0 +1,201 @@
+#include "optimiser.h"
+
+#include "errors.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <optional>
+
+// Block layout. Blocks are placed in chains which follow a successor of the block just
+// placed, so branches become fall throughs once the instruction selector drops jumps to
+// the next block. A block is only placed once everything which branches forwards to it has
+// been, which keeps the arms of an if together with the join after them, and keeps the
+// blocks of a loop together.
+//
+// Loops are rotated: when the header ends in the branch out of the loop, it goes after the
+// rest of the loop. Each trip then ends in one conditional branch back to the top of the
+// body, rather than a jump back to the test and a branch out of the loop, and only entering
+// the loop jumps to the test. Only the order of the blocks changes, so the header can do
+// more than test the condition.
+
+struct LayoutLoop
+{
+	IrLoop loop;
+	int parent = -1;
+	// The successor of the header inside the loop, when the loop can be rotated
+	std::optional<size_t> body;
+};
+
+std::optional<size_t> rotated_body(IrFunction& function, IrLoop& loop)
+{
+	if (loop.header == 0 || loop.contains(0))
+		return std::nullopt;
+
+	auto& terminator = function.blocks[loop.header].terminator();
+	if (terminator.opcode != IrOpcode::Branch || std::find(loop.latches.begin(), loop.latches.end(), loop.header) != loop.latches.end())
+		return std::nullopt;
+	if (loop.contains(terminator.targets[0]) == loop.contains(terminator.targets[1]))
+		return std::nullopt;
+
+	size_t body = loop.contains(terminator.targets[0]) ? terminator.targets[0] : terminator.targets[1];
+	if (function.blocks[body].predecessors.size() != 1)
+		return std::nullopt;
+	return body;
+}
+
+bool layout_blocks(IrFunction& function)
+{
+	size_t num_blocks = function.blocks.size();
+
+	std::vector<LayoutLoop> loops;
+	for (auto& loop : find_loops(function))
+		loops.emplace_back().loop = loop;
+
+	// Loops come inner first, so the first loop found containing a block is its innermost
+	std::vector<int> innermost(num_blocks, -1);
+	std::vector<int> header_of(num_blocks, -1);
+	for (int l = (int)loops.size() - 1; l >= 0; l--)
+	{
+		for (auto b : loops[l].loop.blocks)
+			innermost[b] = l;
+		header_of[loops[l].loop.header] = l;
+		loops[l].body = rotated_body(function, loops[l].loop);
+
+		for (size_t m = l + 1; m < loops.size(); m++)
+		{
+			if (loops[m].loop.contains(loops[l].loop.header))
+			{
+				loops[l].parent = m;
+				break;
+			}
+		}
+	}
+
+	std::vector<bool> placed(num_blocks);
+	std::vector<bool> deferred(num_blocks); // Headers of rotated loops, which go after the rest of the loop
+	std::vector<size_t> order;
+
+	auto is_back_edge = [&](size_t from, size_t to)
+	{
+		return header_of[to] >= 0 && loops[header_of[to]].loop.contains(from);
+	};
+
+	auto is_ready = [&](size_t b)
+	{
+		for (auto p : function.blocks[b].predecessors)
+		{
+			if (!placed[p] && !is_back_edge(p, b))
+				return false;
+		}
+
+		if (deferred[b])
+		{
+			for (auto other : loops[header_of[b]].loop.blocks)
+			{
+				if (other != b && !placed[other])
+					return false;
+			}
+		}
+		return true;
+	};
+
+	// Places a block, or the body of the loop instead when it's the header of a rotated loop
+	int rotated = 0;
+	auto place = [&](size_t b)
+	{
+		int l = header_of[b];
+		if (l >= 0 && !deferred[b] && loops[l].body.has_value() && !placed[loops[l].body.value()])
+		{
+			deferred[b] = true;
+			rotated++;
+			b = loops[l].body.value();
+		}
+
+		placed[b] = true;
+		order.push_back(b);
+		return b;
+	};
+
+	// When the chain can't go on, carry on with the earliest ready block in the innermost loop
+	// which has one, so loops stay together
+	auto pick_next = [&](size_t current) -> std::optional<size_t>
+	{
+		for (int l = innermost[current]; ; l = loops[l].parent)
+		{
+			for (size_t b = 0; b < num_blocks; b++)
+			{
+				if (!placed[b] && (l < 0 || loops[l].loop.contains(b)) && is_ready(b))
+					return b;
+			}
+
+			if (l < 0)
+				break;
+		}
+
+		// Only blocks which can't be reached are left
+		for (size_t b = 0; b < num_blocks; b++)
+		{
+			if (!placed[b])
+				return b;
+		}
+		return std::nullopt;
+	};
+
+	size_t current = place(0);
+	while (order.size() < num_blocks)
+	{
+		// Prefer staying in the loop over leaving it, then the earlier block
+		auto in_current_loop = [&](size_t b) { return innermost[current] < 0 || loops[innermost[current]].loop.contains(b); };
+
+		std::optional<size_t> next;
+		for (auto s : block_successors(function.blocks[current]))
+		{
+			if (placed[s] || !is_ready(s))
+				continue;
+
+			if (!next.has_value() || (in_current_loop(s) && !in_current_loop(next.value()))
+				|| (in_current_loop(s) == in_current_loop(next.value()) && s < next.value()))
+				next = s;
+		}
+
+		if (!next.has_value())
+			next = pick_next(current);
+		if (!next.has_value())
+			internal_error("Block layout ran out of blocks");
+
+		current = place(next.value());
+	}
+
+	bool changed = false;
+	std::vector<size_t> new_index(num_blocks);
+	for (size_t i = 0; i < num_blocks; i++)
+	{
+		new_index[order[i]] = i;
+		changed |= order[i] != i;
+	}
+
+	if (!changed)
+		return false;
+
+	std::vector<IrBlock> blocks;
+	for (auto b : order)
+		blocks.push_back(std::move(function.blocks[b]));
+
+	for (auto& block : blocks)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			for (auto& target : instruction.targets)
+				target = new_index[target];
+			for (auto& phi_block : instruction.phi_blocks)
+				phi_block = new_index[phi_block];
+		}
+	}
+
+	function.blocks = std::move(blocks);
+	compute_predecessors(function);
+
+	if (rotated > 0)
+		add_statistic("layout.rotated-loops", rotated);
+	return true;
+}
@@ -217,6 +217,16 @@ void lex(std::vector<Token>& tokens, Lexer& lexer)
 				new_token.type = TokenType::DirectiveLinkFramework;
 			else if (identifier_string == "include")
 				new_token.type = TokenType::DirectiveInclude;
+			else if (identifier_string == "inline")
+				new_token.type = TokenType::DirectiveInline;
+			else if (identifier_string == "noinline")
+				new_token.type = TokenType::DirectiveNoInline;
+			else if (identifier_string == "tailcall")
+				new_token.type = TokenType::DirectiveTailCall;
+			else if (identifier_string == "unroll")
+				new_token.type = TokenType::DirectiveUnroll;
+			else if (identifier_string == "branchless")
+				new_token.type = TokenType::DirectiveBranchless;
 			else
 				log_error(new_token, "Unrecognised directive");
 		}
@@ -242,6 +252,8 @@ void lex(std::vector<Token>& tokens, Lexer& lexer)
 			new_token.type = TokenType::OperatorDivide;
 		else if (lexer.get_if('+'))
 			new_token.type = TokenType::OperatorPlus;
+		else if (lexer.get_if("---"))
+			new_token.type = TokenType::Uninitialised;
 		else if (lexer.get_if('-'))
 			new_token.type = TokenType::OperatorMinus;
 		else if (lexer.get_if('='))
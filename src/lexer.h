@@ -17,6 +17,11 @@ enum class TokenType
 	DirectiveLink,
 	DirectiveLinkFramework,
 	DirectiveInclude,
+	DirectiveInline,
+	DirectiveNoInline,
+	DirectiveTailCall,
+	DirectiveUnroll,
+	DirectiveBranchless,
 	ParenthesisLeft,
 	ParenthesisRight,
 	BraceLeft,
@@ -40,6 +45,7 @@ enum class TokenType
 	LogicalAnd,
 	Identifier,
 	Assign,
+	Uninitialised,
 	StatementEnd,
 	Comma,
 	Colon,
@@ -0,0 +1,1152 @@
+#include "optimiser.h"
+
+#include "errors.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <map>
+#include <optional>
+#include <set>
+
+// Loop optimisations. Loops are found in the CFG (see find_loops), so this covers while
+// and for loops as well as the loops made from tail recursion. Inner loops are processed
+// first, so invariants of nested loops can move out one level at a time.
+
+// Returns the block which every entry into the loop comes through, inserting one just
+// before the header if there isn't one. The indices in loop are updated to match.
+size_t ensure_preheader(IrFunction& function, IrLoop& loop)
+{
+	std::vector<size_t> outside;
+	for (auto p : function.blocks[loop.header].predecessors)
+	{
+		if (!loop.contains(p))
+			outside.push_back(p);
+	}
+
+	if (outside.size() == 1 && function.blocks[outside[0]].terminator().opcode == IrOpcode::Jump)
+		return outside[0];
+
+	size_t preheader = insert_block(function, loop.header);
+	for (auto& b : loop.blocks)
+	{
+		if (b >= preheader) b++;
+	}
+	for (auto& b : loop.latches)
+	{
+		if (b >= preheader) b++;
+	}
+	for (auto& b : outside)
+	{
+		if (b >= preheader) b++;
+	}
+	loop.header++;
+
+	for (auto p : outside)
+	{
+		for (auto& target : function.blocks[p].terminator().targets)
+		{
+			if (target == loop.header)
+				target = preheader;
+		}
+	}
+
+	// Values coming into the header from outside the loop now come through the preheader,
+	// merged with a phi there if there was more than one way in
+	std::vector<IrInstruction> preheader_instructions;
+	for (auto& instruction : function.blocks[loop.header].instructions)
+	{
+		if (instruction.opcode != IrOpcode::Phi)
+			break;
+
+		IrInstruction merged;
+		merged.opcode = IrOpcode::Phi;
+		merged.type = instruction.type;
+
+		std::vector<int> operands;
+		std::vector<size_t> phi_blocks;
+		for (size_t i = 0; i < instruction.operands.size(); i++)
+		{
+			if (std::find(outside.begin(), outside.end(), instruction.phi_blocks[i]) != outside.end())
+			{
+				merged.operands.push_back(instruction.operands[i]);
+				merged.phi_blocks.push_back(instruction.phi_blocks[i]);
+			}
+			else
+			{
+				operands.push_back(instruction.operands[i]);
+				phi_blocks.push_back(instruction.phi_blocks[i]);
+			}
+		}
+
+		if (merged.operands.empty())
+			internal_error("Loop header phi has no value from outside the loop");
+
+		if (merged.operands.size() == 1)
+			operands.push_back(merged.operands[0]);
+		else
+		{
+			merged.dest = function.make_value(merged.type);
+			operands.push_back(merged.dest);
+			preheader_instructions.push_back(merged);
+		}
+		phi_blocks.push_back(preheader);
+
+		instruction.operands = std::move(operands);
+		instruction.phi_blocks = std::move(phi_blocks);
+	}
+
+	auto& jump = preheader_instructions.emplace_back();
+	jump.opcode = IrOpcode::Jump;
+	jump.targets = { loop.header };
+	function.blocks[preheader].instructions = std::move(preheader_instructions);
+
+	compute_predecessors(function);
+	return preheader;
+}
+
+// Adds instructions to a block just before its terminator
+void insert_before_terminator(IrBlock& block, std::vector<IrInstruction>& instructions)
+{
+	block.instructions.insert(block.instructions.end() - 1, instructions.begin(), instructions.end());
+}
+
+// What the loop might write to memory, which decides which loads are invariant
+struct LoopMemoryEffects
+{
+	bool has_call = false;
+	bool has_pointer_store = false;
+	std::vector<std::pair<uint32_t, int>> frame_stores; // (stack offset, size)
+	std::set<std::string> global_stores;
+};
+
+LoopMemoryEffects find_memory_effects(IrFunction& function, IrLoop& loop)
+{
+	LoopMemoryEffects effects;
+	for (auto b : loop.blocks)
+	{
+		for (auto& instruction : function.blocks[b].instructions)
+		{
+			if (instruction.opcode == IrOpcode::Call || instruction.opcode == IrOpcode::TailCall)
+				effects.has_call = true;
+
+			if (!writes_memory(instruction))
+				continue;
+
+			if (instruction.address.kind == IrAddressKind::Frame)
+				effects.frame_stores.push_back({ instruction.address.stack_offset, memory_write_size(instruction) });
+			else if (instruction.address.kind == IrAddressKind::Global)
+				effects.global_stores.insert(instruction.address.symbol);
+			else
+				effects.has_pointer_store = true;
+		}
+	}
+	return effects;
+}
+
+bool load_is_invariant(IrInstruction& load, LoopMemoryEffects& effects, bool frame_escapes)
+{
+	auto& address = load.address;
+	if (address.kind == IrAddressKind::Frame)
+	{
+		// Pointers to the frame can be written through by a call or a pointer store
+		if (frame_escapes && (effects.has_call || effects.has_pointer_store))
+			return false;
+
+		for (auto [stack_offset, size] : effects.frame_stores)
+		{
+			if (frame_ranges_overlap(address.stack_offset, ir_type_size(load.type), stack_offset, size))
+				return false;
+		}
+		return true;
+	}
+
+	if (address.kind == IrAddressKind::Global)
+		return !effects.has_call && !effects.has_pointer_store && effects.global_stores.count(address.symbol) == 0;
+
+	// Moving a load through a pointer before the loop's checks could fault
+	return false;
+}
+
+bool hoist_from_loop(IrFunction& function, IrLoop& loop, bool frame_escapes)
+{
+	std::vector<bool> defined_in_loop(function.value_types.size());
+	std::vector<std::optional<int64_t>> constants(function.value_types.size());
+	for (auto& block : function.blocks)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			if (instruction.opcode == IrOpcode::Const)
+				constants[instruction.dest] = instruction.immediate;
+		}
+	}
+	for (auto b : loop.blocks)
+	{
+		for (auto& instruction : function.blocks[b].instructions)
+		{
+			if (instruction.dest >= 0)
+				defined_in_loop[instruction.dest] = true;
+		}
+	}
+
+	auto effects = find_memory_effects(function, loop);
+
+	// Integer constants stay where they are, they are cheaper to rematerialise than to keep
+	// in a register for the whole loop. Hoisted instructions which use them get a copy.
+	std::vector<bool> invariant(function.value_types.size());
+	auto is_available = [&](int value)
+	{
+		return !defined_in_loop[value] || invariant[value] || constants[value].has_value();
+	};
+
+	auto can_hoist = [&](IrInstruction& instruction)
+	{
+		switch (instruction.opcode)
+		{
+			case IrOpcode::ConstFloat:
+			case IrOpcode::SymbolAddress:
+			case IrOpcode::FrameAddress:
+			case IrOpcode::Add:
+			case IrOpcode::Sub:
+			case IrOpcode::Mul:
+			case IrOpcode::And:
+			case IrOpcode::Or:
+			case IrOpcode::CmpEq:
+			case IrOpcode::CmpNe:
+			case IrOpcode::CmpGt:
+			case IrOpcode::CmpGe:
+			case IrOpcode::CmpLt:
+			case IrOpcode::CmpLe:
+			case IrOpcode::Convert:
+			case IrOpcode::Select:
+			case IrOpcode::Min:
+			case IrOpcode::Max:
+				return true;
+			case IrOpcode::Div:
+			{
+				// The loop might not run at all, so only divisions which can't fault are moved
+				if (is_float_ir_type(instruction.type))
+					return true;
+				auto divisor = constants[instruction.operands[1]];
+				return divisor.has_value() && divisor.value() != 0 && divisor.value() != -1;
+			}
+			case IrOpcode::Load:
+				return load_is_invariant(instruction, effects, frame_escapes);
+			default:
+				return false;
+		}
+	};
+
+	std::vector<int> hoisted;
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (auto b : loop.blocks)
+		{
+			for (auto& instruction : function.blocks[b].instructions)
+			{
+				if (instruction.dest < 0 || invariant[instruction.dest] || !can_hoist(instruction))
+					continue;
+				if (!std::all_of(instruction.operands.begin(), instruction.operands.end(), is_available))
+					continue;
+
+				invariant[instruction.dest] = true;
+				hoisted.push_back(instruction.dest);
+				changed = true;
+			}
+		}
+	}
+
+	if (hoisted.empty())
+		return false;
+
+	size_t preheader = ensure_preheader(function, loop);
+
+	std::map<int, IrInstruction> moved;
+	for (auto b : loop.blocks)
+	{
+		auto& instructions = function.blocks[b].instructions;
+		for (auto& instruction : instructions)
+		{
+			if (instruction.dest >= 0 && invariant[instruction.dest])
+				moved[instruction.dest] = instruction;
+		}
+		instructions.erase(std::remove_if(instructions.begin(), instructions.end(), [&](IrInstruction& instruction)
+		{
+			return instruction.dest >= 0 && invariant[instruction.dest];
+		}), instructions.end());
+	}
+
+	std::vector<IrInstruction> new_instructions;
+	std::map<int, int> constant_copies;
+	for (auto value : hoisted)
+	{
+		auto& instruction = moved.at(value);
+		for (auto& operand : instruction.operands)
+		{
+			if (!defined_in_loop[operand] || invariant[operand])
+				continue;
+
+			auto it = constant_copies.find(operand);
+			if (it == constant_copies.end())
+			{
+				IrInstruction copy;
+				copy.opcode = IrOpcode::Const;
+				copy.type = function.value_types[operand];
+				copy.immediate = constants[operand].value();
+				copy.dest = function.make_value(copy.type);
+				new_instructions.push_back(copy);
+				it = constant_copies.insert({ operand, copy.dest }).first;
+			}
+			operand = it->second;
+		}
+		new_instructions.push_back(instruction);
+	}
+
+	insert_before_terminator(function.blocks[preheader], new_instructions);
+	add_statistic("licm.hoisted", hoisted.size());
+	return true;
+}
+
+bool hoist_loop_invariants(IrFunction& function)
+{
+	bool frame_escapes = frame_may_escape(function);
+
+	// Inserting a preheader renumbers blocks, so the loops are found again after each change
+	bool changed = false;
+	bool progress = true;
+	while (progress)
+	{
+		progress = false;
+		for (auto& loop : find_loops(function))
+		{
+			if (loop.header == 0)
+				continue;
+
+			if (hoist_from_loop(function, loop, frame_escapes))
+			{
+				changed = progress = true;
+				break;
+			}
+		}
+	}
+
+	return changed;
+}
+
+// A basic induction variable: a header phi which is incremented by a constant on each trip
+struct InductionVariable
+{
+	int phi;
+	int initial;   // Value on entry, from the preheader
+	int next;      // Value on the back edge, phi + step
+	int64_t step;
+	std::optional<int64_t> initial_constant;
+};
+
+std::vector<InductionVariable> find_induction_variables(IrFunction& function, IrLoop& loop, size_t preheader, std::vector<const IrInstruction*>& definitions)
+{
+	std::vector<InductionVariable> result;
+	size_t latch = loop.latches[0];
+
+	for (auto& phi : function.blocks[loop.header].instructions)
+	{
+		if (phi.opcode != IrOpcode::Phi)
+			break;
+		if (phi.operands.size() != 2 || is_float_ir_type(phi.type))
+			continue;
+
+		InductionVariable iv;
+		iv.phi = phi.dest;
+		iv.initial = phi.phi_blocks[0] == preheader ? phi.operands[0] : phi.operands[1];
+		iv.next = phi.phi_blocks[0] == latch ? phi.operands[0] : phi.operands[1];
+
+		auto update = definitions[iv.next];
+		if (update == nullptr || update->opcode != IrOpcode::Add)
+			continue;
+
+		int step_value;
+		if (update->operands[0] == iv.phi)
+			step_value = update->operands[1];
+		else if (update->operands[1] == iv.phi)
+			step_value = update->operands[0];
+		else
+			continue;
+
+		auto step = definitions[step_value];
+		if (step == nullptr || step->opcode != IrOpcode::Const)
+			continue;
+
+		iv.step = step->immediate;
+		auto initial = definitions[iv.initial];
+		if (initial != nullptr && initial->opcode == IrOpcode::Const)
+			iv.initial_constant = initial->immediate;
+		result.push_back(iv);
+	}
+
+	return result;
+}
+
+// Replaces i * c, for an induction variable i and a constant c, with a new induction
+// variable which starts at initial * c and goes up by step * c
+bool reduce_loop_multiplies(IrFunction& function, IrLoop& loop)
+{
+	if (loop.latches.size() != 1)
+		return false;
+
+	std::vector<const IrInstruction*> definitions(function.value_types.size(), nullptr);
+	std::vector<size_t> defining_block(function.value_types.size());
+	for (size_t b = 0; b < function.blocks.size(); b++)
+	{
+		for (auto& instruction : function.blocks[b].instructions)
+		{
+			if (instruction.dest >= 0)
+			{
+				definitions[instruction.dest] = &instruction;
+				defining_block[instruction.dest] = b;
+			}
+		}
+	}
+
+	// Find the multiplies first, so a preheader is only added when it's needed
+	struct Candidate
+	{
+		int multiply;
+		int phi;
+		int64_t factor;
+	};
+	std::vector<Candidate> candidates;
+	for (auto b : loop.blocks)
+	{
+		for (auto& instruction : function.blocks[b].instructions)
+		{
+			if (instruction.opcode != IrOpcode::Mul || is_float_ir_type(instruction.type))
+				continue;
+
+			for (int i = 0; i < 2; i++)
+			{
+				auto phi = definitions[instruction.operands[i]];
+				auto factor = definitions[instruction.operands[1 - i]];
+				if (phi != nullptr && phi->opcode == IrOpcode::Phi && defining_block[phi->dest] == loop.header
+					&& factor != nullptr && factor->opcode == IrOpcode::Const)
+				{
+					candidates.push_back({ instruction.dest, phi->dest, factor->immediate });
+					break;
+				}
+			}
+		}
+	}
+
+	if (candidates.empty())
+		return false;
+
+	size_t preheader = ensure_preheader(function, loop);
+
+	// The preheader might have changed the blocks, so find the definitions again
+	std::fill(definitions.begin(), definitions.end(), nullptr);
+	definitions.resize(function.value_types.size(), nullptr);
+	for (auto& block : function.blocks)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			if (instruction.dest >= 0)
+				definitions[instruction.dest] = &instruction;
+		}
+	}
+
+	auto induction_variables = find_induction_variables(function, loop, preheader, definitions);
+
+	std::vector<int> replacements(function.value_types.size(), -1);
+	std::map<std::pair<int, int64_t>, int> reduced; // (phi, factor) to the new induction variable
+	bool changed = false;
+	for (auto& candidate : candidates)
+	{
+		auto iv = std::find_if(induction_variables.begin(), induction_variables.end(), [&](InductionVariable& iv) { return iv.phi == candidate.phi; });
+		if (iv == induction_variables.end())
+			continue;
+
+		IrType type = function.value_types[candidate.multiply];
+		auto it = reduced.find({ candidate.phi, candidate.factor });
+		if (it == reduced.end())
+		{
+			auto make_constant = [&](int64_t value)
+			{
+				IrInstruction constant;
+				constant.opcode = IrOpcode::Const;
+				constant.type = type;
+				constant.dest = function.make_value(type);
+				constant.immediate = truncate_to_size(value, ir_type_size(type));
+				return constant;
+			};
+
+			// Initial value, computed in the preheader
+			std::vector<IrInstruction> preheader_instructions;
+			IrInstruction initial;
+			if (iv->initial_constant.has_value())
+			{
+				initial = make_constant(iv->initial_constant.value() * candidate.factor);
+			}
+			else
+			{
+				auto factor = make_constant(candidate.factor);
+				initial.opcode = IrOpcode::Mul;
+				initial.type = type;
+				initial.dest = function.make_value(type);
+				initial.operands = { iv->initial, factor.dest };
+				preheader_instructions.push_back(factor);
+			}
+			preheader_instructions.push_back(initial);
+			insert_before_terminator(function.blocks[preheader], preheader_instructions);
+
+			// The update goes straight after the original induction variable's
+			IrInstruction phi;
+			phi.opcode = IrOpcode::Phi;
+			phi.type = type;
+			phi.dest = function.make_value(type);
+
+			auto step = make_constant(iv->step * candidate.factor);
+			IrInstruction update;
+			update.opcode = IrOpcode::Add;
+			update.type = type;
+			update.dest = function.make_value(type);
+			update.operands = { phi.dest, step.dest };
+
+			phi.operands = { initial.dest, update.dest };
+			phi.phi_blocks = { preheader, loop.latches[0] };
+
+			for (auto b : loop.blocks)
+			{
+				auto& instructions = function.blocks[b].instructions;
+				auto position = std::find_if(instructions.begin(), instructions.end(), [&](IrInstruction& instruction) { return instruction.dest == iv->next; });
+				if (position != instructions.end())
+				{
+					instructions.insert(position + 1, { step, update });
+					break;
+				}
+			}
+
+			auto& header = function.blocks[loop.header].instructions;
+			header.insert(header.begin(), phi);
+
+			it = reduced.insert({ { candidate.phi, candidate.factor }, phi.dest }).first;
+		}
+
+		replacements.resize(function.value_types.size(), -1);
+		replacements[candidate.multiply] = it->second;
+		changed = true;
+	}
+
+	if (!changed)
+		return false;
+
+	for (auto b : loop.blocks)
+	{
+		auto& instructions = function.blocks[b].instructions;
+		instructions.erase(std::remove_if(instructions.begin(), instructions.end(), [&](IrInstruction& instruction)
+		{
+			return instruction.dest >= 0 && (size_t)instruction.dest < replacements.size() && replacements[instruction.dest] >= 0;
+		}), instructions.end());
+	}
+
+	replace_values(function, replacements);
+	add_statistic("strength-reduction.multiplies", reduced.size());
+	return true;
+}
+
+bool reduce_induction_variables(IrFunction& function)
+{
+	bool changed = false;
+	bool progress = true;
+	while (progress)
+	{
+		progress = false;
+		for (auto& loop : find_loops(function))
+		{
+			if (loop.header == 0)
+				continue;
+
+			if (reduce_loop_multiplies(function, loop))
+			{
+				changed = progress = true;
+				break;
+			}
+		}
+	}
+
+	return changed;
+}
+
+// Loop unrolling. Only counted loops are unrolled: the header is the only way out of the
+// loop, and it compares an induction variable with a constant start and step against a
+// constant bound, so the number of trips is known. Short loops are unrolled completely.
+// Longer ones run several copies of the body for each test, and the trips left over are
+// copied out after the loop. #unroll(N) asks for N copies, or complete unrolling if the
+// loop runs at most N times, and #unroll(1) stops a loop from being unrolled. N is cut down
+// so the copies stay within a larger budget of their own.
+constexpr int64_t full_unroll_max_trips = 16;
+constexpr int64_t full_unroll_budget = 128;   // Instructions in the unrolled code
+constexpr int partial_unroll_factor = 4;
+constexpr int partial_unroll_budget = 64;     // Instructions in the unrolled loop body
+constexpr int64_t hinted_unroll_budget = 1024; // Instructions in the copies asked for by #unroll
+
+struct CountedLoop
+{
+	InductionVariable iv;
+	size_t entry;        // The only block outside the loop which jumps to the header
+	size_t latch;
+	size_t body;         // Successor of the header inside the loop
+	size_t exit;         // Successor of the header outside the loop
+	IrType type;         // Type of the induction variable
+	int64_t start;
+	int64_t step;
+	int64_t trips;
+};
+
+int loop_size(IrFunction& function, IrLoop& loop)
+{
+	int size = 0;
+	for (auto b : loop.blocks)
+	{
+		for (auto& instruction : function.blocks[b].instructions)
+		{
+			if (instruction.opcode != IrOpcode::Phi && !is_terminator(instruction.opcode))
+				size++;
+		}
+	}
+	return size;
+}
+
+// Number of trips for a loop which runs while (i op bound), where i starts at start and goes
+// up by step. Returns nothing if the loop doesn't end before i wraps around.
+std::optional<int64_t> count_trips(IrOpcode op, int64_t start, int64_t bound, int64_t step, int size)
+{
+	// Keep the arithmetic below well away from overflowing
+	constexpr int64_t limit = int64_t(1) << 61;
+	if (start <= -limit || start >= limit || bound <= -limit || bound >= limit || step <= -limit || step >= limit)
+		return std::nullopt;
+
+	auto holds = [&](int64_t i)
+	{
+		switch (op)
+		{
+			case IrOpcode::CmpEq: return i == bound;
+			case IrOpcode::CmpNe: return i != bound;
+			case IrOpcode::CmpGt: return i > bound;
+			case IrOpcode::CmpGe: return i >= bound;
+			case IrOpcode::CmpLt: return i < bound;
+			case IrOpcode::CmpLe: return i <= bound;
+			default: return false;
+		}
+	};
+
+	if (!holds(start))
+		return 0;
+	if (step == 0)
+		return std::nullopt;
+
+	int64_t distance = bound - start;
+	int64_t trips;
+	switch (op)
+	{
+		case IrOpcode::CmpEq:
+			trips = 1;
+			break;
+		case IrOpcode::CmpNe:
+			if (distance % step != 0 || distance / step <= 0)
+				return std::nullopt;
+			trips = distance / step;
+			break;
+		case IrOpcode::CmpLt:
+			if (step < 0) return std::nullopt;
+			trips = (distance + step - 1) / step;
+			break;
+		case IrOpcode::CmpLe:
+			if (step < 0) return std::nullopt;
+			trips = distance / step + 1;
+			break;
+		case IrOpcode::CmpGt:
+			if (step > 0) return std::nullopt;
+			trips = (distance + step + 1) / step;
+			break;
+		case IrOpcode::CmpGe:
+			if (step > 0) return std::nullopt;
+			trips = distance / step + 1;
+			break;
+		default:
+			return std::nullopt;
+	}
+
+	// The value which fails the compare must not have wrapped around
+	int64_t last = start + trips * step;
+	if (size < 8)
+	{
+		int64_t max = (int64_t(1) << (size * 8 - 1)) - 1;
+		if (last > max || last < -max - 1)
+			return std::nullopt;
+	}
+	return trips;
+}
+
+IrOpcode swap_compare(IrOpcode op)
+{
+	switch (op)
+	{
+		case IrOpcode::CmpGt: return IrOpcode::CmpLt;
+		case IrOpcode::CmpGe: return IrOpcode::CmpLe;
+		case IrOpcode::CmpLt: return IrOpcode::CmpGt;
+		case IrOpcode::CmpLe: return IrOpcode::CmpGe;
+		default: return op;
+	}
+}
+
+IrOpcode negate_compare(IrOpcode op)
+{
+	switch (op)
+	{
+		case IrOpcode::CmpEq: return IrOpcode::CmpNe;
+		case IrOpcode::CmpNe: return IrOpcode::CmpEq;
+		case IrOpcode::CmpGt: return IrOpcode::CmpLe;
+		case IrOpcode::CmpGe: return IrOpcode::CmpLt;
+		case IrOpcode::CmpLt: return IrOpcode::CmpGe;
+		case IrOpcode::CmpLe: return IrOpcode::CmpGt;
+		default: return op;
+	}
+}
+
+std::optional<CountedLoop> find_counted_loop(IrFunction& function, IrLoop& loop)
+{
+	if (loop.latches.size() != 1)
+		return std::nullopt;
+
+	CountedLoop counted;
+	counted.latch = loop.latches[0];
+	if (counted.latch == loop.header)
+		return std::nullopt;
+
+	std::vector<size_t> outside;
+	for (auto p : function.blocks[loop.header].predecessors)
+	{
+		if (!loop.contains(p))
+			outside.push_back(p);
+	}
+	if (outside.size() != 1)
+		return std::nullopt;
+	counted.entry = outside[0];
+
+	// Every other block stays in the loop until it gets back to the header
+	for (auto b : loop.blocks)
+	{
+		auto& terminator = function.blocks[b].terminator();
+		if (terminator.opcode != IrOpcode::Jump && terminator.opcode != IrOpcode::Branch)
+			return std::nullopt;
+		if (b == loop.header)
+			continue;
+		for (auto target : terminator.targets)
+		{
+			if (!loop.contains(target))
+				return std::nullopt;
+		}
+	}
+
+	auto& header = function.blocks[loop.header];
+	auto& branch = header.terminator();
+	if (branch.opcode != IrOpcode::Branch || loop.contains(branch.targets[0]) == loop.contains(branch.targets[1]))
+		return std::nullopt;
+	bool continue_if_true = loop.contains(branch.targets[0]);
+	counted.body = branch.targets[continue_if_true ? 0 : 1];
+	counted.exit = branch.targets[continue_if_true ? 1 : 0];
+
+	std::vector<const IrInstruction*> definitions(function.value_types.size(), nullptr);
+	for (auto& block : function.blocks)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			if (instruction.dest >= 0)
+				definitions[instruction.dest] = &instruction;
+		}
+	}
+
+	auto compare = std::find_if(header.instructions.begin(), header.instructions.end(), [&](IrInstruction& instruction) { return instruction.dest == branch.operands[0]; });
+	if (compare == header.instructions.end() || !is_compare(compare->opcode) || is_float_ir_type(compare->type))
+		return std::nullopt;
+
+	auto induction_variables = find_induction_variables(function, loop, counted.entry, definitions);
+	for (int i = 0; i < 2; i++)
+	{
+		auto iv = std::find_if(induction_variables.begin(), induction_variables.end(), [&](InductionVariable& iv) { return iv.phi == compare->operands[i]; });
+		auto bound = definitions[compare->operands[1 - i]];
+		if (iv == induction_variables.end() || !iv->initial_constant.has_value() || bound == nullptr || bound->opcode != IrOpcode::Const)
+			continue;
+
+		// Normalise the compare to (iv op bound), true when the loop carries on
+		IrOpcode op = i == 0 ? compare->opcode : swap_compare(compare->opcode);
+		if (!continue_if_true)
+			op = negate_compare(op);
+
+		int size = ir_type_size(compare->type);
+		counted.iv = *iv;
+		counted.type = compare->type;
+		counted.start = sign_extend_from_size(iv->initial_constant.value(), size);
+		counted.step = sign_extend_from_size(iv->step, size);
+
+		auto trips = count_trips(op, counted.start, sign_extend_from_size(bound->immediate, size), counted.step, size);
+		if (!trips.has_value())
+			return std::nullopt;
+
+		counted.trips = trips.value();
+		return counted;
+	}
+
+	return std::nullopt;
+}
+
+// A copy of the loop's blocks, appended to the function
+struct LoopCopy
+{
+	size_t first_block;      // The copy of loop.blocks[i] is first_block + i
+	std::vector<int> values; // The copy of each value defined in the loop, -1 for the others
+
+	size_t block(IrLoop& loop, size_t b) const
+	{
+		return first_block + (std::lower_bound(loop.blocks.begin(), loop.blocks.end(), b) - loop.blocks.begin());
+	}
+
+	int value(int v) const
+	{
+		return values[v] >= 0 ? values[v] : v;
+	}
+};
+
+// Copies the loop's blocks. The header's phis aren't copied, the copy uses incoming for
+// their values instead, in the order of the phis. Branches back to the header are left
+// for the caller to redirect.
+LoopCopy copy_loop(IrFunction& function, IrLoop& loop, const std::vector<int>& incoming)
+{
+	LoopCopy copy;
+	copy.first_block = function.blocks.size();
+	copy.values.assign(function.value_types.size(), -1);
+
+	// Name all the new values first, as phis can use values defined further on
+	size_t phi_index = 0;
+	for (auto b : loop.blocks)
+	{
+		for (auto& instruction : function.blocks[b].instructions)
+		{
+			if (instruction.dest < 0)
+				continue;
+
+			if (b == loop.header && instruction.opcode == IrOpcode::Phi)
+				copy.values[instruction.dest] = incoming[phi_index++];
+			else
+				copy.values[instruction.dest] = function.make_value(function.value_types[instruction.dest]);
+		}
+	}
+
+	function.blocks.resize(function.blocks.size() + loop.blocks.size());
+	for (size_t i = 0; i < loop.blocks.size(); i++)
+	{
+		function.blocks[copy.first_block + i].branchless_hint = function.blocks[loop.blocks[i]].branchless_hint;
+		for (auto instruction : function.blocks[loop.blocks[i]].instructions)
+		{
+			if (loop.blocks[i] == loop.header && instruction.opcode == IrOpcode::Phi)
+				continue;
+
+			if (instruction.dest >= 0)
+				instruction.dest = copy.values[instruction.dest];
+			for (auto& operand : instruction.operands)
+				operand = copy.value(operand);
+			for (auto& target : instruction.targets)
+			{
+				if (target != loop.header && loop.contains(target))
+					target = copy.block(loop, target);
+			}
+			for (auto& phi_block : instruction.phi_blocks)
+				phi_block = copy.block(loop, phi_block);
+
+			function.blocks[copy.first_block + i].instructions.push_back(std::move(instruction));
+		}
+	}
+
+	return copy;
+}
+
+void redirect_branches(IrBlock& block, size_t from, size_t to)
+{
+	for (auto& target : block.terminator().targets)
+	{
+		if (target == from)
+			target = to;
+	}
+}
+
+// Runs the loop's trips one after another in a straight line, entered by the branch from
+// entry to entry_target with the header phis set to incoming. The last copy of the header
+// jumps straight to the exit. If header_ran, entry is the original header, which has already
+// run for the first trip, so that trip starts from the body using the header's own values.
+LoopCopy copy_trips(IrFunction& function, IrLoop& loop, CountedLoop& counted, size_t entry, size_t entry_target, std::vector<int> incoming, int64_t trips, bool header_ran)
+{
+	// Nothing to copy, the exit is still reached from the original header
+	LoopCopy copy;
+	if (header_ran && trips == 0)
+		return copy;
+
+	for (int64_t trip = 0; trip <= trips; trip++)
+	{
+		copy = copy_loop(function, loop, incoming);
+
+		size_t header = copy.block(loop, loop.header);
+		if (trip == 0 && header_ran)
+		{
+			// The copy of the header isn't reached, so nothing can use its values
+			std::vector<int> replacements(function.value_types.size(), -1);
+			for (auto& instruction : function.blocks[loop.header].instructions)
+			{
+				if (instruction.dest >= 0 && instruction.opcode != IrOpcode::Phi)
+				{
+					replacements[copy.values[instruction.dest]] = instruction.dest;
+					copy.values[instruction.dest] = -1;
+				}
+			}
+			for (size_t b = copy.first_block; b < copy.first_block + loop.blocks.size(); b++)
+			{
+				for (auto& instruction : function.blocks[b].instructions)
+				{
+					for (auto& operand : instruction.operands)
+					{
+						if (replacements[operand] >= 0)
+							operand = replacements[operand];
+					}
+					for (auto& phi_block : instruction.phi_blocks)
+					{
+						if (phi_block == header)
+							phi_block = entry;
+					}
+				}
+			}
+
+			redirect_branches(function.blocks[entry], entry_target, copy.block(loop, counted.body));
+		}
+		else
+			redirect_branches(function.blocks[entry], entry_target, header);
+
+		// The number of trips is known, so the copies don't need the test
+		auto& terminator = function.blocks[header].terminator();
+		terminator.opcode = IrOpcode::Jump;
+		terminator.operands.clear();
+		terminator.targets = { trip == trips ? counted.exit : copy.block(loop, counted.body) };
+
+		entry = copy.block(loop, counted.latch);
+		entry_target = loop.header;
+		incoming.clear();
+		for (auto& phi : function.blocks[loop.header].instructions)
+		{
+			if (phi.opcode != IrOpcode::Phi)
+				break;
+			size_t i = phi.phi_blocks[0] == counted.latch ? 0 : 1;
+			incoming.push_back(copy.value(phi.operands[i]));
+		}
+	}
+
+	// The last copy of the header is now where the exit is reached from
+	size_t last_header = copy.block(loop, loop.header);
+	for (auto& instruction : function.blocks[counted.exit].instructions)
+	{
+		for (auto& phi_block : instruction.phi_blocks)
+		{
+			if (phi_block == loop.header)
+				phi_block = last_header;
+		}
+	}
+	return copy;
+}
+
+// Uses of the loop's values after the loop now use their values from the last copy of the header
+void use_copied_values(IrFunction& function, IrLoop& loop, LoopCopy& copy, size_t end_of_old_blocks)
+{
+	for (size_t b = 0; b < end_of_old_blocks; b++)
+	{
+		if (loop.contains(b))
+			continue;
+
+		for (auto& instruction : function.blocks[b].instructions)
+		{
+			for (auto& operand : instruction.operands)
+			{
+				if (operand < (int)copy.values.size())
+					operand = copy.value(operand);
+			}
+		}
+	}
+}
+
+std::vector<int> header_phi_values(IrFunction& function, IrLoop& loop, size_t from)
+{
+	std::vector<int> values;
+	for (auto& phi : function.blocks[loop.header].instructions)
+	{
+		if (phi.opcode != IrOpcode::Phi)
+			break;
+		for (size_t i = 0; i < phi.operands.size(); i++)
+		{
+			if (phi.phi_blocks[i] == from)
+				values.push_back(phi.operands[i]);
+		}
+	}
+	return values;
+}
+
+void unroll_completely(IrFunction& function, IrLoop& loop, CountedLoop& counted)
+{
+	size_t end_of_old_blocks = function.blocks.size();
+	auto incoming = header_phi_values(function, loop, counted.entry);
+	auto last = copy_trips(function, loop, counted, counted.entry, loop.header, incoming, counted.trips, false);
+	use_copied_values(function, loop, last, end_of_old_blocks);
+
+	// The original loop is no longer reached, and neither are the copies of the blocks after
+	// the last header copy
+	compute_predecessors(function);
+	remove_unreachable_blocks(function);
+}
+
+void unroll_partially(IrFunction& function, IrLoop& loop, CountedLoop& counted, int factor)
+{
+	size_t end_of_old_blocks = function.blocks.size();
+	int64_t unrolled_trips = counted.trips / factor * factor;
+
+	// The trips left over run in a straight line after the loop, starting from the values
+	// the header had when the loop finished. The header has already run for the first of them.
+	std::vector<int> phis;
+	for (auto& phi : function.blocks[loop.header].instructions)
+	{
+		if (phi.opcode != IrOpcode::Phi)
+			break;
+		phis.push_back(phi.dest);
+	}
+	auto last = copy_trips(function, loop, counted, loop.header, counted.exit, phis, counted.trips - unrolled_trips, true);
+	use_copied_values(function, loop, last, end_of_old_blocks);
+
+	// Chain copies of the whole loop body onto the end of the original. They're all made
+	// before any are linked up, so none copies a branch which has already been redirected.
+	std::vector<LoopCopy> copies;
+	auto latch_values = header_phi_values(function, loop, counted.latch);
+	auto incoming = latch_values;
+	for (int i = 1; i < factor; i++)
+	{
+		copies.push_back(copy_loop(function, loop, incoming));
+		for (size_t v = 0; v < incoming.size(); v++)
+			incoming[v] = copies.back().value(latch_values[v]);
+	}
+
+	size_t latch = counted.latch;
+	for (auto& copy : copies)
+	{
+		size_t header = copy.block(loop, loop.header);
+		redirect_branches(function.blocks[latch], loop.header, header);
+
+		auto& terminator = function.blocks[header].terminator();
+		terminator.opcode = IrOpcode::Jump;
+		terminator.operands.clear();
+		terminator.targets = { copy.block(loop, counted.body) };
+
+		latch = copy.block(loop, counted.latch);
+	}
+
+	// The back edge now comes from the last copy
+	size_t phi_index = 0;
+	auto& header = function.blocks[loop.header];
+	for (auto& phi : header.instructions)
+	{
+		if (phi.opcode != IrOpcode::Phi)
+			break;
+		for (size_t i = 0; i < phi.operands.size(); i++)
+		{
+			if (phi.phi_blocks[i] == counted.latch)
+			{
+				phi.operands[i] = incoming[phi_index];
+				phi.phi_blocks[i] = latch;
+			}
+		}
+		phi_index++;
+	}
+
+	// Test for the value the induction variable has after the unrolled trips, rather than
+	// the original bound, so the loop stops before running past the end
+	std::vector<IrInstruction> test(2);
+	test[0].opcode = IrOpcode::Const;
+	test[0].type = counted.type;
+	test[0].dest = function.make_value(counted.type);
+	test[0].immediate = truncate_to_size(counted.start + unrolled_trips * counted.step, ir_type_size(counted.type));
+
+	auto& branch = header.terminator();
+	test[1].opcode = branch.targets[0] == counted.body ? IrOpcode::CmpNe : IrOpcode::CmpEq;
+	test[1].type = counted.type;
+	test[1].dest = function.make_value(IrType::I8);
+	test[1].operands = { counted.iv.phi, test[0].dest };
+	branch.operands = { test[1].dest };
+	insert_before_terminator(header, test);
+
+	// Don't unroll the unrolled loop again
+	header.unroll_hint = 1;
+
+	// The copies of the blocks after the last header copy in the remainder aren't reached
+	compute_predecessors(function);
+	remove_unreachable_blocks(function);
+}
+
+bool unroll_loop(IrFunction& function, IrLoop& loop, bool has_inner_loops)
+{
+	int64_t hint = function.blocks[loop.header].unroll_hint;
+	if (hint == 1 || (has_inner_loops && hint == 0))
+		return false;
+
+	auto counted = find_counted_loop(function, loop);
+	if (!counted.has_value())
+		return false;
+
+	int64_t size = loop_size(function, loop);
+	int64_t trips = counted->trips;
+	if (hint != 0)
+		hint = std::min(hint, std::max<int64_t>(1, hinted_unroll_budget / std::max<int64_t>(size, 1)));
+	if (hint != 0 ? trips <= hint : trips <= full_unroll_max_trips && trips * size <= full_unroll_budget)
+	{
+		unroll_completely(function, loop, counted.value());
+		add_statistic("unroll.complete");
+		return true;
+	}
+
+	int factor = (int)hint;
+	if (factor == 0)
+	{
+		factor = partial_unroll_factor;
+		while (factor > 1 && factor * size > partial_unroll_budget)
+			factor /= 2;
+	}
+	if (factor < 2)
+		return false;
+
+	unroll_partially(function, loop, counted.value(), factor);
+	add_statistic("unroll.partial");
+	return true;
+}
+
+bool unroll_loops(IrFunction& function)
+{
+	bool changed = false;
+	bool progress = true;
+	while (progress)
+	{
+		progress = false;
+		auto loops = find_loops(function);
+		for (auto& loop : loops)
+		{
+			bool has_inner_loops = std::any_of(loops.begin(), loops.end(), [&](IrLoop& other) { return other.header != loop.header && loop.contains(other.header); });
+			if (unroll_loop(function, loop, has_inner_loops))
+			{
+				changed = progress = true;
+				break;
+			}
+		}
+	}
+
+	return changed;
+}
@@ -0,0 +1,610 @@
+#include "machine.h"
+
+#include "errors.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <inttypes.h>
+
+const char* register_name_data[] =
+{
+	 "al", "ax", "eax", "rax",     // 0
+	 "bl", "bx", "ebx", "rbx",     // 1
+	 "cl", "cx", "ecx", "rcx",     // 2
+	 "dl", "dx", "edx", "rdx",     // 3
+	"sil", "si", "esi", "rsi",     // 4
+	"dil", "di", "edi", "rdi",     // 5
+	"bpl", "bp", "ebp", "rbp",     // 6
+	"spl", "sp", "esp", "rsp",     // 7
+	"r8b", "r8w", "r8d", "r8",     // 8
+	"r9b", "r9w", "r9d", "r9",     // 9
+	"r10b", "r10w", "r10d", "r10", // 10
+	"r11b", "r11w", "r11d", "r11", // 11
+	"r12b", "r12w", "r12d", "r12", // 12
+	"r13b", "r13w", "r13d", "r13", // 13
+	"r14b", "r14w", "r14d", "r14", // 14
+	"r15b", "r15w", "r15d", "r15"  // 15
+};
+
+const char* register_name(int reg, int bytes)
+{
+	if (reg < 0 || reg >= 16) internal_error("Invalid register");
+
+	     if (bytes == 1) return register_name_data[reg * 4 + 0];
+	else if (bytes == 2) return register_name_data[reg * 4 + 1];
+	else if (bytes == 4) return register_name_data[reg * 4 + 2];
+	else if (bytes == 8) return register_name_data[reg * 4 + 3];
+	else
+		internal_error("Invalid register size");
+}
+
+const char* xmm_register_name_data[] =
+{
+	"xmm0", "xmm1", "xmm2", "xmm3",
+	"xmm4", "xmm5", "xmm6", "xmm7",
+	"xmm8", "xmm9", "xmm10", "xmm11",
+	"xmm12", "xmm13", "xmm14", "xmm15"
+};
+
+const char* xmm_register_name(int reg)
+{
+	if (reg < 16 || reg >= 32) internal_error("Invalid xmm register");
+
+	return xmm_register_name_data[reg - 16];
+}
+
+// "Volatile"/"Call clobbered registers" are free to use within a function but need to be saved before a call
+int caller_saved_registers[9] = { 0, 2, 3, 4, 5, 8, 9, 10, 11 };
+// "Call preserved registers" need to be saved and restored within the function if they are used
+int callee_saved_registers[6] = { 1, 6, 12, 13, 14, 15 };
+
+const char* opcode_names[] =
+{
+	"",
+	"mov",
+	"movzx",
+	"movsx",
+	"movsxd",
+	"lea",
+	"add",
+	"sub",
+	"inc",
+	"dec",
+	"imul",
+	"imul",
+	"div",
+	"idiv",
+	"cqo",
+	"cdq",
+	"shl",
+	"shr",
+	"sar",
+	"xor",
+	"and",
+	"or",
+	"cmp",
+	"test",
+	"sete",
+	"setne",
+	"setg",
+	"setge",
+	"setl",
+	"setle",
+	"seta",
+	"setnb",
+	"cmove",
+	"cmovne",
+	"cmovg",
+	"cmovge",
+	"cmovl",
+	"cmovle",
+	"cmova",
+	"cmovae",
+	"jmp",
+	"jz",
+	"je",
+	"jne",
+	"jg",
+	"jge",
+	"jl",
+	"jle",
+	"ja",
+	"jae",
+	"jb",
+	"jbe",
+	"call",
+	"ret",
+	"jmp",
+	"movsd",
+	"movss",
+	"movaps",
+	"addsd",
+	"subsd",
+	"mulsd",
+	"divsd",
+	"addss",
+	"subss",
+	"mulss",
+	"divss",
+	"minsd",
+	"maxsd",
+	"minss",
+	"maxss",
+	"comisd",
+	"ucomiss",
+	"cvtsd2ss",
+	"xorps",
+	"movdqu",
+	"rep stosb",
+	"rep movsb"
+};
+
+bool defines_first_operand(MachineOpcode opcode)
+{
+	switch (opcode)
+	{
+		case MachineOpcode::Mov:
+		case MachineOpcode::Movzx:
+		case MachineOpcode::Movsx:
+		case MachineOpcode::Movsxd:
+		case MachineOpcode::Lea:
+		case MachineOpcode::Add:
+		case MachineOpcode::Sub:
+		case MachineOpcode::Inc:
+		case MachineOpcode::Dec:
+		case MachineOpcode::Imul:
+		case MachineOpcode::Shl:
+		case MachineOpcode::Shr:
+		case MachineOpcode::Sar:
+		case MachineOpcode::Xor:
+		case MachineOpcode::And:
+		case MachineOpcode::Or:
+		case MachineOpcode::Sete:
+		case MachineOpcode::Setne:
+		case MachineOpcode::Setg:
+		case MachineOpcode::Setge:
+		case MachineOpcode::Setl:
+		case MachineOpcode::Setle:
+		case MachineOpcode::Seta:
+		case MachineOpcode::Setnb:
+		case MachineOpcode::Cmove:
+		case MachineOpcode::Cmovne:
+		case MachineOpcode::Cmovg:
+		case MachineOpcode::Cmovge:
+		case MachineOpcode::Cmovl:
+		case MachineOpcode::Cmovle:
+		case MachineOpcode::Cmova:
+		case MachineOpcode::Cmovae:
+		case MachineOpcode::Movsd:
+		case MachineOpcode::Movss:
+		case MachineOpcode::Movaps:
+		case MachineOpcode::Addsd:
+		case MachineOpcode::Subsd:
+		case MachineOpcode::Mulsd:
+		case MachineOpcode::Divsd:
+		case MachineOpcode::Addss:
+		case MachineOpcode::Subss:
+		case MachineOpcode::Mulss:
+		case MachineOpcode::Divss:
+		case MachineOpcode::Minsd:
+		case MachineOpcode::Maxsd:
+		case MachineOpcode::Minss:
+		case MachineOpcode::Maxss:
+		case MachineOpcode::Cvtsd2ss:
+		case MachineOpcode::Xorps:
+		case MachineOpcode::Movdqu:
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool uses_first_operand(MachineOpcode opcode)
+{
+	switch (opcode)
+	{
+		case MachineOpcode::Add:
+		case MachineOpcode::Sub:
+		case MachineOpcode::Inc:
+		case MachineOpcode::Dec:
+		case MachineOpcode::Imul:
+		case MachineOpcode::ImulWide:
+		case MachineOpcode::Div:
+		case MachineOpcode::Idiv:
+		case MachineOpcode::Shl:
+		case MachineOpcode::Shr:
+		case MachineOpcode::Sar:
+		case MachineOpcode::Xor:
+		case MachineOpcode::And:
+		case MachineOpcode::Or:
+		case MachineOpcode::Cmp:
+		case MachineOpcode::Test:
+		case MachineOpcode::Cmove:
+		case MachineOpcode::Cmovne:
+		case MachineOpcode::Cmovg:
+		case MachineOpcode::Cmovge:
+		case MachineOpcode::Cmovl:
+		case MachineOpcode::Cmovle:
+		case MachineOpcode::Cmova:
+		case MachineOpcode::Cmovae:
+		case MachineOpcode::Addsd:
+		case MachineOpcode::Subsd:
+		case MachineOpcode::Mulsd:
+		case MachineOpcode::Divsd:
+		case MachineOpcode::Addss:
+		case MachineOpcode::Subss:
+		case MachineOpcode::Mulss:
+		case MachineOpcode::Divss:
+		case MachineOpcode::Minsd:
+		case MachineOpcode::Maxsd:
+		case MachineOpcode::Minss:
+		case MachineOpcode::Maxss:
+		case MachineOpcode::Comisd:
+		case MachineOpcode::Ucomiss:
+		case MachineOpcode::Xorps:
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool is_zeroing_idiom(const MachineInstruction& mi)
+{
+	return (mi.opcode == MachineOpcode::Xor || mi.opcode == MachineOpcode::Xorps)
+		&& mi.operands[0].is_register() && mi.operands[1].is_register()
+		&& mi.operands[0].reg == mi.operands[1].reg;
+}
+
+bool is_jump(MachineOpcode opcode)
+{
+	return opcode == MachineOpcode::Jmp || is_conditional_jump(opcode);
+}
+
+bool is_conditional_jump(MachineOpcode opcode)
+{
+	return opcode >= MachineOpcode::Jz && opcode <= MachineOpcode::Jbe;
+}
+
+bool is_function_exit(MachineOpcode opcode)
+{
+	return opcode == MachineOpcode::Ret || opcode == MachineOpcode::TailJmp;
+}
+
+// 64 bit operations take a sign extended 32 bit immediate
+bool immediate_fits(int64_t value, int size)
+{
+	if (size == 8) return value >= INT32_MIN && value <= INT32_MAX;
+	if (size == 4) return value >= INT32_MIN && value <= UINT32_MAX;
+	if (size == 2) return value >= INT16_MIN && value <= UINT16_MAX;
+	return value >= INT8_MIN && value <= UINT8_MAX;
+}
+
+MachineOperand machine_register(int reg, int size)
+{
+	MachineOperand op;
+	op.type = MachineOperandType::Register;
+	op.reg = reg;
+	op.size = size;
+	return op;
+}
+
+MachineOperand machine_immediate(int64_t value)
+{
+	MachineOperand op;
+	op.type = MachineOperandType::Immediate;
+	op.value = value;
+	return op;
+}
+
+MachineOperand machine_stack(uint32_t stack_offset, int size)
+{
+	return machine_memory(-1, -(int32_t)stack_offset, size);
+}
+
+MachineOperand machine_memory(int base_reg, int32_t displacement, int size)
+{
+	MachineOperand op;
+	op.type = MachineOperandType::Memory;
+	op.reg = base_reg;
+	op.value = displacement;
+	op.size = size;
+	return op;
+}
+
+MachineOperand machine_indexed(int base_reg, int index_reg, int scale, int32_t displacement, int size)
+{
+	MachineOperand op = machine_memory(base_reg, displacement, size);
+	op.index = index_reg;
+	op.scale = scale;
+	return op;
+}
+
+MachineOperand machine_global(const std::string& symbol, int size)
+{
+	MachineOperand op;
+	op.type = MachineOperandType::Memory;
+	op.symbol = symbol;
+	op.size = size;
+	return op;
+}
+
+MachineOperand machine_label(size_t label)
+{
+	MachineOperand op;
+	op.type = MachineOperandType::Label;
+	op.value = label;
+	return op;
+}
+
+MachineOperand machine_symbol(const std::string& symbol)
+{
+	MachineOperand op;
+	op.type = MachineOperandType::Symbol;
+	op.symbol = symbol;
+	return op;
+}
+
+int MachineFunction::make_virtual_register(bool is_float)
+{
+	virtual_register_is_float.push_back(is_float);
+	return first_virtual_register + virtual_register_is_float.size() - 1;
+}
+
+void MachineFunction::add(MachineOpcode opcode)
+{
+	auto& mi = instructions.emplace_back();
+	mi.opcode = opcode;
+}
+
+void MachineFunction::add(MachineOpcode opcode, const MachineOperand& op0)
+{
+	auto& mi = instructions.emplace_back();
+	mi.opcode = opcode;
+	mi.operands[0] = op0;
+	mi.num_operands = 1;
+}
+
+void MachineFunction::add(MachineOpcode opcode, const MachineOperand& op0, const MachineOperand& op1)
+{
+	auto& mi = instructions.emplace_back();
+	mi.opcode = opcode;
+	mi.operands[0] = op0;
+	mi.operands[1] = op1;
+	mi.num_operands = 2;
+}
+
+void print_register(FILE* file, int reg, int size)
+{
+	if (reg >= first_virtual_register)
+		fprintf(file, "v%d", reg - first_virtual_register);
+	else if (reg >= 16)
+		fprintf(file, "%s", xmm_register_name(reg));
+	else
+		fprintf(file, "%s", register_name(reg, size));
+}
+
+void print_operand(FILE* file, const MachineFunction& mf, const MachineOperand& op)
+{
+	if (op.type == MachineOperandType::Register)
+		print_register(file, op.reg, op.size);
+	else if (op.type == MachineOperandType::Immediate)
+		fprintf(file, "%" PRId64, op.value);
+	else if (op.type == MachineOperandType::Memory)
+	{
+		if (op.explicit_size)
+		{
+			     if (op.size == 1) fprintf(file, "byte ");
+			else if (op.size == 2) fprintf(file, "word ");
+			else if (op.size == 4) fprintf(file, "dword ");
+			else if (op.size == 8) fprintf(file, "qword ");
+		}
+
+		// Without a frame pointer, rsp is stack_adjust bytes below the return address, and the
+		// return address is 8 bytes above where rbp would point
+		int64_t displacement = op.value;
+		fprintf(file, "[");
+		if (op.is_frame_slot() && mf.omit_frame_pointer)
+		{
+			fprintf(file, "rsp");
+			displacement += (int64_t)mf.stack_adjust - 8;
+		}
+		else if (op.is_frame_slot())
+			fprintf(file, "rbp");
+		else if (op.reg >= 0)
+			print_register(file, op.reg, 8);
+		else if (op.external && get_platform() == Platform::Linux)
+			fprintf(file, "rel %s wrt ..gotpcrel", op.symbol.c_str());
+		else
+			fprintf(file, "rel %s", op.symbol.c_str());
+
+		if (op.index >= 0)
+		{
+			fprintf(file, " + ");
+			print_register(file, op.index, 8);
+			if (op.scale != 1)
+				fprintf(file, "*%d", op.scale);
+		}
+
+		if (displacement < 0)
+			fprintf(file, " - %" PRId64, -displacement);
+		else if (displacement > 0)
+			fprintf(file, " + %" PRId64, displacement);
+		fprintf(file, "]");
+	}
+	else if (op.type == MachineOperandType::Label)
+		fprintf(file, ".L%" PRId64, op.value);
+	else if (op.type == MachineOperandType::Symbol)
+		fprintf(file, "%s%s", op.symbol.c_str(), op.external && get_platform() == Platform::Linux ? " wrt ..plt" : "");
+	else
+		internal_error("Unhandled machine operand type");
+}
+
+std::vector<MachineBlock> build_blocks(MachineFunction& mf)
+{
+	std::vector<MachineBlock> blocks;
+	std::vector<size_t> label_blocks;
+
+	auto& instructions = mf.instructions;
+	for (size_t i = 0; i < instructions.size(); i++)
+	{
+		bool starts_block = i == 0
+			|| instructions[i].opcode == MachineOpcode::Label
+			|| is_jump(instructions[i - 1].opcode)
+			|| is_function_exit(instructions[i - 1].opcode);
+
+		if (starts_block)
+		{
+			auto& block = blocks.emplace_back();
+			block.first = i;
+		}
+		blocks.back().last = i;
+
+		if (instructions[i].opcode == MachineOpcode::Label)
+		{
+			size_t label = instructions[i].operands[0].value;
+			if (label >= label_blocks.size())
+				label_blocks.resize(label + 1);
+			label_blocks[label] = blocks.size() - 1;
+		}
+	}
+
+	for (size_t b = 0; b < blocks.size(); b++)
+	{
+		auto& last = instructions[blocks[b].last];
+		if (is_jump(last.opcode))
+			blocks[b].successors.push_back(label_blocks[last.operands[0].value]);
+
+		bool falls_through = last.opcode != MachineOpcode::Jmp && !is_function_exit(last.opcode);
+		if (falls_through && b + 1 < blocks.size())
+			blocks[b].successors.push_back(b + 1);
+	}
+
+	return blocks;
+}
+
+std::optional<MachineOpcode> find_machine_opcode(const std::string& name)
+{
+	for (size_t i = 0; i < sizeof(opcode_names) / sizeof(opcode_names[0]); i++)
+	{
+		if (name == opcode_names[i])
+			return (MachineOpcode)i;
+	}
+	return std::nullopt;
+}
+
+bool is_leaf_function(const MachineFunction& mf)
+{
+	return std::none_of(mf.instructions.begin(), mf.instructions.end(), [](const MachineInstruction& mi) { return mi.opcode == MachineOpcode::Call; });
+}
+
+bool is_redundant_move(const MachineInstruction& mi)
+{
+	if (mi.opcode != MachineOpcode::Mov && mi.opcode != MachineOpcode::Movaps
+	 && mi.opcode != MachineOpcode::Movsd && mi.opcode != MachineOpcode::Movss)
+		return false;
+
+	auto& op0 = mi.operands[0];
+	auto& op1 = mi.operands[1];
+
+	// A 4 byte move to itself isn't redundant because it zeroes the upper half of the register
+	return op0.is_register() && op1.is_register() && op0.reg == op1.reg && (op0.size == op1.size && op0.size != 4);
+}
+
+void emit_epilogue(FILE* file, MachineFunction& mf)
+{
+	for (auto [reg, stack_offset] : mf.callee_saved)
+	{
+		fprintf(file, "    mov %s, ", register_name(reg, 8));
+		print_operand(file, mf, machine_stack(stack_offset, 8));
+		fprintf(file, "\n");
+	}
+
+	if (!mf.omit_frame_pointer)
+		fprintf(file, "    leave\n");
+	else if (mf.stack_adjust != 0)
+		fprintf(file, "    add rsp, %u\n", mf.stack_adjust);
+}
+
+void align_loop_headers(MachineFunction& mf)
+{
+	std::vector<bool> label_seen;
+	for (auto& mi : mf.instructions)
+	{
+		size_t label = mi.operands[0].value;
+		if (mi.opcode == MachineOpcode::Label)
+		{
+			if (label >= label_seen.size())
+				label_seen.resize(label + 1);
+			label_seen[label] = true;
+		}
+		else if (is_jump(mi.opcode) && label < label_seen.size() && label_seen[label])
+		{
+			if (std::find(mf.aligned_labels.begin(), mf.aligned_labels.end(), label) == mf.aligned_labels.end())
+				mf.aligned_labels.push_back(label);
+		}
+	}
+}
+
+void emit_machine_function(FILE* file, MachineFunction& mf)
+{
+	fprintf(file, "%s:\n", mf.asm_name.c_str());
+
+	// Function preamble
+	if (!mf.omit_frame_pointer)
+	{
+		fprintf(file, "    push rbp\n");
+		fprintf(file, "    mov rbp, rsp\n");
+		if (mf.frame_size != 0)
+			fprintf(file, "    sub rsp, %u\n", mf.frame_size);
+	}
+	else if (mf.stack_adjust != 0)
+		fprintf(file, "    sub rsp, %u\n", mf.stack_adjust);
+
+	for (auto [reg, stack_offset] : mf.callee_saved)
+	{
+		fprintf(file, "    mov ");
+		print_operand(file, mf, machine_stack(stack_offset, 8));
+		fprintf(file, ", %s\n", register_name(reg, 8));
+	}
+
+	for (auto& mi : mf.instructions)
+	{
+		if (mi.opcode == MachineOpcode::Label)
+		{
+			if (std::find(mf.aligned_labels.begin(), mf.aligned_labels.end(), (size_t)mi.operands[0].value) != mf.aligned_labels.end())
+				fprintf(file, "    align 16\n");
+			fprintf(file, ".L%" PRId64 ":\n", mi.operands[0].value);
+			continue;
+		}
+
+		if (mi.opcode == MachineOpcode::Ret)
+		{
+			emit_epilogue(file, mf);
+			fprintf(file, "    ret\n");
+			continue;
+		}
+
+		// The callee returns straight to our caller
+		if (mi.opcode == MachineOpcode::TailJmp)
+		{
+			emit_epilogue(file, mf);
+			fprintf(file, "    jmp ");
+			print_operand(file, mf, mi.operands[0]);
+			fprintf(file, "\n");
+			continue;
+		}
+
+		if (is_redundant_move(mi))
+			continue;
+
+		fprintf(file, "    %s", opcode_names[(int)mi.opcode]);
+		for (int i = 0; i < mi.num_operands; i++)
+		{
+			fprintf(file, i == 0 ? " " : ", ");
+			print_operand(file, mf, mi.operands[i]);
+		}
+		fprintf(file, "\n");
+	}
+
+	fprintf(file, "\n");
+}
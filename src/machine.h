@@ -0,0 +1,249 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <optional>
+#include <string>
+#include <vector>
+
+// Registers 0-15 are the general purpose registers and 16-31 are the xmm registers.
+// Register numbers from first_virtual_register upwards are virtual registers, which
+// are mapped to physical registers (or stack slots) by the register allocator.
+constexpr int first_virtual_register = 32;
+
+const char* register_name(int reg, int bytes);
+const char* xmm_register_name(int reg);
+
+extern int caller_saved_registers[9];
+extern int callee_saved_registers[6];
+
+enum class MachineOpcode
+{
+	Label, // Pseudo instruction, operand 0 is the label
+	Mov,
+	Movzx,
+	Movsx,
+	Movsxd,
+	Lea,
+	Add,
+	Sub,
+	Inc,
+	Dec,
+	Imul,
+	ImulWide, // One operand form, rdx:rax = rax * operand
+	Div,
+	Idiv,
+	Cqo,
+	Cdq,
+	Shl,
+	Shr,
+	Sar,
+	Xor,
+	And,
+	Or,
+	Cmp,
+	Test,
+	Sete,
+	Setne,
+	Setg,
+	Setge,
+	Setl,
+	Setle,
+	Seta,
+	Setnb,
+	Cmove,
+	Cmovne,
+	Cmovg,
+	Cmovge,
+	Cmovl,
+	Cmovle,
+	Cmova,
+	Cmovae,
+	Jmp,
+	Jz,
+	Je,
+	Jne,
+	Jg,
+	Jge,
+	Jl,
+	Jle,
+	Ja,
+	Jae,
+	Jb,
+	Jbe,
+	Call,
+	Ret, // Pseudo instruction, expanded to the function epilogue when emitted
+	TailJmp, // Pseudo instruction, the function epilogue without the ret, then a jmp to the symbol
+	Movsd,
+	Movss,
+	Movaps,
+	Addsd,
+	Subsd,
+	Mulsd,
+	Divsd,
+	Addss,
+	Subss,
+	Mulss,
+	Divss,
+	Minsd,
+	Maxsd,
+	Minss,
+	Maxss,
+	Comisd,
+	Ucomiss,
+	Cvtsd2ss,
+	Xorps,
+	Movdqu,
+	RepStosb, // rcx bytes at rdi set to al
+	RepMovsb  // rcx bytes copied from rsi to rdi
+};
+
+enum class MachineOperandType
+{
+	None,
+	Register,
+	Immediate,
+	Memory,
+	Label,
+	Symbol
+};
+
+struct MachineOperand
+{
+	MachineOperandType type = MachineOperandType::None;
+
+	// Register: the register. Memory: the base register, or -1 if addressing a symbol or a
+	// slot in the frame
+	int reg = -1;
+	// Memory: the index register, or -1 if there isn't one, and what it is multiplied by
+	int index = -1;
+	int scale = 1;
+	// Size of the register or memory access in bytes
+	int size = 8;
+	// Immediate value, memory displacement or label index. Frame slots are at a negative
+	// displacement from where rbp points when there's a frame pointer
+	int64_t value = 0;
+	// Memory or Symbol: the symbol name, e.g. GVAR0 or a function name. Memory operands
+	// addressing a symbol are RIP-relative
+	std::string symbol;
+	// Memory or Symbol: the symbol is a function defined outside the program, which is called
+	// through the PLT and whose address is loaded from the GOT
+	bool external = false;
+	// Print the size (e.g. "byte [rax]") for memory operands where the other operand doesn't imply it
+	bool explicit_size = false;
+
+	bool is_register() const { return type == MachineOperandType::Register; }
+	bool is_virtual_register() const { return type == MachineOperandType::Register && reg >= first_virtual_register; }
+	bool is_frame_slot() const { return type == MachineOperandType::Memory && reg < 0 && symbol.empty(); }
+};
+
+MachineOperand machine_register(int reg, int size = 8);
+MachineOperand machine_immediate(int64_t value);
+MachineOperand machine_stack(uint32_t stack_offset, int size);
+MachineOperand machine_memory(int base_reg, int32_t displacement, int size);
+MachineOperand machine_indexed(int base_reg, int index_reg, int scale, int32_t displacement, int size);
+MachineOperand machine_global(const std::string& symbol, int size);
+MachineOperand machine_label(size_t label);
+MachineOperand machine_symbol(const std::string& symbol);
+
+struct MachineInstruction
+{
+	MachineOpcode opcode;
+	MachineOperand operands[2];
+	int num_operands = 0;
+
+	// Physical registers read or written by the instruction which don't appear as operands,
+	// e.g. argument registers for a call
+	uint32_t implicit_uses = 0;
+	uint32_t implicit_defs = 0;
+};
+
+bool defines_first_operand(MachineOpcode opcode);
+bool uses_first_operand(MachineOpcode opcode);
+// xor of a register with itself only writes the register, it doesn't depend on the old value
+bool is_zeroing_idiom(const MachineInstruction& mi);
+// A move from a register to itself which doesn't change it
+bool is_redundant_move(const MachineInstruction& mi);
+bool is_jump(MachineOpcode opcode);
+bool is_conditional_jump(MachineOpcode opcode);
+// Ret and TailJmp, which leave the function
+bool is_function_exit(MachineOpcode opcode);
+// Whether an immediate can be encoded in an instruction operating on size bytes
+bool immediate_fits(int64_t value, int size);
+
+struct MachineFunction
+{
+	std::string asm_name;
+	std::vector<MachineInstruction> instructions;
+	std::vector<bool> virtual_register_is_float; // Indexed by (virtual register - first_virtual_register)
+
+	// Bytes of the frame used by variables in memory, as computed by the sizer
+	uint32_t stack_size = 0;
+
+	// Set before register allocation. Without a frame pointer, frame slots are addressed from
+	// rsp and rbp is allocated like any other callee saved register
+	bool omit_frame_pointer = false;
+
+	// Filled in by the register allocator
+	uint32_t frame_size = 0;
+	std::vector<std::pair<int, uint32_t>> callee_saved; // (register, stack offset) pairs saved in the prologue
+	// Bytes the prologue subtracts from rsp when there's no frame pointer. Zero for a leaf
+	// function whose frame fits in the red zone below rsp
+	uint32_t stack_adjust = 0;
+
+	// Labels emitted aligned to 16 bytes
+	std::vector<size_t> aligned_labels;
+
+	int make_virtual_register(bool is_float);
+
+	void add(MachineOpcode opcode);
+	void add(MachineOpcode opcode, const MachineOperand& op0);
+	void add(MachineOpcode opcode, const MachineOperand& op0, const MachineOperand& op1);
+};
+
+// A straight line run of instructions, split at labels and after jumps
+struct MachineBlock
+{
+	size_t first;
+	size_t last;
+	std::vector<size_t> successors;
+};
+
+std::vector<MachineBlock> build_blocks(MachineFunction& mf);
+
+// Makes no calls, so the red zone below rsp is never overwritten
+bool is_leaf_function(const MachineFunction& mf);
+
+// Aligns the labels which are jumped to from further on, which are the tops of loops
+void align_loop_headers(MachineFunction& mf);
+
+// Calls use for every register read by the instruction and def for every register it writes
+template <typename UseFunc, typename DefFunc>
+void for_each_register(const MachineInstruction& mi, UseFunc use, DefFunc def)
+{
+	for (int i = 0; i < mi.num_operands && !is_zeroing_idiom(mi); i++)
+	{
+		auto& op = mi.operands[i];
+		if (op.type == MachineOperandType::Memory)
+		{
+			if (op.reg >= 0) use(op.reg);
+			if (op.index >= 0) use(op.index);
+		}
+		else if (op.type == MachineOperandType::Register && (i != 0 || uses_first_operand(mi.opcode)))
+			use(op.reg);
+	}
+
+	for (int r = 0; r < 32; r++)
+		if (mi.implicit_uses & (1u << r)) use(r);
+
+	if (mi.num_operands > 0 && mi.operands[0].type == MachineOperandType::Register && defines_first_operand(mi.opcode))
+		def(mi.operands[0].reg);
+
+	for (int r = 0; r < 32; r++)
+		if (mi.implicit_defs & (1u << r)) def(r);
+}
+
+std::optional<MachineOpcode> find_machine_opcode(const std::string& name);
+
+void emit_machine_function(FILE* file, MachineFunction& mf);
@@ -2,11 +2,14 @@
 #include "lexer.h"
 #include "parser.h"
 #include "codegen.h"
+#include "irgen.h"
+#include "optimiser.h"
 #include "typecheck.h"
 #include "errors.h"
 #include "utils.h"
 #include "file_table.h"
 #include "sizer.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,6 +29,11 @@ struct CommandLineOptions
 	std::optional<std::string> output_binary;
 	std::optional<std::string> output_asm;
 	std::optional<std::string> output_debug_data;
+	std::optional<std::string> output_ir;
+	int optimisation_level = 1;
+	bool time_passes = false;
+	bool print_statistics = false;
+	bool reorder_struct_members = false;
 };
 
 void fail_usage(const char* executable_name)
@@ -36,6 +44,11 @@ void fail_usage(const char* executable_name)
 	printf("  -o <file>                    Output binary name\n");
 	printf("  -a <file>                    Output assembly file\n");
 	printf("  --dump-symbols <file>        Dump debug information\n");
+	printf("  --emit-ir <file>             Output the IR after optimisation\n");
+	printf("  -O0, -O1, -O2                Optimisation level (default -O1)\n");
+	printf("  --time-passes                Print the time taken by each optimisation pass\n");
+	printf("  --stats                      Print counts of the optimisations applied\n");
+	printf("  --reorder-struct-members     Lay out struct members by alignment to remove padding\n");
 	printf("  -h                           Print this message\n");
 	printf("\n");
 	exit(1);
@@ -75,6 +88,28 @@ CommandLineOptions parse_arguments(int argc, char** argv)
 			do_flag(options.output_asm);
 		else if (strcmp(argv[current_arg], "--dump-symbols") == 0)
 			do_flag(options.output_debug_data);
+		else if (strcmp(argv[current_arg], "--emit-ir") == 0)
+			do_flag(options.output_ir);
+		else if (strcmp(argv[current_arg], "-O0") == 0 || strcmp(argv[current_arg], "-O1") == 0 || strcmp(argv[current_arg], "-O2") == 0)
+		{
+			options.optimisation_level = argv[current_arg][2] - '0';
+			current_arg += 1;
+		}
+		else if (strcmp(argv[current_arg], "--time-passes") == 0)
+		{
+			options.time_passes = true;
+			current_arg += 1;
+		}
+		else if (strcmp(argv[current_arg], "--stats") == 0)
+		{
+			options.print_statistics = true;
+			current_arg += 1;
+		}
+		else if (strcmp(argv[current_arg], "--reorder-struct-members") == 0)
+		{
+			options.reorder_struct_members = true;
+			current_arg += 1;
+		}
 		else if (strcmp(argv[current_arg], "-h") == 0)
 			fail_usage(argv[0]);
 		else if (argv[current_arg][0] == '-')
@@ -176,6 +211,7 @@ int main(int argc, char** argv)
 		type.type = TypeType::Intrinsic;
 		type.name = name;
 		type.data_size = data_size;
+		type.alignment = data_size;
 
 		return symbol_table.types.size() - 1;
 	};
@@ -327,7 +363,7 @@ int main(int argc, char** argv)
 		parse_top_level(parser, symbol_table, file_table[file_table.size() - i - 1].name);
 	}
 
-	compute_sizing(symbol_table);
+	compute_sizing(symbol_table, options.reorder_struct_members);
 
 	if (options.output_debug_data.has_value())
 	{
@@ -356,6 +392,28 @@ int main(int argc, char** argv)
 		internal_error(msg.c_str());
 	}
 
+	IrProgram program = generate_ir(symbol_table);
+
+	OptimiserOptions optimiser_options;
+	optimiser_options.level = options.optimisation_level;
+	optimiser_options.time_passes = options.time_passes;
+	optimise(program, symbol_table, optimiser_options);
+
+	if (options.output_ir.has_value())
+	{
+		FILE* ir_file = fopen(options.output_ir.value().c_str(), "w");
+		if (ir_file == nullptr)
+		{
+			printf("Failed to open %s for writing!\n", options.output_ir.value().c_str());
+
+			internal_error("IO failure");
+		}
+
+		dump_ir(ir_file, program);
+
+		fclose(ir_file);
+	}
+
 	std::string asm_file_name;
 	if (options.output_asm.has_value())
 		asm_file_name = options.output_asm.value();
@@ -383,7 +441,14 @@ int main(int argc, char** argv)
 		}
 	}
 
-	codegen(symbol_table, asm_file, is_libc_mode);
+	CodegenOptions codegen_options;
+	codegen_options.is_libc_mode = is_libc_mode;
+	codegen_options.optimisation_level = options.optimisation_level;
+
+	codegen(symbol_table, program, asm_file, codegen_options);
+
+	if (options.print_statistics)
+		print_statistics(stdout);
 
 	fclose(asm_file);
 
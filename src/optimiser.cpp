@@ -0,0 +1,250 @@
+#include "optimiser.h"
+
+#include "errors.h"
+
+#include <algorithm>
+#include <chrono>
+
+struct Pass
+{
+	const char* name;
+	// Lowest optimisation level the pass runs at
+	int level;
+	bool (*run)(IrProgram& program, SymbolTable& symbol_table);
+};
+
+template <bool (*run_function)(IrFunction&)>
+bool run_on_functions(IrProgram& program, SymbolTable&)
+{
+	bool changed = false;
+	for (auto& function : program.functions)
+		changed |= run_function(function);
+	return changed;
+}
+
+// The pipeline, in the order the passes run
+Pass passes[] =
+{
+	{ "inline",               1, inline_functions },
+	{ "tail-calls",           1, run_on_functions<optimise_tail_calls> },
+	{ "constant-propagation", 1, run_on_functions<propagate_constants> },
+	{ "simplify-cfg",         1, run_on_functions<simplify_cfg> },
+	{ "licm",                 1, run_on_functions<hoist_loop_invariants> },
+	{ "strength-reduction",   2, run_on_functions<reduce_induction_variables> },
+	{ "unroll",               1, run_on_functions<unroll_loops> },
+	{ "gvn",                  1, run_on_functions<eliminate_common_subexpressions> },
+	{ "if-conversion",        1, run_on_functions<convert_branches> },
+	{ "constant-propagation", 1, run_on_functions<propagate_constants> },
+	{ "simplify-cfg",         1, run_on_functions<simplify_cfg> },
+	{ "dead-stores",          1, run_on_functions<eliminate_dead_stores> },
+	{ "dce",                  1, run_on_functions<eliminate_dead_code> },
+	{ "stack-slots",          1, run_on_functions<colour_stack_slots> },
+	{ "layout",               1, run_on_functions<layout_blocks> },
+};
+
+void optimise(IrProgram& program, SymbolTable& symbol_table, const OptimiserOptions& options)
+{
+	constexpr size_t num_passes = sizeof(passes) / sizeof(passes[0]);
+	double pass_times[num_passes] = {};
+	bool pass_ran[num_passes] = {};
+
+	for (size_t i = 0; i < num_passes; i++)
+	{
+		if (options.level < passes[i].level)
+			continue;
+
+		auto start = std::chrono::steady_clock::now();
+		passes[i].run(program, symbol_table);
+		auto end = std::chrono::steady_clock::now();
+
+		pass_times[i] += std::chrono::duration<double, std::milli>(end - start).count();
+		pass_ran[i] = true;
+	}
+
+	if (options.time_passes)
+	{
+		printf("Pass timings (-O%d):\n", options.level);
+		double total = 0.0;
+		for (size_t i = 0; i < num_passes; i++)
+		{
+			if (!pass_ran[i]) continue;
+
+			printf("  %-24s %10.3f ms\n", passes[i].name, pass_times[i]);
+			total += pass_times[i];
+		}
+		printf("  %-24s %10.3f ms\n", "total", total);
+	}
+}
+
+bool block_has_phis(IrBlock& block)
+{
+	return !block.instructions.empty() && block.instructions[0].opcode == IrOpcode::Phi;
+}
+
+// Merges each block into its predecessor when the predecessor jumps straight to it and
+// nothing else does, following chains of them in one sweep. The predecessors must be up to
+// date, and are kept up to date. Returns true if anything was merged.
+bool merge_blocks(IrFunction& function)
+{
+	std::vector<int> replacements(function.value_types.size(), -1);
+	bool merged = false;
+	for (size_t b = 0; b < function.blocks.size(); b++)
+	{
+		while (true)
+		{
+			auto& terminator = function.blocks[b].terminator();
+			if (terminator.opcode != IrOpcode::Jump)
+				break;
+
+			size_t s = terminator.targets[0];
+			if (s == b || s == 0 || function.blocks[s].predecessors.size() != 1)
+				break;
+
+			// Phis in the merged block have a single operand
+			auto& successor = function.blocks[s];
+			auto& instructions = function.blocks[b].instructions;
+			instructions.pop_back();
+			for (auto& instruction : successor.instructions)
+			{
+				if (instruction.opcode == IrOpcode::Phi)
+					replacements[instruction.dest] = instruction.operands[0];
+				else
+					instructions.push_back(std::move(instruction));
+			}
+
+			// The merged block is now unreachable, leave it jumping to itself until it's removed
+			successor.instructions.clear();
+			auto& self_jump = successor.instructions.emplace_back();
+			self_jump.opcode = IrOpcode::Jump;
+			self_jump.targets = { s };
+			successor.predecessors = { s };
+
+			// The successors of the merged block are now reached from b
+			for (auto next : block_successors(function.blocks[b]))
+			{
+				for (auto& predecessor : function.blocks[next].predecessors)
+				{
+					if (predecessor == s)
+						predecessor = b;
+				}
+				for (auto& instruction : function.blocks[next].instructions)
+				{
+					for (auto& phi_block : instruction.phi_blocks)
+					{
+						if (phi_block == s)
+							phi_block = b;
+					}
+				}
+			}
+
+			merged = true;
+		}
+	}
+
+	if (merged)
+		replace_values(function, replacements);
+	return merged;
+}
+
+bool simplify_cfg(IrFunction& function)
+{
+	bool changed = remove_unreachable_blocks(function);
+
+	bool progress = true;
+	while (progress)
+	{
+		progress = false;
+
+		for (size_t b = 0; b < function.blocks.size(); b++)
+		{
+			auto& terminator = function.blocks[b].terminator();
+
+			// A branch to the same block either way doesn't need the condition
+			if (terminator.opcode == IrOpcode::Branch && terminator.targets[0] == terminator.targets[1])
+			{
+				terminator.opcode = IrOpcode::Jump;
+				terminator.operands.clear();
+				terminator.targets.resize(1);
+				progress = true;
+			}
+
+			// Skip over blocks which only jump somewhere else, all the way along a chain of them.
+			// A cycle of them is left alone.
+			for (auto& target : terminator.targets)
+			{
+				for (size_t steps = 0; steps < function.blocks.size(); steps++)
+				{
+					auto& target_block = function.blocks[target];
+					if (target == b || target_block.instructions.size() != 1 || target_block.terminator().opcode != IrOpcode::Jump)
+						break;
+
+					size_t final_target = target_block.terminator().targets[0];
+					if (final_target == target || block_has_phis(function.blocks[final_target]))
+						break;
+
+					target = final_target;
+					progress = true;
+				}
+			}
+		}
+
+		// Blocks which were skipped over no longer count as predecessors
+		if (progress)
+			remove_unreachable_blocks(function);
+		compute_predecessors(function);
+		if (merge_blocks(function))
+			progress = true;
+
+		changed |= progress;
+	}
+
+	// The merged blocks are left jumping to themselves
+	remove_unreachable_blocks(function);
+	compute_predecessors(function);
+	return changed;
+}
+
+bool eliminate_dead_code(IrFunction& function)
+{
+	std::vector<const IrInstruction*> definitions(function.value_types.size(), nullptr);
+	std::vector<int> worklist;
+	for (auto& block : function.blocks)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			if (instruction.dest >= 0)
+				definitions[instruction.dest] = &instruction;
+
+			if (has_side_effects(instruction))
+				worklist.insert(worklist.end(), instruction.operands.begin(), instruction.operands.end());
+		}
+	}
+
+	std::vector<bool> live(function.value_types.size());
+	while (!worklist.empty())
+	{
+		int value = worklist.back();
+		worklist.pop_back();
+		if (live[value]) continue;
+
+		live[value] = true;
+		if (definitions[value] == nullptr)
+			internal_error("IR value used but never defined");
+		worklist.insert(worklist.end(), definitions[value]->operands.begin(), definitions[value]->operands.end());
+	}
+
+	bool changed = false;
+	for (auto& block : function.blocks)
+	{
+		auto& instructions = block.instructions;
+		auto new_end = std::remove_if(instructions.begin(), instructions.end(), [&](IrInstruction& instruction)
+		{
+			return instruction.dest >= 0 && !live[instruction.dest] && !has_side_effects(instruction);
+		});
+
+		changed |= new_end != instructions.end();
+		instructions.erase(new_end, instructions.end());
+	}
+
+	return changed;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "ast.h"
+#include "ir.h"
+
+struct OptimiserOptions
+{
+	// 0 runs no passes, 1 runs the cheap passes, 2 runs everything
+	int level = 1;
+	// Print how long each pass took in total
+	bool time_passes = false;
+};
+
+void optimise(IrProgram& program, SymbolTable& symbol_table, const OptimiserOptions& options);
+
+// Passes. Each returns true if it changed anything
+bool inline_functions(IrProgram& program, SymbolTable& symbol_table);
+bool optimise_tail_calls(IrFunction& function);
+bool propagate_constants(IrFunction& function);
+bool simplify_cfg(IrFunction& function);
+bool hoist_loop_invariants(IrFunction& function);
+bool reduce_induction_variables(IrFunction& function);
+bool unroll_loops(IrFunction& function);
+bool eliminate_common_subexpressions(IrFunction& function);
+bool convert_branches(IrFunction& function);
+bool eliminate_dead_stores(IrFunction& function);
+bool eliminate_dead_code(IrFunction& function);
+bool colour_stack_slots(IrFunction& function);
+bool layout_blocks(IrFunction& function);
+
+// Integer constants are kept zero extended from the size of their type
+int64_t truncate_to_size(int64_t value, int size);
+int64_t sign_extend_from_size(int64_t value, int size);
+
+// True if the address of anything in the function's frame is taken
+bool frame_may_escape(IrFunction& function);
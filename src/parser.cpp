@@ -437,12 +437,23 @@ size_t parse_statement(Parser& parser, Ast& ast, SymbolTable& symbol_table, size
 		size_t expr_node;
 		size_t assign_node;
 		bool assignment = false;
+		bool uninitialised = false;
 		if (parser.next_is(TokenType::Assign))
 		{
-			assignment = true;
 			auto& assign_token = parser.get();
-			assign_node = ast.make(AstNodeType::Assignment, assign_token);
-			expr_node = parse_expression(parser, ast, symbol_table, scope_index, end_token);
+			if (parser.next_is(TokenType::Uninitialised))
+			{
+				// "= ---" opts out of zeroing the variable
+				uninitialised = true;
+				parser.get();
+				parser.get_if(TokenType::StatementEnd, "Expected ;");
+			}
+			else
+			{
+				assignment = true;
+				assign_node = ast.make(AstNodeType::Assignment, assign_token);
+				expr_node = parse_expression(parser, ast, symbol_table, scope_index, end_token);
+			}
 		}
 		else if (parser.next_is(TokenType::StatementEnd))
 		{
@@ -471,18 +482,28 @@ size_t parse_statement(Parser& parser, Ast& ast, SymbolTable& symbol_table, size
 		}
 		else
 		{
-			size_t init_node = ast.make(AstNodeType::ZeroInitialise, ident_token);
+			size_t init_node = ast.make(uninitialised ? AstNodeType::Uninitialised : AstNodeType::ZeroInitialise, ident_token);
 			ast[init_node].child0 = var_node;
 
 			return init_node;
 		}
 	}
 	// Return
-	else if (parser.next_is(TokenType::KeywordReturn))
+	else if (parser.next_is(TokenType::KeywordReturn) || parser.next_is(TokenType::DirectiveTailCall))
 	{
+		bool tail_call = false;
+		if (parser.next_is(TokenType::DirectiveTailCall))
+		{
+			auto& directive_token = parser.get();
+			if (!parser.next_is(TokenType::KeywordReturn))
+				log_error(directive_token, "Expected return after #tailcall");
+			tail_call = true;
+		}
+
 		auto& return_token = parser.get();
 
 		size_t return_node = ast.make(AstNodeType::Return, return_token);
+		ast[return_node].data_return.tail_call = tail_call;
 		if (!parser.next_is(TokenType::StatementEnd))
 		{
 			auto expr_node = parse_expression(parser, ast, symbol_table, scope_index, end_token);
@@ -526,9 +547,38 @@ size_t parse_statement(Parser& parser, Ast& ast, SymbolTable& symbol_table, size
 		ast[if_node].child0 = expr_node;
 		ast[if_node].child1 = block_node.value();
 		ast[if_node].aux = else_block_node;
+		ast[if_node].data_if.branchless = false;
 
 		return if_node;
 	}
+	// If with a hint to compute both arms and pick the results without branching
+	else if (parser.next_is(TokenType::DirectiveBranchless))
+	{
+		auto& directive_token = parser.get();
+		if (!parser.next_is(TokenType::KeywordIf))
+			log_error(directive_token, "Expected if after #branchless");
+
+		auto if_node = parse_statement(parser, ast, symbol_table, scope_index, end_token);
+		ast[if_node].data_if.branchless = true;
+		return if_node;
+	}
+	// Loop with an unrolling hint
+	else if (parser.next_is(TokenType::DirectiveUnroll))
+	{
+		auto& directive_token = parser.get();
+		parser.get_if(TokenType::ParenthesisLeft, "Expected (");
+		auto& count_token = parser.get_if(TokenType::LiteralInteger, "Expected unroll count");
+		parser.get_if(TokenType::ParenthesisRight, "Expected )");
+
+		if (count_token.data_int < 1)
+			log_error(count_token, "Unroll count must be at least 1");
+		if (!parser.next_is(TokenType::KeywordWhile) && !parser.next_is(TokenType::KeywordFor))
+			log_error(directive_token, "Expected loop after #unroll");
+
+		auto loop_node = parse_statement(parser, ast, symbol_table, scope_index, end_token);
+		ast[loop_node].data_loop.unroll = count_token.data_int;
+		return loop_node;
+	}
 	// While loop
 	else if (parser.next_is(TokenType::KeywordWhile))
 	{
@@ -547,6 +597,7 @@ size_t parse_statement(Parser& parser, Ast& ast, SymbolTable& symbol_table, size
 		size_t while_node = ast.make(AstNodeType::While, while_token);
 		ast[while_node].child0 = expr_node;
 		ast[while_node].child1 = block_node.value();
+		ast[while_node].data_loop.unroll = 0;
 
 		return while_node;
 	}
@@ -576,6 +627,7 @@ size_t parse_statement(Parser& parser, Ast& ast, SymbolTable& symbol_table, size
 		size_t for_node = ast.make(AstNodeType::For, for_token);
 		ast[for_node].child0 = init_node;
 		ast[for_node].child1 = block_node.value();
+		ast[for_node].data_loop.unroll = 0;
 		ast[init_node].aux = cond_node;
 		ast[cond_node].aux = incr_node;
 
@@ -779,6 +831,7 @@ void parse_function_type(Parser& parser, SymbolTable& symbol_table)
 		auto& type = symbol_table.types.back();
 		type.type = TypeType::Function;
 		type.data_size = 8;
+		type.alignment = 8;
 		type.function_type_index = symbol_table.function_types.size();
 
 		symbol_table.function_types.emplace_back();
@@ -854,6 +907,18 @@ void parse_top_level(Parser& parser, SymbolTable& symbol_table, const std::strin
 			parse_function(parser, symbol_table, false);
 		else if (parser.next_is(TokenType::KeywordStruct))
 			parse_struct(parser, symbol_table);
+		else if (parser.next_is(TokenType::DirectiveInline) || parser.next_is(TokenType::DirectiveNoInline))
+		{
+			auto& hint_token = parser.get();
+			if (!parser.has_more() || !parser.next_is(TokenType::KeywordFunctionDecl))
+				log_error(hint_token, "Expected function after inlining directive");
+
+			parse_function(parser, symbol_table, false);
+			if (hint_token.type == TokenType::DirectiveInline)
+				symbol_table.functions.back().inline_hint = InlineHint::Always;
+			else
+				symbol_table.functions.back().inline_hint = InlineHint::Never;
+		}
 		else if (parser.next_is(TokenType::KeywordExternal))
 			parse_function(parser, symbol_table, true);
 		else if (parser.next_is(TokenType::KeywordFunctionType))
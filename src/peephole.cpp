@@ -0,0 +1,556 @@
+#include "peephole.h"
+
+#include "errors.h"
+#include "stats.h"
+
+// Peephole optimisation over the register allocated instruction stream. Each rule is a
+// pattern of consecutive instructions, what to replace them with, and optionally a
+// condition which must hold. Patterns are written one instruction per string:
+//
+//   mnemonic   an opcode as it appears in the assembly, "label" for a label, "alu" for any
+//              instruction which can take an immediate as its second operand, or "*" for
+//              any instruction other than a label (its operands aren't matched)
+//   %a         a register, bound to the name a
+//   #x         an immediate, bound to the name x. #0 only matches zero
+//   [m]        a memory operand, bound to the name m
+//   @l         a label, bound to the name l
+//
+// A name which is used twice has to match the same operand both times. Replacements use
+// the same syntax, with "=N" as the mnemonic to repeat the opcode of the Nth matched
+// instruction and %a:4 to change the size of register a.
+//
+// The instructions are swept from the start, replacing the first rule which matches at
+// each position, until a sweep makes no changes.
+
+struct PeepholeMatch;
+
+struct PeepholeRule
+{
+	const char* name;
+	std::vector<const char*> pattern;
+	std::vector<const char*> replacement;
+	bool (*condition)(PeepholeMatch& match);
+};
+
+enum class PatternOperandType
+{
+	Register,
+	Immediate,
+	ImmediateValue,
+	Memory,
+	Label
+};
+
+struct PatternOperand
+{
+	PatternOperandType type;
+	char name = 0;
+	int size = 0; // Register size override in replacements
+	int64_t value = 0;
+};
+
+enum class PatternOpcodeType
+{
+	Opcode,
+	Alu,
+	Any,
+	SameAs
+};
+
+struct PatternInstruction
+{
+	PatternOpcodeType opcode_type;
+	MachineOpcode opcode;
+	int same_as = 0;
+	std::vector<PatternOperand> operands;
+};
+
+struct CompiledRule
+{
+	const PeepholeRule* rule;
+	std::vector<PatternInstruction> pattern;
+	std::vector<PatternInstruction> replacement;
+};
+
+constexpr int flags_register = 32;
+
+struct PeepholeMatch
+{
+	MachineFunction& mf;
+	size_t start;
+
+	MachineOperand bindings[26];
+	bool bound[26] = {};
+
+	// Registers (and flags) live after the last matched instruction
+	uint64_t live_after;
+	std::vector<int>& label_references;
+
+	MachineInstruction& instruction(size_t i) { return mf.instructions[start + i]; }
+	MachineOperand& binding(char name) { return bindings[name - 'a']; }
+	bool is_live(int reg) { return (live_after & (uint64_t(1) << reg)) != 0; }
+};
+
+bool writes_flags(MachineOpcode opcode)
+{
+	switch (opcode)
+	{
+		case MachineOpcode::Add:
+		case MachineOpcode::Sub:
+		case MachineOpcode::Inc:
+		case MachineOpcode::Dec:
+		case MachineOpcode::Imul:
+		case MachineOpcode::ImulWide:
+		case MachineOpcode::Div:
+		case MachineOpcode::Idiv:
+		case MachineOpcode::Shl:
+		case MachineOpcode::Shr:
+		case MachineOpcode::Sar:
+		case MachineOpcode::Xor:
+		case MachineOpcode::And:
+		case MachineOpcode::Or:
+		case MachineOpcode::Cmp:
+		case MachineOpcode::Test:
+		case MachineOpcode::Comisd:
+		case MachineOpcode::Ucomiss:
+		case MachineOpcode::Call:
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool reads_flags(MachineOpcode opcode)
+{
+	switch (opcode)
+	{
+		case MachineOpcode::Sete:
+		case MachineOpcode::Setne:
+		case MachineOpcode::Setg:
+		case MachineOpcode::Setge:
+		case MachineOpcode::Setl:
+		case MachineOpcode::Setle:
+		case MachineOpcode::Seta:
+		case MachineOpcode::Setnb:
+		case MachineOpcode::Cmove:
+		case MachineOpcode::Cmovne:
+		case MachineOpcode::Cmovg:
+		case MachineOpcode::Cmovge:
+		case MachineOpcode::Cmovl:
+		case MachineOpcode::Cmovle:
+		case MachineOpcode::Cmova:
+		case MachineOpcode::Cmovae:
+			return true;
+		default:
+			return is_conditional_jump(opcode);
+	}
+}
+
+bool accepts_immediate(MachineOpcode opcode)
+{
+	switch (opcode)
+	{
+		case MachineOpcode::Mov:
+		case MachineOpcode::Add:
+		case MachineOpcode::Sub:
+		case MachineOpcode::Imul:
+		case MachineOpcode::Xor:
+		case MachineOpcode::And:
+		case MachineOpcode::Or:
+		case MachineOpcode::Cmp:
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool register_dead(PeepholeMatch& match)
+{
+	return match.binding('a').reg < 32 && !match.is_live(match.binding('a').reg);
+}
+
+bool flags_dead(PeepholeMatch& match)
+{
+	return !match.is_live(flags_register);
+}
+
+bool zero_with_xor_allowed(PeepholeMatch& match)
+{
+	return !match.is_live(flags_register) && match.binding('a').size >= 4 && match.binding('a').reg < 16;
+}
+
+bool immediate_folds(PeepholeMatch& match)
+{
+	auto& temp = match.binding('a');
+	auto& use = match.instruction(1).operands[1];
+	auto& destination = match.instruction(1).operands[0];
+	if (match.is_live(temp.reg) || destination.reg == temp.reg || destination.index == temp.reg)
+		return false;
+
+	// A smaller move leaves (or zeroes) the upper bits, which the immediate wouldn't
+	return temp.size == use.size && immediate_fits(match.binding('x').value, use.size);
+}
+
+// As in is_redundant_move, a 4 byte move back zeroes the upper half of the register
+bool register_sizes_match(PeepholeMatch& match)
+{
+	int size = match.instruction(0).operands[0].size;
+	return size != 4 && match.instruction(0).operands[1].size == size
+		&& match.instruction(1).operands[0].size == size && match.instruction(1).operands[1].size == size;
+}
+
+bool reload_sizes_match(PeepholeMatch& match)
+{
+	return match.instruction(0).operands[1].size == match.instruction(1).operands[0].size;
+}
+
+bool move_redundant(PeepholeMatch& match)
+{
+	return is_redundant_move(match.instruction(0));
+}
+
+bool label_unused(PeepholeMatch& match)
+{
+	return match.label_references[match.binding('l').value] == 0;
+}
+
+PeepholeRule peephole_rules[] =
+{
+	// Moves which the register allocator left between a register and itself
+	{ "self-move",        { "mov %a, %a" },                     { },                  move_redundant },
+	{ "self-move",        { "movaps %a, %a" },                  { },                  move_redundant },
+	// Constants which the instruction selector folded into the instructions using them
+	{ "dead-move",        { "mov %a, #x" },                     { },                  register_dead },
+	// Zeroing with xor is shorter, but it writes the flags
+	{ "zero-with-xor",    { "mov %a, #0" },                     { "xor %a:4, %a:4" }, zero_with_xor_allowed },
+	// inc and dec are shorter, but leave the carry flag as it was
+	{ "inc-dec",          { "add %a, #1" },                     { "inc %a" },         flags_dead },
+	{ "inc-dec",          { "sub %a, #1" },                     { "dec %a" },         flags_dead },
+	// Use an immediate directly rather than loading it into a register first
+	{ "fold-immediate",   { "mov %a, #x", "alu %b, %a" },       { "=2 %b, #x" },      immediate_folds },
+	{ "fold-immediate",   { "mov %a, #x", "mov [m], %a" },      { "mov [m], #x" },    immediate_folds },
+	// The second move copies back the value which was just copied
+	{ "redundant-move",   { "mov %a, %b", "mov %b, %a" },       { "=1 %a, %b" },      register_sizes_match },
+	{ "redundant-move",   { "movaps %a, %b", "movaps %b, %a" }, { "=1 %a, %b" },      nullptr },
+	{ "redundant-reload", { "mov [m], %a", "mov %a, [m]" },     { "=1 [m], %a" },     reload_sizes_match },
+	{ "redundant-reload", { "movsd [m], %a", "movsd %a, [m]" }, { "=1 [m], %a" },     nullptr },
+	// Nothing after an unconditional jump or a return is reachable until the next label
+	{ "unreachable-code", { "jmp @l", "*" },                    { "=1 @l" },          nullptr },
+	{ "unreachable-code", { "ret", "*" },                       { "=1" },             nullptr },
+	{ "jump-to-next",     { "jmp @l", "label @l" },             { "label @l" },       nullptr },
+	{ "jump-to-next",     { "jz @l", "label @l" },              { "label @l" },       nullptr },
+	{ "unused-label",     { "label @l" },                       { },                  label_unused },
+};
+
+PatternInstruction parse_pattern_instruction(const std::string& text)
+{
+	PatternInstruction result;
+
+	size_t space = text.find(' ');
+	std::string mnemonic = text.substr(0, space);
+	if (mnemonic == "*")
+		result.opcode_type = PatternOpcodeType::Any;
+	else if (mnemonic == "alu")
+		result.opcode_type = PatternOpcodeType::Alu;
+	else if (mnemonic[0] == '=')
+	{
+		result.opcode_type = PatternOpcodeType::SameAs;
+		result.same_as = std::stoi(mnemonic.substr(1)) - 1;
+	}
+	else if (mnemonic == "label")
+	{
+		result.opcode_type = PatternOpcodeType::Opcode;
+		result.opcode = MachineOpcode::Label;
+	}
+	else
+	{
+		auto opcode = find_machine_opcode(mnemonic);
+		if (!opcode.has_value())
+			internal_error("Unknown opcode in peephole rule");
+		result.opcode_type = PatternOpcodeType::Opcode;
+		result.opcode = opcode.value();
+	}
+
+	size_t position = space;
+	while (position != std::string::npos && position < text.size())
+	{
+		size_t comma = text.find(',', position + 1);
+		std::string operand_text = text.substr(position + 1, comma == std::string::npos ? std::string::npos : comma - position - 1);
+		while (!operand_text.empty() && operand_text[0] == ' ')
+			operand_text.erase(0, 1);
+		position = comma;
+
+		PatternOperand operand;
+		if (operand_text[0] == '%')
+		{
+			operand.type = PatternOperandType::Register;
+			operand.name = operand_text[1];
+			if (operand_text.size() > 3 && operand_text[2] == ':')
+				operand.size = std::stoi(operand_text.substr(3));
+		}
+		else if (operand_text[0] == '#' && isdigit(operand_text[1]))
+		{
+			operand.type = PatternOperandType::ImmediateValue;
+			operand.value = std::stoll(operand_text.substr(1));
+		}
+		else if (operand_text[0] == '#')
+		{
+			operand.type = PatternOperandType::Immediate;
+			operand.name = operand_text[1];
+		}
+		else if (operand_text[0] == '[')
+		{
+			operand.type = PatternOperandType::Memory;
+			operand.name = operand_text[1];
+		}
+		else if (operand_text[0] == '@')
+		{
+			operand.type = PatternOperandType::Label;
+			operand.name = operand_text[1];
+		}
+		else
+			internal_error("Invalid operand in peephole rule");
+
+		result.operands.push_back(operand);
+	}
+
+	return result;
+}
+
+std::vector<CompiledRule>& compiled_rules()
+{
+	static std::vector<CompiledRule> rules;
+	if (rules.empty())
+	{
+		for (auto& rule : peephole_rules)
+		{
+			auto& compiled = rules.emplace_back();
+			compiled.rule = &rule;
+			for (auto text : rule.pattern)
+				compiled.pattern.push_back(parse_pattern_instruction(text));
+			for (auto text : rule.replacement)
+				compiled.replacement.push_back(parse_pattern_instruction(text));
+		}
+	}
+	return rules;
+}
+
+bool same_operand(const MachineOperand& a, const MachineOperand& b)
+{
+	if (a.type != b.type) return false;
+	if (a.type == MachineOperandType::Register) return a.reg == b.reg;
+	if (a.type == MachineOperandType::Memory)
+		return a.reg == b.reg && a.index == b.index && a.scale == b.scale && a.value == b.value && a.symbol == b.symbol && a.size == b.size;
+	return a.value == b.value && a.symbol == b.symbol;
+}
+
+bool match_operand(PeepholeMatch& match, const PatternOperand& pattern, const MachineOperand& operand)
+{
+	switch (pattern.type)
+	{
+		case PatternOperandType::Register:
+			if (operand.type != MachineOperandType::Register) return false;
+			break;
+		case PatternOperandType::Immediate:
+			if (operand.type != MachineOperandType::Immediate) return false;
+			break;
+		case PatternOperandType::ImmediateValue:
+			return operand.type == MachineOperandType::Immediate && operand.value == pattern.value;
+		case PatternOperandType::Memory:
+			if (operand.type != MachineOperandType::Memory) return false;
+			break;
+		case PatternOperandType::Label:
+			if (operand.type != MachineOperandType::Label) return false;
+			break;
+	}
+
+	int index = pattern.name - 'a';
+	if (match.bound[index])
+		return same_operand(match.bindings[index], operand);
+
+	match.bindings[index] = operand;
+	match.bound[index] = true;
+	return true;
+}
+
+bool match_instruction(PeepholeMatch& match, const PatternInstruction& pattern, const MachineInstruction& mi)
+{
+	if (pattern.opcode_type == PatternOpcodeType::Any)
+		return mi.opcode != MachineOpcode::Label;
+	if (pattern.opcode_type == PatternOpcodeType::Alu && !accepts_immediate(mi.opcode))
+		return false;
+	if (pattern.opcode_type == PatternOpcodeType::Opcode && mi.opcode != pattern.opcode)
+		return false;
+
+	if ((int)pattern.operands.size() != mi.num_operands)
+		return false;
+
+	for (int i = 0; i < mi.num_operands; i++)
+	{
+		if (!match_operand(match, pattern.operands[i], mi.operands[i]))
+			return false;
+	}
+
+	return true;
+}
+
+MachineInstruction build_instruction(PeepholeMatch& match, const PatternInstruction& pattern)
+{
+	MachineInstruction mi;
+	if (pattern.opcode_type == PatternOpcodeType::SameAs)
+	{
+		auto& original = match.instruction(pattern.same_as);
+		mi.opcode = original.opcode;
+		mi.implicit_uses = original.implicit_uses;
+		mi.implicit_defs = original.implicit_defs;
+	}
+	else
+		mi.opcode = pattern.opcode;
+
+	bool has_immediate = false;
+	for (auto& operand : pattern.operands)
+	{
+		auto& result = mi.operands[mi.num_operands++];
+		if (operand.type == PatternOperandType::ImmediateValue)
+			result = machine_immediate(operand.value);
+		else
+			result = match.binding(operand.name);
+
+		if (operand.size != 0)
+			result.size = operand.size;
+		if (result.type == MachineOperandType::Immediate)
+			has_immediate = true;
+	}
+
+	// Nothing else gives the size of a memory operand written with an immediate
+	for (int i = 0; i < mi.num_operands && has_immediate; i++)
+	{
+		if (mi.operands[i].type == MachineOperandType::Memory)
+			mi.operands[i].explicit_size = true;
+	}
+
+	return mi;
+}
+
+// Returns the registers (and flags) live after each instruction, as a bit mask
+std::vector<uint64_t> compute_live_after(MachineFunction& mf)
+{
+	auto transfer = [](const MachineInstruction& mi, uint64_t live)
+	{
+		uint64_t uses = 0;
+		uint64_t defs = 0;
+		for_each_register(mi, [&](int reg) { uses |= uint64_t(1) << reg; }, [&](int reg) { defs |= uint64_t(1) << reg; });
+
+		// Writing the low byte or word of a register keeps the rest of it, but values are
+		// only ever read at the size they were written, so it counts as a full definition
+		if (writes_flags(mi.opcode)) defs |= uint64_t(1) << flags_register;
+		if (reads_flags(mi.opcode)) uses |= uint64_t(1) << flags_register;
+
+		return (live & ~defs) | uses;
+	};
+
+	auto blocks = build_blocks(mf);
+	std::vector<uint64_t> live_in(blocks.size());
+
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (size_t b = blocks.size(); b > 0; b--)
+		{
+			auto& block = blocks[b - 1];
+			uint64_t live = 0;
+			for (auto successor : block.successors)
+				live |= live_in[successor];
+
+			for (size_t i = block.last + 1; i > block.first; i--)
+				live = transfer(mf.instructions[i - 1], live);
+
+			if (live != live_in[b - 1])
+			{
+				live_in[b - 1] = live;
+				changed = true;
+			}
+		}
+	}
+
+	std::vector<uint64_t> live_after(mf.instructions.size());
+	for (size_t b = 0; b < blocks.size(); b++)
+	{
+		auto& block = blocks[b];
+		uint64_t live = 0;
+		for (auto successor : block.successors)
+			live |= live_in[successor];
+
+		for (size_t i = block.last + 1; i > block.first; i--)
+		{
+			live_after[i - 1] = live;
+			live = transfer(mf.instructions[i - 1], live);
+		}
+	}
+
+	return live_after;
+}
+
+void run_peephole(MachineFunction& mf)
+{
+	auto& rules = compiled_rules();
+
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+
+		auto live_after = compute_live_after(mf);
+		std::vector<int> label_references;
+		for (auto& mi : mf.instructions)
+		{
+			for (int i = 0; i < mi.num_operands; i++)
+			{
+				if (mi.operands[i].type != MachineOperandType::Label) continue;
+
+				size_t label = mi.operands[i].value;
+				if (label >= label_references.size())
+					label_references.resize(label + 1);
+				if (mi.opcode != MachineOpcode::Label)
+					label_references[label]++;
+			}
+		}
+
+		std::vector<MachineInstruction> output;
+		size_t i = 0;
+		while (i < mf.instructions.size())
+		{
+			bool applied = false;
+			for (auto& rule : rules)
+			{
+				size_t length = rule.pattern.size();
+				if (i + length > mf.instructions.size())
+					continue;
+
+				PeepholeMatch match { mf, i, {}, {}, live_after[i + length - 1], label_references };
+
+				bool matches = true;
+				for (size_t j = 0; j < length && matches; j++)
+					matches = match_instruction(match, rule.pattern[j], mf.instructions[i + j]);
+
+				if (!matches || (rule.rule->condition != nullptr && !rule.rule->condition(match)))
+					continue;
+
+				for (auto& replacement : rule.replacement)
+					output.push_back(build_instruction(match, replacement));
+
+				add_statistic(std::string("peephole.") + rule.rule->name);
+				i += length;
+				applied = true;
+				changed = true;
+				break;
+			}
+
+			if (!applied)
+				output.push_back(mf.instructions[i++]);
+		}
+
+		mf.instructions = std::move(output);
+	}
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "machine.h"
+
+// Rewrites short sequences of instructions into cheaper ones, after register allocation
+void run_peephole(MachineFunction& mf);
@@ -0,0 +1,619 @@
+#include "regalloc.h"
+
+#include "errors.h"
+
+#include <algorithm>
+#include <iterator>
+#include <optional>
+
+// Linear scan register allocation (Poletto & Sarkar). Each virtual register gets a single
+// live interval covering every instruction where it is live, and intervals are assigned
+// registers in order of their start. Physical registers which are written by the instruction
+// stream (argument registers, return registers, div, call clobbers) block any interval which
+// overlaps the range from their definition to their last use.
+//
+// Instruction i reads its operands at position 2i and writes its results at 2i + 1, so a
+// register whose last use is at instruction i can be reused for a result of the same instruction.
+//
+// Calls clobber every caller saved register, so an interval which is live across a call first
+// looks for a callee saved register. When there isn't one (there are no callee saved xmm
+// registers at all) it can still take a caller saved register if it's used more often than it
+// crosses calls: the value is stored to a frame slot wherever it's written and reloaded after
+// each call it's live across. Nothing is pushed around calls, so rsp stays aligned.
+
+// Never allocated, these hold spilled virtual registers for the duration of one instruction
+int gp_scratch_registers[] = { 10, 11 };
+int xmm_scratch_registers[] = { 30, 31 };
+
+// Caller saved registers come first because using them doesn't need a save in the prologue.
+// rbp is only allocatable in functions without a frame pointer
+int gp_allocatable_registers[] = { 0, 2, 3, 4, 5, 8, 9, 1, 12, 13, 14, 15, 6 };
+int xmm_allocatable_registers[] = { 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29 };
+
+struct LiveInterval
+{
+	int vreg;
+	int start;
+	int end;
+	bool is_float;
+
+	// Registers which would let a copy into or out of this virtual register be removed
+	int hint_physical = -1;
+	int hint_virtual = -1;
+
+	int uses = 0;
+	int defs = 0;
+
+	int assigned = -1;
+	bool spilled = false;
+	bool saved_around_calls = false; // Kept in a caller saved register, and in the slot across calls
+	uint32_t spill_offset;
+};
+
+std::vector<LiveInterval> build_intervals(MachineFunction& mf, std::vector<MachineBlock>& blocks)
+{
+	size_t num_vregs = mf.virtual_register_is_float.size();
+	auto& instructions = mf.instructions;
+
+	auto is_virtual = [](int reg) { return reg >= first_virtual_register; };
+
+	// Per block use (read before written) and def sets, as sorted lists of virtual registers.
+	// Most registers are only live in a few blocks, so these are kept sparse rather than as a
+	// bit for every register in every block.
+	using LiveSet = std::vector<int>;
+	auto sort_set = [](LiveSet& set)
+	{
+		std::sort(set.begin(), set.end());
+		set.erase(std::unique(set.begin(), set.end()), set.end());
+	};
+
+	std::vector<LiveSet> block_use(blocks.size());
+	std::vector<LiveSet> block_def(blocks.size());
+	std::vector<size_t> defined_in(num_vregs, SIZE_MAX); // The last block which wrote each register
+	for (size_t b = 0; b < blocks.size(); b++)
+	{
+		for (size_t i = blocks[b].first; i <= blocks[b].last; i++)
+		{
+			for_each_register(instructions[i],
+				[&](int reg)
+				{
+					if (is_virtual(reg) && defined_in[reg - first_virtual_register] != b)
+						block_use[b].push_back(reg - first_virtual_register);
+				},
+				[&](int reg)
+				{
+					if (!is_virtual(reg)) return;
+					defined_in[reg - first_virtual_register] = b;
+					block_def[b].push_back(reg - first_virtual_register);
+				});
+		}
+		sort_set(block_use[b]);
+		sort_set(block_def[b]);
+	}
+
+	std::vector<std::vector<size_t>> predecessors(blocks.size());
+	for (size_t b = 0; b < blocks.size(); b++)
+	{
+		for (auto s : blocks[b].successors)
+			predecessors[s].push_back(b);
+	}
+
+	// Solve the liveness equations with a worklist, revisiting the predecessors of a block
+	// whenever its live in set grows
+	std::vector<LiveSet> live_in(blocks.size());
+	std::vector<LiveSet> live_out(blocks.size());
+	std::vector<size_t> worklist;
+	std::vector<bool> queued(blocks.size(), true);
+	for (size_t b = 0; b < blocks.size(); b++)
+		worklist.push_back(b);
+
+	LiveSet merged;
+	while (!worklist.empty())
+	{
+		size_t b = worklist.back();
+		worklist.pop_back();
+		queued[b] = false;
+
+		auto& out = live_out[b];
+		for (auto s : blocks[b].successors)
+		{
+			merged.clear();
+			std::set_union(out.begin(), out.end(), live_in[s].begin(), live_in[s].end(), std::back_inserter(merged));
+			out.swap(merged);
+		}
+
+		LiveSet through;
+		std::set_difference(out.begin(), out.end(), block_def[b].begin(), block_def[b].end(), std::back_inserter(through));
+		LiveSet in;
+		std::set_union(through.begin(), through.end(), block_use[b].begin(), block_use[b].end(), std::back_inserter(in));
+
+		// The sets only grow, so a change in size is a change
+		if (in.size() == live_in[b].size())
+			continue;
+		live_in[b] = std::move(in);
+		for (auto p : predecessors[b])
+		{
+			if (!queued[p])
+			{
+				queued[p] = true;
+				worklist.push_back(p);
+			}
+		}
+	}
+
+	std::vector<LiveInterval> intervals(num_vregs);
+	for (size_t v = 0; v < num_vregs; v++)
+	{
+		intervals[v].vreg = first_virtual_register + v;
+		intervals[v].start = INT32_MAX;
+		intervals[v].end = -1;
+		intervals[v].is_float = mf.virtual_register_is_float[v];
+	}
+
+	auto touch = [&](int reg, int position)
+	{
+		auto& interval = intervals[reg - first_virtual_register];
+		interval.start = std::min(interval.start, position);
+		interval.end = std::max(interval.end, position);
+	};
+
+	for (size_t b = 0; b < blocks.size(); b++)
+	{
+		int block_start = 2 * blocks[b].first;
+		int block_end = 2 * blocks[b].last + 1;
+
+		for (auto v : live_in[b])
+			touch(first_virtual_register + v, block_start);
+		for (auto v : live_out[b])
+			touch(first_virtual_register + v, block_end);
+
+		for (size_t i = blocks[b].first; i <= blocks[b].last; i++)
+		{
+			for_each_register(instructions[i],
+				[&](int reg)
+				{
+					if (!is_virtual(reg)) return;
+					touch(reg, 2 * i);
+					intervals[reg - first_virtual_register].uses++;
+				},
+				[&](int reg)
+				{
+					if (!is_virtual(reg)) return;
+					touch(reg, 2 * i + 1);
+					intervals[reg - first_virtual_register].defs++;
+				});
+		}
+	}
+
+	// Copies give hints, so both sides of the copy can end up in the same register
+	for (auto& mi : instructions)
+	{
+		if (mi.opcode != MachineOpcode::Mov && mi.opcode != MachineOpcode::Movaps)
+			continue;
+		if (!mi.operands[0].is_register() || !mi.operands[1].is_register())
+			continue;
+
+		int dst = mi.operands[0].reg;
+		int src = mi.operands[1].reg;
+		if (is_virtual(dst) && is_virtual(src))
+			intervals[dst - first_virtual_register].hint_virtual = src;
+		else if (is_virtual(dst))
+			intervals[dst - first_virtual_register].hint_physical = src;
+		else if (is_virtual(src))
+			intervals[src - first_virtual_register].hint_physical = dst;
+	}
+
+	return intervals;
+}
+
+// Ranges where physical registers hold values written by the instruction stream
+using FixedRanges = std::vector<std::pair<int, int>>;
+
+void build_fixed_ranges(MachineFunction& mf, FixedRanges fixed_ranges[32])
+{
+	int last_def[32];
+	for (int r = 0; r < 32; r++)
+		last_def[r] = -1; // Anything used before it is written is live in to the function
+
+	for (size_t i = 0; i < mf.instructions.size(); i++)
+	{
+		for_each_register(mf.instructions[i],
+			[&](int reg) { if (reg < first_virtual_register) fixed_ranges[reg].push_back({ last_def[reg], 2 * i }); },
+			[&](int reg)
+			{
+				if (reg < first_virtual_register)
+				{
+					fixed_ranges[reg].push_back({ 2 * i + 1, 2 * i + 1 });
+					last_def[reg] = 2 * i + 1;
+				}
+			});
+	}
+}
+
+bool overlaps_fixed_range(const FixedRanges& ranges, int start, int end)
+{
+	for (auto [range_start, range_end] : ranges)
+	{
+		if (range_start <= end && start <= range_end)
+			return true;
+	}
+	return false;
+}
+
+// Like overlaps_fixed_range, but ignoring the registers a call clobbers without leaving a result
+bool overlaps_fixed_range_between_calls(const FixedRanges& ranges, int start, int end, const std::vector<int>& call_positions)
+{
+	for (auto [range_start, range_end] : ranges)
+	{
+		if (range_start == range_end && std::binary_search(call_positions.begin(), call_positions.end(), range_start))
+			continue;
+		if (range_start <= end && start <= range_end)
+			return true;
+	}
+	return false;
+}
+
+bool is_call(const MachineInstruction& mi)
+{
+	return mi.opcode == MachineOpcode::Call;
+}
+
+void linear_scan(MachineFunction& mf, std::vector<LiveInterval>& intervals, FixedRanges fixed_ranges[32])
+{
+	std::vector<size_t> order;
+	for (size_t i = 0; i < intervals.size(); i++)
+	{
+		if (intervals[i].end >= 0)
+			order.push_back(i);
+	}
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return intervals[a].start < intervals[b].start; });
+
+	// Where each call writes its results, in order
+	std::vector<int> call_positions;
+	for (size_t i = 0; i < mf.instructions.size(); i++)
+	{
+		if (is_call(mf.instructions[i]))
+			call_positions.push_back(2 * i + 1);
+	}
+
+	uint32_t next_stack_offset = mf.stack_size;
+	auto spill = [&](LiveInterval& interval)
+	{
+		interval.spilled = true;
+		interval.saved_around_calls = false;
+		interval.assigned = -1;
+		next_stack_offset += 8;
+		interval.spill_offset = next_stack_offset;
+	};
+
+	std::vector<size_t> active;
+	for (auto current_index : order)
+	{
+		auto& current = intervals[current_index];
+
+		active.erase(std::remove_if(active.begin(), active.end(), [&](size_t a) { return intervals[a].end < current.start; }), active.end());
+
+		auto is_free = [&](int reg)
+		{
+			for (auto a : active)
+			{
+				if (intervals[a].assigned == reg)
+					return false;
+			}
+			return !overlaps_fixed_range(fixed_ranges[reg], current.start, current.end);
+		};
+
+		auto is_allocatable = [&](int reg)
+		{
+			if (reg == 6 && !mf.omit_frame_pointer)
+				return false;
+			if (current.is_float)
+				return std::find(std::begin(xmm_allocatable_registers), std::end(xmm_allocatable_registers), reg) != std::end(xmm_allocatable_registers);
+			else
+				return std::find(std::begin(gp_allocatable_registers), std::end(gp_allocatable_registers), reg) != std::end(gp_allocatable_registers);
+		};
+
+		int chosen = -1;
+		if (current.hint_physical >= 0 && is_allocatable(current.hint_physical) && is_free(current.hint_physical))
+			chosen = current.hint_physical;
+
+		if (chosen < 0 && current.hint_virtual >= 0)
+		{
+			int hint_reg = intervals[current.hint_virtual - first_virtual_register].assigned;
+			if (hint_reg >= 0 && is_allocatable(hint_reg) && is_free(hint_reg))
+				chosen = hint_reg;
+		}
+
+		if (chosen < 0)
+		{
+			if (current.is_float)
+			{
+				for (auto reg : xmm_allocatable_registers)
+				{
+					if (is_free(reg)) { chosen = reg; break; }
+				}
+			}
+			else
+			{
+				for (auto reg : gp_allocatable_registers)
+				{
+					if (is_allocatable(reg) && is_free(reg)) { chosen = reg; break; }
+				}
+			}
+		}
+
+		if (chosen >= 0)
+		{
+			current.assigned = chosen;
+			active.push_back(current_index);
+			continue;
+		}
+
+		// A caller saved register costs a store for each write and a load after each call crossed,
+		// where spilling costs a load or store for every use and write
+		int calls_crossed = 0;
+		for (auto position : call_positions)
+		{
+			if (current.start < position && position < current.end)
+				calls_crossed++;
+		}
+
+		if (calls_crossed > 0 && calls_crossed < current.uses)
+		{
+			auto is_free_between_calls = [&](int reg)
+			{
+				for (auto a : active)
+				{
+					if (intervals[a].assigned == reg)
+						return false;
+				}
+				return !overlaps_fixed_range_between_calls(fixed_ranges[reg], current.start, current.end, call_positions);
+			};
+
+			if (current.is_float)
+			{
+				for (auto reg : xmm_allocatable_registers)
+				{
+					if (is_free_between_calls(reg)) { chosen = reg; break; }
+				}
+			}
+			else
+			{
+				for (auto reg : caller_saved_registers)
+				{
+					if (is_allocatable(reg) && is_free_between_calls(reg)) { chosen = reg; break; }
+				}
+			}
+
+			if (chosen >= 0)
+			{
+				current.assigned = chosen;
+				current.saved_around_calls = true;
+				next_stack_offset += 8;
+				current.spill_offset = next_stack_offset;
+				active.push_back(current_index);
+				continue;
+			}
+		}
+
+		// No register is free, so spill whichever of the current interval or an active interval
+		// ends last. The active interval can only give up its register if that register isn't
+		// blocked for the current interval.
+		std::optional<size_t> victim;
+		for (size_t ai = 0; ai < active.size(); ai++)
+		{
+			auto& candidate = intervals[active[ai]];
+			if (candidate.is_float != current.is_float) continue;
+			if (overlaps_fixed_range(fixed_ranges[candidate.assigned], current.start, current.end)) continue;
+
+			if (!victim.has_value() || candidate.end > intervals[active[*victim]].end)
+				victim = ai;
+		}
+
+		if (victim.has_value() && intervals[active[*victim]].end > current.end)
+		{
+			auto& victim_interval = intervals[active[*victim]];
+			current.assigned = victim_interval.assigned;
+			spill(victim_interval);
+			active[*victim] = current_index;
+		}
+		else
+			spill(current);
+	}
+
+	mf.frame_size = next_stack_offset;
+}
+
+void rewrite_instructions(MachineFunction& mf, std::vector<LiveInterval>& intervals)
+{
+	std::vector<MachineInstruction> rewritten;
+	rewritten.reserve(mf.instructions.size());
+
+	auto interval_of = [&](int reg) -> LiveInterval& { return intervals[reg - first_virtual_register]; };
+	auto is_spilled = [&](const MachineOperand& op)
+	{
+		if (op.type == MachineOperandType::Memory && op.index >= first_virtual_register && interval_of(op.index).spilled)
+			return true;
+		return (op.type == MachineOperandType::Register || op.type == MachineOperandType::Memory)
+			&& op.reg >= first_virtual_register && interval_of(op.reg).spilled;
+	};
+
+	auto move_to_slot = [&](LiveInterval& interval, bool store)
+	{
+		auto& move = rewritten.emplace_back();
+		move.opcode = interval.is_float ? MachineOpcode::Movsd : MachineOpcode::Mov;
+		move.num_operands = 2;
+		move.operands[store ? 0 : 1] = machine_stack(interval.spill_offset, 8);
+		move.operands[store ? 1 : 0] = machine_register(interval.assigned, 8);
+	};
+
+	// Values kept in caller saved registers are stored whenever they're written, unless the
+	// next instruction writes them again, and reloaded after every call they're live across
+	auto save_around_calls = [&](const MachineInstruction& mi, size_t i)
+	{
+		auto written_next = [&](int vreg)
+		{
+			bool written = false;
+			if (i + 1 < mf.instructions.size())
+				for_each_register(mf.instructions[i + 1], [](int) {}, [&](int reg) { written |= reg == vreg; });
+			return written;
+		};
+
+		for_each_register(mi,
+			[&](int) {},
+			[&](int reg)
+			{
+				if (reg >= first_virtual_register && interval_of(reg).saved_around_calls && !written_next(reg))
+					move_to_slot(interval_of(reg), true);
+			});
+
+		if (!is_call(mi))
+			return;
+		int position = 2 * (int)i + 1;
+		for (auto& interval : intervals)
+		{
+			if (interval.saved_around_calls && interval.start < position && position < interval.end)
+				move_to_slot(interval, false);
+		}
+	};
+
+	for (size_t i = 0; i < mf.instructions.size(); i++)
+	{
+		auto& mi = mf.instructions[i];
+		bool copy = (mi.opcode == MachineOpcode::Mov || mi.opcode == MachineOpcode::Movsd
+			|| mi.opcode == MachineOpcode::Movss || mi.opcode == MachineOpcode::Movaps)
+			&& mi.operands[0].is_register() && mi.operands[1].is_register();
+
+		// Copies to or from a spilled virtual register can use the stack slot directly
+		if (copy && is_spilled(mi.operands[0]) != is_spilled(mi.operands[1]))
+		{
+			MachineInstruction new_mi = mi;
+			if (new_mi.opcode == MachineOpcode::Movaps)
+				new_mi.opcode = MachineOpcode::Movsd;
+
+			for (int i = 0; i < 2; i++)
+			{
+				auto& op = new_mi.operands[i];
+				if (is_spilled(op))
+					op = machine_stack(interval_of(op.reg).spill_offset, new_mi.operands[1 - i].size);
+				else if (op.reg >= first_virtual_register)
+					op.reg = interval_of(op.reg).assigned;
+			}
+
+			rewritten.push_back(new_mi);
+			save_around_calls(mi, i);
+			continue;
+		}
+
+		std::vector<int> spilled_uses;
+		std::vector<int> spilled_defs;
+		for_each_register(mi,
+			[&](int reg) { if (reg >= first_virtual_register && interval_of(reg).spilled) spilled_uses.push_back(reg); },
+			[&](int reg) { if (reg >= first_virtual_register && interval_of(reg).spilled) spilled_defs.push_back(reg); });
+
+		// Give each spilled virtual register in the instruction a scratch register. The
+		// operands are all read before the result is written, so a result which isn't also
+		// read can share a scratch register with an operand (lea can have three registers).
+		std::vector<std::pair<int, int>> scratch; // (virtual register, scratch register)
+		int gp_used = 0;
+		int xmm_used = 0;
+		auto scratch_for = [&](int vreg)
+		{
+			for (auto [v, s] : scratch)
+				if (v == vreg) return s;
+
+			int s;
+			if (interval_of(vreg).is_float)
+			{
+				if (xmm_used == 2) internal_error("Out of xmm scratch registers");
+				s = xmm_scratch_registers[xmm_used++];
+			}
+			else
+			{
+				bool only_written = std::find(spilled_uses.begin(), spilled_uses.end(), vreg) == spilled_uses.end();
+				if (gp_used == 2 && only_written)
+					s = gp_scratch_registers[0];
+				else if (gp_used == 2)
+					internal_error("Out of scratch registers");
+				else
+					s = gp_scratch_registers[gp_used++];
+			}
+			scratch.push_back({ vreg, s });
+			return s;
+		};
+
+		auto reload_or_store = [&](int vreg, bool store)
+		{
+			auto& interval = interval_of(vreg);
+			int s = scratch_for(vreg);
+			auto opcode = interval.is_float ? MachineOpcode::Movsd : MachineOpcode::Mov;
+			auto& reload = rewritten.emplace_back();
+			reload.opcode = opcode;
+			reload.num_operands = 2;
+			reload.operands[store ? 0 : 1] = machine_stack(interval.spill_offset, 8);
+			reload.operands[store ? 1 : 0] = machine_register(s, 8);
+		};
+
+		for (auto vreg : spilled_uses)
+			reload_or_store(vreg, false);
+
+		MachineInstruction new_mi = mi;
+		for (int i = 0; i < new_mi.num_operands; i++)
+		{
+			auto& op = new_mi.operands[i];
+			if ((op.type == MachineOperandType::Register || op.type == MachineOperandType::Memory) && op.reg >= first_virtual_register)
+			{
+				auto& interval = interval_of(op.reg);
+				op.reg = interval.spilled ? scratch_for(op.reg) : interval.assigned;
+			}
+			if (op.type == MachineOperandType::Memory && op.index >= first_virtual_register)
+			{
+				auto& interval = interval_of(op.index);
+				op.index = interval.spilled ? scratch_for(op.index) : interval.assigned;
+			}
+		}
+		rewritten.push_back(new_mi);
+
+		for (auto vreg : spilled_defs)
+			reload_or_store(vreg, true);
+		save_around_calls(mi, i);
+	}
+
+	mf.instructions = std::move(rewritten);
+}
+
+void allocate_registers(MachineFunction& mf)
+{
+	auto blocks = build_blocks(mf);
+	auto intervals = build_intervals(mf, blocks);
+
+	FixedRanges fixed_ranges[32];
+	build_fixed_ranges(mf, fixed_ranges);
+
+	linear_scan(mf, intervals, fixed_ranges);
+	rewrite_instructions(mf, intervals);
+
+	// Callee saved registers which were handed out are saved in the frame by the prologue
+	uint32_t stack_offset = mf.frame_size;
+	for (auto reg : callee_saved_registers)
+	{
+		bool used = std::any_of(intervals.begin(), intervals.end(), [reg](const LiveInterval& interval) { return interval.assigned == reg; });
+		if (used)
+		{
+			stack_offset += 8;
+			mf.callee_saved.push_back({ reg, stack_offset });
+		}
+	}
+
+	if (stack_offset % 16 != 0)
+		stack_offset = ((stack_offset / 16) + 1) * 16;
+	mf.frame_size = stack_offset;
+
+	// Without a frame pointer the return address takes the place of the saved rbp in keeping
+	// rsp aligned at calls. A leaf function can leave its frame in the 128 byte red zone.
+	if (mf.omit_frame_pointer)
+	{
+		bool fits_red_zone = mf.frame_size + 8 <= 128;
+		mf.stack_adjust = is_leaf_function(mf) && fits_red_zone ? 0 : mf.frame_size + 8;
+	}
+}
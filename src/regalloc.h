@@ -0,0 +1,5 @@
+#pragma once
+
+#include "machine.h"
+
+void allocate_registers(MachineFunction& mf);
@@ -2,22 +2,44 @@
 
 #include "errors.h"
 
-// Assigns offsets to each variable in the scope using the data type size.
+#include <algorithm>
+#include <numeric>
+
+uint32_t align_up(uint32_t value, size_t alignment)
+{
+	return (uint32_t)((value + alignment - 1) / alignment * alignment);
+}
+
+// Assigns offsets to each variable in the scope using the data type size, padding each one
+// to its natural alignment. Sizes are always a multiple of the alignment, so the offset is
+// aligned both as a distance below the frame base and as the end of a struct member.
 // Recurses into the child scopes to assign their variables too.
-uint32_t assign_stack_offsets(SymbolTable& symbol_table, uint32_t base_offset, size_t scope_index)
+uint32_t assign_stack_offsets(SymbolTable& symbol_table, uint32_t base_offset, size_t scope_index, bool reorder = false)
 {
 	auto& scope = symbol_table.scopes[scope_index];
-	uint32_t scope_size = 0;
-	for (size_t var_index = 0; var_index < scope.local_variables.size(); var_index++)
+
+	// Reordering places the most aligned variables first, so no padding is needed between
+	// them. The variables keep their indices, only their offsets change.
+	std::vector<size_t> order(scope.local_variables.size());
+	std::iota(order.begin(), order.end(), 0);
+	if (reorder)
+	{
+		std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+		{
+			return get_alignment(symbol_table, scope.local_variables[a].type_annotation) > get_alignment(symbol_table, scope.local_variables[b].type_annotation);
+		});
+	}
+
+	uint32_t end_offset = base_offset;
+	for (auto var_index : order)
 	{
 		auto& var = scope.local_variables[var_index];
 		auto data_size = get_data_size(symbol_table, var.type_annotation);
-		if (var_index == 0)
-			var.stack_offset = data_size + base_offset;
-		else
-			var.stack_offset = scope.local_variables[var_index - 1].stack_offset + data_size;
-		scope_size += data_size;
+		auto alignment = get_alignment(symbol_table, var.type_annotation);
+		var.stack_offset = align_up(end_offset, alignment) + data_size;
+		end_offset = var.stack_offset;
 	}
+	uint32_t scope_size = end_offset - base_offset;
 
 	// This is an inefficient way to find the child scopes
 	uint32_t biggest_child_size = 0;
@@ -36,7 +58,7 @@ uint32_t assign_stack_offsets(SymbolTable& symbol_table, uint32_t base_offset, s
 
 // Calls assign_stack_offsets on all the scopes this one depends on, and also on the current one.
 // Keeps track of which ones are visited in order to be used as part of the topsort calculation.
-void assign_stack_offsets_dependent_scopes(SymbolTable& symbol_table, size_t scope_index, std::vector<bool>& visited)
+void assign_stack_offsets_dependent_scopes(SymbolTable& symbol_table, size_t scope_index, std::vector<bool>& visited, bool reorder_struct_members)
 {
 	// Scopes which are children of other scopes can be skipped because they are handled
 	// when their parent is handled since assign_stack_offsets recurses
@@ -53,7 +75,7 @@ void assign_stack_offsets_dependent_scopes(SymbolTable& symbol_table, size_t sco
 		if (is_struct_type(symbol_table, var.type_annotation)) // will break when we have arrays - need to check if it depends on the member types not being incomplete, i.e. pointers are okay
 		{
 			if (!visited[type.scope])
-				assign_stack_offsets_dependent_scopes(symbol_table, type.scope, visited);
+				assign_stack_offsets_dependent_scopes(symbol_table, type.scope, visited, reorder_struct_members);
 		}
 	}
 
@@ -70,7 +92,7 @@ void assign_stack_offsets_dependent_scopes(SymbolTable& symbol_table, size_t sco
 			if (is_struct_type(symbol_table, var.type_annotation)) // will break when we have arrays - need to check if it depends on the member types not being incomplete, i.e. pointers are okay
 			{
 				if (!visited[type.scope])
-					assign_stack_offsets_dependent_scopes(symbol_table, type.scope, visited);
+					assign_stack_offsets_dependent_scopes(symbol_table, type.scope, visited, reorder_struct_members);
 			}
 		}
 	}
@@ -90,11 +112,17 @@ void assign_stack_offsets_dependent_scopes(SymbolTable& symbol_table, size_t sco
 		}
 	}
 
+	// A struct is aligned like its most aligned member, and padded at the end so that its
+	// size is a multiple of that
 	for (auto& type : symbol_table.types)
 	{
 		if (type.type == TypeType::Struct && type.scope == scope_index)
 		{
-			type.data_size = assign_stack_offsets(symbol_table, 0, type.scope);
+			type.alignment = 1;
+			for (auto& var : symbol_table.scopes[scope_index].local_variables)
+				type.alignment = std::max(type.alignment, get_alignment(symbol_table, var.type_annotation));
+
+			type.data_size = align_up(assign_stack_offsets(symbol_table, 0, type.scope, reorder_struct_members), type.alignment);
 			break;
 		}
 	}
@@ -102,17 +130,17 @@ void assign_stack_offsets_dependent_scopes(SymbolTable& symbol_table, size_t sco
 
 // Calls assign_stack_offsets for all scopes in the symbol table, in the order that their
 // dependencies require.
-void assign_stack_offsets_all_scopes(SymbolTable& symbol_table)
+void assign_stack_offsets_all_scopes(SymbolTable& symbol_table, bool reorder_struct_members)
 {
 	std::vector<bool> visited(symbol_table.scopes.size());
 	for (size_t unvisited = 0; unvisited < symbol_table.scopes.size(); unvisited++)
 	{
 		if (!visited[unvisited])
-			assign_stack_offsets_dependent_scopes(symbol_table, unvisited, visited);
+			assign_stack_offsets_dependent_scopes(symbol_table, unvisited, visited, reorder_struct_members);
 	}
 }
 
-void compute_sizing(SymbolTable& symbol_table)
+void compute_sizing(SymbolTable& symbol_table, bool reorder_struct_members)
 {
 	for (size_t type_index = 0; type_index < symbol_table.types.size(); type_index++)
 	{
@@ -121,7 +149,7 @@ void compute_sizing(SymbolTable& symbol_table)
 			log_error(type, "Undefined type");
 	}
 
-	assign_stack_offsets_all_scopes(symbol_table);
+	assign_stack_offsets_all_scopes(symbol_table, reorder_struct_members);
 }
 
 size_t get_data_size(SymbolTable& symbol_table, const TypeAnnotation& type_annotation)
@@ -135,4 +163,15 @@ size_t get_data_size(SymbolTable& symbol_table, const TypeAnnotation& type_annot
 	}
 
 	return size;
-}
\ No newline at end of file
+}
+
+size_t get_alignment(SymbolTable& symbol_table, const TypeAnnotation& type_annotation)
+{
+	for (int i = 0; i < type_annotation.modifiers_in_use; i++)
+	{
+		if (type_annotation.modifiers[i].type == TypeAnnotation::ModifierType::Pointer)
+			return 8;
+	}
+
+	return symbol_table.types[type_annotation.type_index].alignment;
+}
@@ -2,6 +2,12 @@
 
 #include "ast.h"
 
-void compute_sizing(SymbolTable& symbol_table);
+// Lays out struct members and function frames. Reordering the members of structs by their
+// alignment removes most of the padding, but the layout no longer matches the declaration.
+void compute_sizing(SymbolTable& symbol_table, bool reorder_struct_members = false);
 
-size_t get_data_size(SymbolTable& symbol_table, const TypeAnnotation& type_annotation);
\ No newline at end of file
+// Rounds value up to a multiple of alignment
+uint32_t align_up(uint32_t value, size_t alignment);
+
+size_t get_data_size(SymbolTable& symbol_table, const TypeAnnotation& type_annotation);
+size_t get_alignment(SymbolTable& symbol_table, const TypeAnnotation& type_annotation);
\ No newline at end of file
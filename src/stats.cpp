@@ -0,0 +1,18 @@
+#include "stats.h"
+
+#include <inttypes.h>
+#include <map>
+
+std::map<std::string, int64_t> statistics;
+
+void add_statistic(const std::string& name, int64_t amount)
+{
+	statistics[name] += amount;
+}
+
+void print_statistics(FILE* output)
+{
+	fprintf(output, "Statistics:\n");
+	for (auto& [name, value] : statistics)
+		fprintf(output, "  %-40s %10" PRId64 "\n", name.c_str(), value);
+}
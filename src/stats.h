@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+
+// Counters collected during compilation, printed with --stats
+void add_statistic(const std::string& name, int64_t amount = 1);
+void print_statistics(FILE* output);
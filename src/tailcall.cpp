@@ -0,0 +1,175 @@
+#include "optimiser.h"
+
+#include "errors.h"
+
+// A call followed by a return of its result can reuse the caller's return address:
+// the caller's frame is torn down and the callee is jumped to. A call from a function
+// to itself in that position doesn't need the jump either, it becomes a branch back
+// to the start of the function body with the arguments as the new parameters.
+
+// If the address of a frame variable is taken, the callee might still use it, so the
+// frame has to stay alive until the call returns
+bool frame_may_escape(IrFunction& function)
+{
+	for (auto& block : function.blocks)
+	{
+		for (auto& instruction : block.instructions)
+		{
+			if (instruction.opcode == IrOpcode::FrameAddress)
+				return true;
+		}
+	}
+	return false;
+}
+
+// Returns true if the instruction at index in block is a call whose result is returned straight away
+bool is_tail_call(IrBlock& block, size_t index)
+{
+	auto& instruction = block.instructions[index];
+	if (instruction.opcode == IrOpcode::TailCall)
+		return true;
+	if (instruction.opcode != IrOpcode::Call || index + 2 != block.instructions.size())
+		return false;
+
+	auto& terminator = block.terminator();
+	if (terminator.opcode != IrOpcode::Return)
+		return false;
+
+	// A function without a return value can ignore the callee's
+	return terminator.operands.empty() || terminator.operands[0] == instruction.dest;
+}
+
+void eliminate_tail_recursion(IrFunction& function, std::vector<size_t>& recursive_blocks)
+{
+	// Move the body of the entry block into a new loop header, leaving the parameters behind
+	size_t header = function.blocks.size();
+	auto& new_block = function.blocks.emplace_back();
+	auto& entry = function.blocks[0];
+
+	std::vector<int> parameters;
+	std::vector<IrInstruction> entry_instructions;
+	for (auto& instruction : entry.instructions)
+	{
+		if (instruction.opcode == IrOpcode::Parameter)
+		{
+			parameters.push_back(instruction.dest);
+			entry_instructions.push_back(std::move(instruction));
+		}
+		else
+			new_block.instructions.push_back(std::move(instruction));
+	}
+	entry.instructions = std::move(entry_instructions);
+
+	IrInstruction jump;
+	jump.opcode = IrOpcode::Jump;
+	jump.targets = { header };
+	entry.instructions.push_back(jump);
+
+	for (auto successor : new_block.terminator().targets)
+	{
+		for (auto& instruction : function.blocks[successor].instructions)
+		{
+			for (auto& phi_block : instruction.phi_blocks)
+			{
+				if (phi_block == 0)
+					phi_block = header;
+			}
+		}
+	}
+
+	for (auto& b : recursive_blocks)
+	{
+		if (b == 0)
+			b = header;
+	}
+
+	// Parameters are now phis in the header
+	std::vector<int> replacements(function.value_types.size(), -1);
+	std::vector<IrInstruction> phis;
+	for (auto parameter : parameters)
+	{
+		IrType type = function.value_types[parameter];
+		auto& phi = phis.emplace_back();
+		phi.opcode = IrOpcode::Phi;
+		phi.type = type;
+		phi.dest = function.make_value(type);
+		phi.operands = { parameter };
+		phi.phi_blocks = { 0 };
+	}
+	replacements.resize(function.value_types.size(), -1);
+	for (size_t i = 0; i < parameters.size(); i++)
+		replacements[parameters[i]] = phis[i].dest;
+	replace_values(function, replacements);
+
+	// The recursive calls pass their arguments to the phis and branch to the header
+	for (auto b : recursive_blocks)
+	{
+		auto& instructions = function.blocks[b].instructions;
+		size_t call_index = instructions.back().opcode == IrOpcode::TailCall ? instructions.size() - 1 : instructions.size() - 2;
+		auto& call = instructions[call_index];
+
+		if (call.operands.size() != phis.size())
+			internal_error("Recursive call has the wrong number of arguments");
+
+		for (size_t i = 0; i < phis.size(); i++)
+		{
+			phis[i].operands.push_back(call.operands[i]);
+			phis[i].phi_blocks.push_back(b);
+		}
+
+		instructions.resize(call_index);
+		instructions.push_back(jump);
+	}
+
+	auto& header_instructions = function.blocks[header].instructions;
+	header_instructions.insert(header_instructions.begin(), phis.begin(), phis.end());
+
+	compute_predecessors(function);
+	remove_trivial_phis(function);
+}
+
+bool optimise_tail_calls(IrFunction& function)
+{
+	if (frame_may_escape(function))
+		return false;
+
+	bool changed = false;
+	std::vector<size_t> recursive_blocks;
+	for (size_t b = 0; b < function.blocks.size(); b++)
+	{
+		auto& block = function.blocks[b];
+		if (block.instructions.size() < 2 && block.terminator().opcode != IrOpcode::TailCall)
+			continue;
+
+		size_t index = block.terminator().opcode == IrOpcode::TailCall ? block.instructions.size() - 1 : block.instructions.size() - 2;
+		if (!is_tail_call(block, index))
+			continue;
+
+		if (block.instructions[index].symbol == function.asm_name)
+		{
+			recursive_blocks.push_back(b);
+			continue;
+		}
+
+		// Other calls become tail calls, replacing the return
+		if (block.instructions[index].opcode == IrOpcode::Call)
+		{
+			auto& call = block.instructions[index];
+			call.opcode = IrOpcode::TailCall;
+			call.type = IrType::None;
+			call.dest = -1;
+			call.address = IrAddress();
+			call.result_types.clear();
+			block.instructions.pop_back();
+			changed = true;
+		}
+	}
+
+	if (!recursive_blocks.empty())
+	{
+		eliminate_tail_recursion(function, recursive_blocks);
+		changed = true;
+	}
+
+	return changed;
+}
@@ -24,20 +24,20 @@
 
 bool quiet = true;
 
-bool run_test(const char* input_file, int expected_error, const char* expected_output)
+bool run_test(const char* input_file, const char* flags, int expected_error, const char* expected_output)
 {
-	if (!quiet) printf("%s... ", input_file);
+	if (!quiet) printf("%s %s... ", input_file, flags);
 	const char* executable_name = std::tmpnam(nullptr);
 
 	bool success = [&]()
 	{
 		char compiler_command[1024];
-		snprintf(compiler_command, 1024, "./inkc %s -o %s", input_file, executable_name);
+		snprintf(compiler_command, 1024, "./inkc %s %s -o %s", input_file, flags, executable_name);
 		std::string compiler_output;
 		int compiler_error = exec_process(compiler_command, compiler_output);
 		if (compiler_error != expected_error)
 		{
-			if (quiet) printf("%s... ", input_file);
+			if (quiet) printf("%s %s... ", input_file, flags);
 			printf("%sFailed!%s\n", CONSOLE_RED, CONSOLE_NRM);
 			printf("Compiler returned %d instead of expected %d\n", compiler_error, expected_error);
 			if (!compiler_output.empty()) printf("Compiler output:\n%s", compiler_output.c_str());
@@ -58,7 +58,7 @@ bool run_test(const char* input_file, int expected_error, const char* expected_o
 		int runtime_error = exec_process(runtime_command, runtime_output);
 		if (runtime_error != 0)
 		{
-			if (quiet) printf("%s... ", input_file);
+			if (quiet) printf("%s %s... ", input_file, flags);
 			printf("%sFailed!%s\n", CONSOLE_RED, CONSOLE_NRM);
 			printf("Program returned %d\n", runtime_error);
 			printf("Program output:\n%s\n", runtime_output.c_str());
@@ -67,7 +67,7 @@ bool run_test(const char* input_file, int expected_error, const char* expected_o
 
 		if (strcmp(runtime_output.c_str(), expected_output) != 0)
 		{
-			if (quiet) printf("%s... ", input_file);
+			if (quiet) printf("%s %s... ", input_file, flags);
 			printf("%sFailed!%s\n", CONSOLE_RED, CONSOLE_NRM);
 			printf("Program output:\n%s\n", runtime_output.c_str());
 			return false;
@@ -86,10 +86,14 @@ bool run_test(const char* input_file, int expected_error, const char* expected_o
 struct TestData
 {
 	std::string source_file;
+	std::string flags;
 	int expected_error;
 	std::string expected_output;
 };
 
+// Programs which compile are run at every optimisation level
+const char* optimisation_flags[] = { "-O0", "-O1", "-O2" };
+
 int main(int argc, const char** argv)
 {
 	if (argc > 1)
@@ -106,7 +110,14 @@ int main(int argc, const char** argv)
 	std::vector<TestData> tests;
 	auto add_test = [&tests](const std::string& src, int error, const std::string& output = "")
 	{
-		tests.push_back({ src, error, output });
+		if (error != 0)
+		{
+			tests.push_back({ src, "", error, output });
+			return;
+		}
+
+		for (auto flags : optimisation_flags)
+			tests.push_back({ src, flags, error, output });
 	};
 
 	std::string keyword = "@test ";
@@ -196,7 +207,7 @@ int main(int argc, const char** argv)
 	for (size_t i = 0; i < num_tests; i++)
 	{
 		if (!quiet) printf("[%zu/%zu] ", i + 1, num_tests);
-		bool pass = run_test(tests[i].source_file.c_str(), tests[i].expected_error, tests[i].expected_output.c_str());
+		bool pass = run_test(tests[i].source_file.c_str(), tests[i].flags.c_str(), tests[i].expected_error, tests[i].expected_output.c_str());
 		if (pass)
 			num_pass += 1;
 		else
@@ -211,7 +222,7 @@ int main(int argc, const char** argv)
 	{
 		printf("\nFailures:\n");
 		for (auto& i : failures)
-			printf("%s\n", tests[i].source_file.c_str());
+			printf("%s %s\n", tests[i].source_file.c_str(), tests[i].flags.c_str());
 	}
 
 	return 0;
@@ -276,7 +276,7 @@ void type_check_ast(SymbolTable& symbol_table, Ast& ast, size_t index, std::opti
 
 		return;
 	}
-	else if (ast[index].type == AstNodeType::ZeroInitialise)
+	else if (ast[index].type == AstNodeType::ZeroInitialise || ast[index].type == AstNodeType::Uninitialised)
 	{
 		type_check_ast(symbol_table, ast, ast[index].child0, return_type);
 
@@ -308,6 +308,12 @@ void type_check_ast(SymbolTable& symbol_table, Ast& ast, size_t index, std::opti
 				log_error(ast[ast[index].aux.value()], "Function doesn't return a value");
 		}
 
+		if (ast[index].data_return.tail_call)
+		{
+			if (!ast[index].aux.has_value() || ast[ast[index].aux.value()].type != AstNodeType::FunctionCall)
+				log_error(ast[index], "Only a function call can be a tail call");
+		}
+
 		return;
 	}
 	else if (ast[index].type == AstNodeType::ExpressionStatement)
@@ -13,4 +13,32 @@ void print_int_double(int x, double y)
 double sum_doubles(double x, double y)
 {
 	return x + y;
-}
\ No newline at end of file
+}
+
+typedef struct { float x; float y; } Vec2f;
+typedef struct { unsigned long long id; double weight; } Item;
+typedef struct { double x; double y; double z; } Vec3d;
+
+Vec2f scale_vec2f(Vec2f v, float s)
+{
+	Vec2f result = { v.x * s, v.y * s };
+	return result;
+}
+
+Item heavier_item(Item item, double extra)
+{
+	item.id += 1;
+	item.weight += extra;
+	return item;
+}
+
+Vec3d make_vec3d(double x, double y, double z)
+{
+	Vec3d result = { x, y, z };
+	return result;
+}
+
+void print_vec2f(Vec2f v)
+{
+	printf("%f %f\n", v.x, v.y);
+}